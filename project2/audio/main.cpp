@@ -3,44 +3,68 @@
 #include <iostream>
 #include "./t1.cpp"
 #include "./t2.cpp"
+#include "../include/cxxopts.hpp"
 using namespace std;
 
 
 
-// Save WAV file
-void save_wav(const char* output_filename, const vector<int16_t>& data, int sample_rate, int channels) {
+// Bits per sample of a PCM input file, 0 for formats the codec can't keep losslessly (32-bit, float)
+int sample_bits_of(const SF_INFO& sfinfo) {
+    switch (sfinfo.format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8: return 8;
+        case SF_FORMAT_PCM_16: return 16;
+        case SF_FORMAT_PCM_24: return 24;
+        default: return 0;
+    }
+}
+
+// Open a WAV file of `sample_bits`-bit samples (8, 16 or 24) for writing, chunk by chunk
+SNDFILE* create_wav(const char* output_filename, int sample_rate, int channels, int sample_bits) {
     SF_INFO sfinfo = { 0 };
     sfinfo.samplerate = sample_rate;
     sfinfo.channels = channels;
-    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+    sfinfo.format = SF_FORMAT_WAV | (sample_bits <= 8 ? SF_FORMAT_PCM_U8 : sample_bits <= 16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24);
 
     SNDFILE* sf_out = sf_open(output_filename, SFM_WRITE, &sfinfo);
     if (!sf_out) {
         cerr << "Error: Could not open output WAV file." << endl;
-        return;
     }
-
-    sf_writef_short(sf_out, data.data(), data.size() / channels);
-    sf_close(sf_out);
+    return sf_out;
 }
 
 
 
 
-double calculate_snr(const std::vector<int16_t>& original, const std::vector<int16_t>& reconstructed) {
-    if (original.size() != reconstructed.size()) {
+// SNR of a reconstructed file against the original, read side by side a chunk at a time
+double calculate_snr(const char* original_filename, const char* reconstructed_filename) {
+    SF_INFO original_info = { 0 }, reconstructed_info = { 0 };
+    SNDFILE* original = sf_open(original_filename, SFM_READ, &original_info);
+    SNDFILE* reconstructed = sf_open(reconstructed_filename, SFM_READ, &reconstructed_info);
+    if (!original || !reconstructed || original_info.frames != reconstructed_info.frames ||
+        original_info.channels != reconstructed_info.channels) {
         std::cerr << "Error: Original and reconstructed signals must have the same size." << std::endl;
+        if (original) sf_close(original);
+        if (reconstructed) sf_close(reconstructed);
         return -1; // Return an error value
     }
 
     double signal_power = 0.0;
     double noise_power = 0.0;
 
-    for (size_t i = 0; i < original.size(); ++i) {
-        signal_power += original[i] * original[i];
-        double noise = original[i] - reconstructed[i];
-        noise_power += noise * noise;
+    int channels = original_info.channels;
+    vector<int> a(CHUNK_FRAMES * channels), b(CHUNK_FRAMES * channels);
+    sf_count_t count;
+    while ((count = sf_readf_int(original, a.data(), CHUNK_FRAMES)) > 0) {
+        sf_readf_int(reconstructed, b.data(), count);
+        for (sf_count_t i = 0; i < count * channels; ++i) {
+            signal_power += double(a[i]) * a[i];
+            double noise = double(a[i]) - b[i];
+            noise_power += noise * noise;
+        }
     }
+    sf_close(original);
+    sf_close(reconstructed);
 
     if (noise_power == 0) {
         // std::cerr << "Warning: Noise power is zero. SNR is infinite." << std::endl;
@@ -55,139 +79,177 @@ double calculate_snr(const std::vector<int16_t>& original, const std::vector<int
 
 
 
-int predict_sample(const int16_t* buffer,int channels, int n, int order) {
-    if (order == 0) return 0;
-
-    // Adjust indexing for stereo
-    int step = channels; // Each frame has two samples (left and right) if it is stereo
-
-    if (order == 1) return buffer[n - step ];
-    if (order == 2) return 2 * buffer[n - step] - buffer[n - 2 * step];
-    if (order == 3) return 3 * buffer[n - step] - 3 * buffer[n - 2 * step] + buffer[n - 3 * step];
-    if (order == 4) return buffer[n - step] + (buffer[n - step] - buffer[n - 2*step]);
+// Fixed polynomial prediction of sample[0] from the `order` samples before it in the same channel (planar, unit stride)
+int predict_sample(const int* sample, int order) {
+    if (order == 1) return sample[-1];
+    if (order == 2) return 2 * sample[-1] - sample[-2];
+    if (order == 3) return 3 * sample[-1] - 3 * sample[-2] + sample[-3];
+    if (order == 4) return 4 * sample[-1] - 6 * sample[-2] + 4 * sample[-3] - sample[-4];
     return 0; // Default fallback
 }
 
-int16_t quantize_sample(int16_t sample, int num_bits) {
-
-    int16_t diff = 16-num_bits;
-    int16_t quantized_sample = sample >> diff ;
+// Residual to the nearest multiple of step, rounding half away from zero (a plain >> would bias every residual down)
+int quantize_sample(int sample, int step) {
+    int half = step / 2;
+    return sample >= 0 ? (sample + half) / step : -((half - sample) / step);
+}
 
-    return quantized_sample;
+int dequantize_sample(int sample, int step) {
+    return sample * step;
 }
 
-int16_t dequantize_sample(int16_t sample, int num_bits) {
+// Rice spends at least 2 bits on any residual (sign and end of unary) plus the remainder bits of a fixed M, a floor on the lossy bitrate
+void warn_rice_floor(const AudioContainer& container) {
+    double floor = static_cast<double>(Golomb::codeLength(0, max(container.golombM, 1), 0)) * container.sampleRate * container.channels;
+    if (container.backend == EntropyBackend::Rice && container.targetBitrate > 0 && container.targetBitrate < floor) {
+        cerr << "Warning: Rice coding can't go below " << floor / 1000 << " kbps here, try -e rans or arithmetic" << endl;
+    }
+}
 
-    int16_t diff = 16-num_bits;
-    int16_t dequantized_sample = sample << diff;
+// Encode an opened WAV file into a self-describing file: the container header, then the payload
+void encode_file(SNDFILE* input, const AudioContainer& container, const string& output_file) {
+    ofstream output(output_file, ios::binary);
+    if (!output) {
+        throw runtime_error("Unable to open file: " + output_file);
+    }
+    container.write(output);
+    if (container.mode == AudioContainer::Mode::Lossless) {
+        encode_audio(input, container, output);
+    } else {
+        encode_audio_lossy(input, container, output);
+    }
+    if (!output) {
+        throw runtime_error("Unable to write file: " + output_file);
+    }
+}
 
-    return dequantized_sample;
+// Decode frames [first, first + count) of an encoded file into a WAV file; count -1 decodes to the end
+void decode_file(const string& input_file, const string& output_file, int first = 0, int count = -1) {
+    ifstream input(input_file, ios::binary);
+    if (!input) {
+        throw runtime_error("Unable to open file: " + input_file);
+    }
+    AudioContainer container = AudioContainer::read(input);
+    if (count < 0) count = container.frames - first;
+    if (first < 0 || count < 0 || first + count > container.frames) {
+        throw invalid_argument("Frame range outside the file");
+    }
+    SNDFILE* output = create_wav(output_file.c_str(), container.sampleRate, container.channels, container.bitsPerSample);
+    if (!output) {
+        throw runtime_error("Unable to open file: " + output_file);
+    }
+    try {
+        if (container.mode == AudioContainer::Mode::Lossless) {
+            decode_audio(container, input, output, first, count);
+        } else {
+            decode_audio_lossy(container, input, output, first, count);
+        }
+    } catch (...) {
+        sf_close(output);
+        throw;
+    }
+    sf_close(output);
 }
 
-// Calculate dynamic M
-int calculate_dynamic_m(int16_t* buffer, int frames,int channels, bool isLossless,int predictor_order,int num_bits) {
-    vector<int16_t> prediction_errors;
-    if(isLossless){
-        for (int i = 0; i < predictor_order; i++) {
-            if(channels == 2){
-                prediction_errors.push_back(buffer[i * 2]);     // Left channel
-                prediction_errors.push_back(buffer[i * 2 + 1]); // Right channel
-            }
-            else
-                prediction_errors.push_back(buffer[i]);     // Left channel
+/*
+ * Non-interactive audio coding for batch jobs, e.g.
+ *   ./main encode -i in.wav -o in.bin --order 32
+ *   ./main encode -i in.wav -o in.bin --lossy --bitrate 256 --noise-shaping -e rans
+ *   ./main decode -i in.bin -o out.wav [--start 44100 --frames 441000]
+ * Encoded files carry their format and codec parameters, so decode needs
+ * nothing else.
+ */
+int runAudioCommand(int argc, char* argv[]) {
+    cxxopts::Options options("main", "Audio encode / decode");
+    options.add_options()
+        ("command", "encode or decode", cxxopts::value<string>())
+        ("i,input", "WAV input (encode) or encoded file (decode)", cxxopts::value<string>())
+        ("o,output", "Encoded file (encode) or WAV output (decode)", cxxopts::value<string>())
+        ("lossy", "Lossy coding (encode)")
+        ("p,order", "Predictor order, 1 to 32 (lossless, default 8) or 4 (lossy, default 3)", cxxopts::value<int>())
+        ("m,golomb", "Golomb parameter, 0 to choose it (per block when lossless)", cxxopts::value<int>()->default_value("0"))
+        ("e,entropy", "Entropy coder: rice, arithmetic or rans (encode)", cxxopts::value<string>()->default_value("rice"))
+        ("bits", "Bits kept per sample, a constant step (lossy)", cxxopts::value<int>()->default_value("8"))
+        ("bitrate", "Target bitrate in kbps, the step adapting per block; overrides --bits (lossy)", cxxopts::value<double>()->default_value("0"))
+        ("noise-shaping", "First-order noise shaping (lossy)")
+        ("start", "First frame to decode", cxxopts::value<int>()->default_value("0"))
+        ("frames", "Number of frames to decode, -1 to the end", cxxopts::value<int>()->default_value("-1"))
+        ("h,help", "Print usage");
+    options.parse_positional({"command"});
+    options.positional_help("encode|decode");
+
+    try {
+        auto args = options.parse(argc, argv);
+        if (args.count("help") || !args.count("command") || !args.count("input") || !args.count("output")) {
+            cerr << options.help() << endl;
+            return args.count("help") ? 0 : 1;
         }
-        for (int i = predictor_order; i < frames; i++) {
-            if(channels == 2){
-                int left_idx = i * 2;
-                int right_idx = i * 2 + 1;
-
-                int16_t prediction_left = predict_sample(buffer, channels,left_idx, predictor_order);
-                int16_t residual_left = buffer[left_idx] - prediction_left;
-                prediction_errors.push_back(abs(residual_left));
-
-                int16_t prediction_right = predict_sample(buffer, channels, right_idx, predictor_order);
-                int16_t residual_right = buffer[right_idx] - prediction_right;
-                prediction_errors.push_back(abs(residual_right));
-            }
-            else{
-                int16_t prediction = predict_sample(buffer, channels,i, predictor_order);
-                int16_t residual = buffer[i] - prediction;
-                prediction_errors.push_back(abs(residual));
-            }
+        string command = args["command"].as<string>();
+        string input = args["input"].as<string>();
+        string output = args["output"].as<string>();
+        if (command == "decode") {
+            decode_file(input, output, args["start"].as<int>(), args["frames"].as<int>());
+            return 0;
         }
-    }
-    else{
-        int16_t *buffercpy = new int16_t[frames * channels];   
-        memcpy(buffercpy,buffer,frames*channels*sizeof(int16_t));  // make a copy of the buffer with the original data
-
-        for (int i = 0; i < predictor_order; i++) {
-            // quantized the samples to have the "num_bits" data rate
-            if(channels == 2){
-                int16_t left_sample = quantize_sample(buffer[i * 2],num_bits);      
-                int16_t right_sample = quantize_sample(buffer[i * 2 + 1],num_bits);
-
-                prediction_errors.push_back(left_sample);     // Left channel
-                prediction_errors.push_back(right_sample); // Right channel
-
-                // save the samples after reversing the quantization in the buffer, in order to have the same samples in the encoder and decoder
-                buffercpy[i*2] = dequantize_sample(left_sample,num_bits);           
-                buffercpy[i*2+1] = dequantize_sample(right_sample,num_bits);
-            }
-            else{
-                int16_t sample = quantize_sample(buffer[i],num_bits);      
-                prediction_errors.push_back(sample); 
-                buffercpy[i] = dequantize_sample(sample,num_bits);           
-            }
+        if (command != "encode") {
+            throw invalid_argument("Unknown command: " + command);
         }
-        // Encode residuals with prediction
-        for (int i = predictor_order; i < frames; i++) {
-            if(channels == 2) {
-                int left_idx = i * 2;
-                int right_idx = i * 2 + 1;
-
-                int16_t prediction_left = predict_sample(buffercpy, channels, left_idx, predictor_order);
-                int16_t residual_left = buffercpy[left_idx] - prediction_left;
-                residual_left = quantize_sample(residual_left,num_bits);
-                prediction_errors.push_back(abs(residual_left));
-                buffercpy[left_idx] = prediction_left+dequantize_sample( residual_left,num_bits);     
-                
-                int16_t prediction_right = predict_sample(buffercpy, channels, right_idx, predictor_order);
-                int16_t residual_right = buffercpy[right_idx] - prediction_right;
-                residual_right = quantize_sample(residual_right,num_bits);
-                buffercpy[right_idx] = prediction_right+dequantize_sample(residual_right,num_bits);     
-                prediction_errors.push_back(abs(residual_right));
-            }
-            else{
-                int16_t prediction = predict_sample(buffercpy, channels, i, predictor_order);
-                int16_t residual = buffercpy[i] - prediction;
-                residual = quantize_sample(residual,num_bits);
-                prediction_errors.push_back(abs(residual));
-                buffercpy[i] = prediction+dequantize_sample( residual,num_bits);     
+
+        SF_INFO sfinfo = { 0 };
+        SNDFILE* sf = sf_open(input.c_str(), SFM_READ, &sfinfo);
+        if (!sf) {
+            throw runtime_error("Unable to open file: " + input);
+        }
+        AudioContainer container;
+        container.sampleRate = sfinfo.samplerate;
+        container.channels = sfinfo.channels;
+        container.bitsPerSample = sample_bits_of(sfinfo);
+        container.frames = static_cast<int>(sfinfo.frames);
+        container.mode = args.count("lossy") ? AudioContainer::Mode::Lossy : AudioContainer::Mode::Lossless;
+        container.backend = parseEntropyBackend(args["entropy"].as<string>());
+        container.golombM = args["golomb"].as<int>();
+        bool lossy = container.mode == AudioContainer::Mode::Lossy;
+        container.predictorOrder = args.count("order") ? args["order"].as<int>() : (lossy ? 3 : 8);
+        if (container.bitsPerSample == 0) {
+            sf_close(sf);
+            throw invalid_argument("Only 8, 16 and 24-bit PCM input is supported");
+        }
+        if (container.predictorOrder < 1 || container.predictorOrder > (lossy ? 4 : 32)) {
+            sf_close(sf);
+            throw invalid_argument("Predictor order must be between 1 and " + to_string(lossy ? 4 : 32));
+        }
+        if (lossy) {
+            double bitrate = args["bitrate"].as<double>();
+            if (bitrate < 0 || bitrate * 1000 > INT_MAX) {
+                sf_close(sf);
+                throw invalid_argument("Bitrate out of range");
             }
+            container.targetBitrate = static_cast<int>(bitrate * 1000);
+            container.quantizedBits = min(max(args["bits"].as<int>(), 1), container.bitsPerSample);
+            container.noiseShaping = args.count("noise-shaping") > 0;
+            warn_rice_floor(container);
         }
-        free(buffercpy);
-    }
-    double mean_error = 0;
-    for (int16_t error : prediction_errors) {
-        // cout << error << endl;
-        mean_error += error;
+        try {
+            encode_file(sf, container, output);
+        } catch (...) {
+            sf_close(sf);
+            throw;
+        }
+        sf_close(sf);
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
     }
-    mean_error /= prediction_errors.size();
-
-    int dynamic_m = (int)pow(2, ceil(log2(mean_error)));
-    dynamic_m = max(dynamic_m, 2); // Ensure M is at least 2
-    return dynamic_m;
+    return 0;
 }
 
-
-
-
-
-
-
 int main(int argc, char* argv[]){
+    if (argc > 1 && (string(argv[1]) == "encode" || string(argv[1]) == "decode" || argv[1][0] == '-')) {
+        return runAudioCommand(argc, argv);
+    }
     if (argc < 2) {
         cout << "Usage: ./main <audio_file>" << endl;
+        cout << "   or: ./main encode|decode -i <input> -o <output> [options], see ./main --help" << endl;
         cout << "Example: ./main audio_samples/sample01.wav" << endl;
         return 1;
     }
@@ -205,15 +267,19 @@ int main(int argc, char* argv[]){
     int sample_rate = sfinfo.samplerate;
     int channels = sfinfo.channels;
     int frames = sfinfo.frames;
+    int sample_bits = sample_bits_of(sfinfo);
 
     cout << "Sample rate: " << sample_rate << endl;
     cout << "Channels: " << channels << endl;
     cout << "Frames: " << frames << endl;
+    cout << "Bits per sample: " << sample_bits << endl;
+    if (sample_bits == 0) {
+        cerr << "Only 8, 16 and 24-bit PCM input is supported" << endl;
+        sf_close(sf);
+        return 1;
+    }
 
 
-    int16_t* buffer = new int16_t[frames * channels];
-    sf_readf_short(sf, buffer, frames);
-
     string input;
     // ask if the user wants to give an M value for the Golomb (default 'N')
     printf("Would you like to give an M value? [y/N] ");
@@ -237,37 +303,79 @@ int main(int argc, char* argv[]){
 
     bool isLossless = (input == "1");
     int predictor_order = 3; // Default predictor order
-    cout << "Number of previous samples to use in the predictor (1 to 4): ";
+    // Lossless blocks also try a linear predictor (LPC) of up to this order; the lossy path has the fixed ones only
+    int max_order = isLossless ? 32 : 4;
+    cout << "Number of previous samples to use in the predictor (1 to " << max_order << "): ";
     cin >> predictor_order;
-    if(predictor_order > 4) predictor_order = 4;
+    if(predictor_order > max_order) predictor_order = max_order;
     else if(predictor_order < 1) predictor_order = 1;
     cout << "predictor_order: " << predictor_order << endl;
-    int target_bitrate;     
-    int num_bits = 16;      // number of bits that each sample will have 
+    int target_bitrate = 0;     
+    bool noise_shaping = false;
 
     if (!isLossless) {
-        cout << "Enter desired bitrate: ";
+        // The quantization step adapts per block to hold this rate
+        cout << "Enter desired bitrate (bits per second): ";
         cin >> target_bitrate;
-
-        while(target_bitrate <= sample_rate*num_bits*channels)   num_bits--;
-        cout << "new number of bits per sample: " << num_bits << endl;
+        target_bitrate = max(target_bitrate, 1);
+        cout << "Use noise shaping? [y/N] ";
+        cin >> input;
+        noise_shaping = input == "y" || input == "Y";
     }
 
+    cout << "Choose entropy coder:\n"
+         << "1. Rice (Golomb)\n"
+         << "2. rANS\n"
+         << "3. Arithmetic\n"
+         << "Enter your choice: ";
+    cin >> input;
+    EntropyBackend backend = EntropyBackend::Rice;
+    if (input == "2") backend = EntropyBackend::Rans;
+    else if (input == "3") backend = EntropyBackend::Arithmetic;
+    cout << "Entropy coder: " << entropyBackendName(backend) << endl;
+
     if (dynamicM) {
-        M = calculate_dynamic_m(buffer, frames, channels, isLossless, predictor_order, num_bits);
+        M = 0;  // chosen per block
+        cout << "Using M: chosen per block" << endl;
+    } else {
+        cout << "Using M: " << M << endl;
     }
 
-    cout << "Using M: " << M << endl;
-
-    if (isLossless) {
-        cout << "Performing lossless encoding...\n";
-        perform_lossless_encoding(buffer, frames, M, predictor_order, sample_rate, channels);
-    } else {
-        cout << "Performing lossy encoding...\n";
-        perform_lossy_encoding(buffer, frames, M, predictor_order, num_bits, sample_rate, channels);
+    AudioContainer container;
+    container.sampleRate = sample_rate;
+    container.channels = channels;
+    container.bitsPerSample = sample_bits;
+    container.frames = frames;
+    container.mode = isLossless ? AudioContainer::Mode::Lossless : AudioContainer::Mode::Lossy;
+    container.backend = backend;
+    container.predictorOrder = predictor_order;
+    container.golombM = M;
+    container.targetBitrate = target_bitrate;
+    container.noiseShaping = noise_shaping;
+    warn_rice_floor(container);
+
+    try {
+        if (isLossless) {
+            cout << "Performing lossless encoding...\n";
+            encode_file(sf, container, "error.bin");
+            decode_file("error.bin", "reconstructed.wav");
+            cout << "Successfully generated 'reconstructed.wav' using lossless predictive coding!" << endl;
+        } else {
+            cout << "Performing lossy encoding...\n";
+            encode_file(sf, container, "error_lossy.bin");
+            decode_file("error_lossy.bin", "reconstructed_lossy.wav");
+            cout << "Successfully generated 'reconstructed_lossy.wav' using lossy predictive coding!" << endl;
+            ifstream encoded("error_lossy.bin", ios::binary | ios::ate);
+            cout << "Bitrate: " << 8.0 * encoded.tellg() * sample_rate / max(frames, 1) / 1000 << " kbps" << endl;
+            double snr = calculate_snr(filename, "reconstructed_lossy.wav");
+            cout << "Signal-to-Noise Ratio (SNR): " << snr << " dB" << endl;
+        }
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        sf_close(sf);
+        return 1;
     }
 
     sf_close(sf);
-    delete[] buffer;
     return 0;
 }
\ No newline at end of file
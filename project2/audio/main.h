@@ -1,11 +1,15 @@
 #include <stdint.h>
 #include <vector>
 #include <cmath>
+#include <sndfile.h>
 
-int predict_sample(const int16_t* buffer, int channels, int n, int order);
-int16_t quantize_sample(int16_t sample, int num_bits);
-int16_t dequantize_sample(int16_t sample, int num_bits);
-int calculate_dynamic_m(int16_t* buffer, int frames, int channels, bool isLossless, int predictor_order, int num_bits);
-void save_wav(const char* output_filename, const vector<int16_t>& data, int sample_rate, int channels);
-double calculate_snr(const std::vector<int16_t>& original, const std::vector<int16_t>& reconstructed);
+#define CHUNK_FRAMES 65536  // frames read, coded and written at a time, so memory doesn't grow with the file
+
+int predict_sample(const int* sample, int order);
+int quantize_sample(int sample, int step);
+int dequantize_sample(int sample, int step);
+int read_frames(SNDFILE* input, int32_t* samples, int count, int channels, int sample_bits);
+void write_frames(SNDFILE* output, const int32_t* samples, int count, int channels, int sample_bits, std::vector<int32_t>& scratch);
+SNDFILE* create_wav(const char* output_filename, int sample_rate, int channels, int sample_bits);
+double calculate_snr(const char* original_filename, const char* reconstructed_filename);
 
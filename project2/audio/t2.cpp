@@ -6,135 +6,321 @@
 #include <chrono>
 #include <cmath>
 #include <cstring>
-#include "../include/Golomb.h"
+#include "../include/entropy_backend.h"
+#include "../include/audio_container.h"
 #include "./main.h"
 
 #define DEFAULT_M_VALUE 32768
+#define LOSSY_BLOCK_FRAMES 4096  // frames sharing a quantization step, a divisor of CHUNK_FRAMES
+#define HEADER_M 16              // Golomb parameter of the block headers (step index, Rice shifts)
+#define MAX_RICE_SHIFT 29        // largest per-channel Rice shift of a lossy block
 
 using namespace std;
 namespace fs = filesystem;
 using namespace chrono;
 
 
-// Encode audio
-void encode_audio_lossy(int16_t* buffer, int frames,int channels, int M, const string& output_file, int predictor_order, int num_bits) {
-    Golomb encoder(M, false, output_file);
-
-    // Encode first samples (no prediction for these)
-    for (int i = 0; i < predictor_order; i++) {
-        if(channels == 2){
-            // quantized the samples to have the "num_bits" data rate
-            int16_t left_sample = quantize_sample(buffer[i * 2],num_bits);
-            int16_t right_sample = quantize_sample(buffer[i * 2 + 1],num_bits);
-
-            encoder.encode(left_sample);     // Left channel
-            encoder.encode(right_sample); // Right channel
-                
-            // save the samples after reversing the quantization in the buffer, in order to have the same samples in the encoder and decoder
-            buffer[i*2] = dequantize_sample(left_sample,num_bits);
-            buffer[i*2+1] = dequantize_sample(right_sample,num_bits);
-        }
-        else{
-            int16_t sample = quantize_sample(buffer[i],num_bits);
-            encoder.encode(sample);
-            buffer[i] = dequantize_sample(sample,num_bits);
+/*
+ * The lossy coder works on planar chunks: channel c's samples are
+ * window[c * stride + predictor_order + i], behind `predictor_order`
+ * reconstructed samples of history, stride = predictor_order + CHUNK_FRAMES.
+ */
+void load_chunk(const int32_t* interleaved, int frames, int channels, int predictor_order, vector<int>& window) {
+    int stride = predictor_order + CHUNK_FRAMES;
+    for (int c = 0; c < channels; c++) {
+        int* x = window.data() + c * stride + predictor_order;
+        for (int i = 0; i < frames; i++) {
+            x[i] = interleaved[i * channels + c];
         }
     }
+}
 
-    
-    // Encode residuals with prediction
-    for (int i = predictor_order; i < frames; i++) {
-        if(channels == 2){
-            int left_idx = i * 2;
-            int right_idx = i * 2 + 1;
-
-            int16_t prediction_left = predict_sample(buffer, channels, left_idx, predictor_order);
-            int16_t residual_left = buffer[left_idx] - prediction_left;
-            residual_left = quantize_sample(residual_left,num_bits);
-            encoder.encode(residual_left);
-            buffer[left_idx] = prediction_left+dequantize_sample( residual_left,num_bits);      // alter the buffer position so we dont have the error propagation
-            
-            int16_t prediction_right = predict_sample(buffer, channels, right_idx, predictor_order);
-            int16_t residual_right = buffer[right_idx] - prediction_right;
-            residual_right = quantize_sample(residual_right,num_bits);
-            buffer[right_idx] = prediction_right+dequantize_sample(residual_right,num_bits);      // alter the buffer position so we dont have the error propagation
-            encoder.encode(residual_right);
-        }
-        else{
-            int16_t prediction = predict_sample(buffer, channels, i, predictor_order);
-            int16_t residual = buffer[i] - prediction;
-            residual = quantize_sample(residual,num_bits);
-            buffer[i] = prediction + dequantize_sample(residual,num_bits);      // alter the buffer position so we dont have the error propagation
-            encoder.encode(residual);
+void store_chunk(const vector<int>& window, int frames, int channels, int predictor_order, vector<int32_t>& interleaved) {
+    int stride = predictor_order + CHUNK_FRAMES;
+    interleaved.resize(static_cast<size_t>(frames) * channels);
+    for (int c = 0; c < channels; c++) {
+        const int* x = window.data() + c * stride + predictor_order;
+        for (int i = 0; i < frames; i++) {
+            interleaved[i * channels + c] = x[i];
         }
     }
+}
 
-    encoder.end();
+// Step of step index k, four per octave: 1, 1, 1, 1, 2, 2, 3, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, ...
+int lossy_step(int k) {
+    return ((4 + (k & 3)) << (k >> 2)) >> 2;
 }
 
-vector<int16_t> decode_audio_lossy(int M, const string& input_file, int frames, int channels, int predictor_order,int num_bits) {
-    Golomb decoder(M, true, input_file);
-    vector<int> residuals = decoder.decode();
-    decoder.end();
-
-    vector<int16_t> decoded;
-    // Decode first samples directly
-    for (int i = 0; i < predictor_order; i++) {
-        if(channels == 2){
-            decoded.push_back(dequantize_sample(residuals[i * 2],num_bits));     // Left channel
-            decoded.push_back(dequantize_sample(residuals[i * 2 + 1],num_bits) ); // Right channel
-        }
-        else{
-            decoded.push_back(dequantize_sample(residuals[i],num_bits));     // Left channel
+// Largest step index for samples of sample_bits bits (a step of half the range)
+int max_step_index(int sample_bits) {
+    return 4 * (sample_bits - 1);
+}
+
+// What the decoder makes of a prediction and a quantized residual, kept to the sample range
+int reconstruct_sample(int prediction, int residual, int step, int sample_bits) {
+    int low = -(1 << (sample_bits - 1)), high = (1 << (sample_bits - 1)) - 1;
+    return min(max(prediction + dequantize_sample(residual, step), low), high);
+}
+
+/*
+ * Quantizes samples x[0, frames) of one channel in place, x[-predictor_order, 0)
+ * being its history: each sample becomes what the decoder will reconstruct,
+ * and its rounded residual goes to `residuals`. `first` is the index in the
+ * file of x[0]; the file's first `predictor_order` samples have no history
+ * and are quantized directly. With noise shaping, each sample's
+ * quantization error is taken off the next sample's target (first-order
+ * error feedback), which moves the noise up in frequency; `error` carries
+ * it from sample to sample.
+ */
+void quantize_channel(int* x, int frames, int predictor_order, int step, int sample_bits, int first, bool noise_shaping, int& error, int* residuals) {
+    int low = -(1 << (sample_bits - 1)), high = (1 << (sample_bits - 1)) - 1;
+    for (int i = 0; i < frames; i++) {
+        int prediction = first + i < predictor_order ? 0 : predict_sample(x + i, predictor_order);
+        int target = noise_shaping ? min(max(x[i] - error, low), high) : x[i];
+        residuals[i] = quantize_sample(target - prediction, step);
+        x[i] = reconstruct_sample(prediction, residuals[i], step, sample_bits);      // alter the buffer position so we dont have the error propagation
+        // Only rounding error is fed back: clipping error would make the loop swing
+        error = min(max(x[i] - target, -step / 2), step / 2);
+    }
+}
+
+// Bits of residuals under Golomb mode 0: a fixed m, or the best power of two (its shift goes to `shift`)
+uint64_t residual_bits(const int* residuals, int n, int golomb_m, int& shift) {
+    if (golomb_m > 0) {
+        uint64_t bits = 0;
+        for (int i = 0; i < n; i++) bits += Golomb::codeLength(residuals[i], golomb_m, 0);
+        return bits;
+    }
+    // The best shift is near log2 of the mean magnitude; only its neighbours are counted
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) total += abs(residuals[i]);
+    int estimate = 0;
+    while (estimate + 1 < MAX_RICE_SHIFT && (uint64_t(1) << (estimate + 1)) * max(n, 1) <= total) estimate++;
+    uint64_t best = UINT64_MAX;
+    for (int candidate = max(estimate - 1, 0); candidate <= min(estimate + 1, MAX_RICE_SHIFT); candidate++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < n; i++) bits += 2 + candidate + (static_cast<uint32_t>(abs(residuals[i])) >> candidate);
+        if (bits < best) {
+            best = bits;
+            shift = candidate;
         }
     }
+    return best;
+}
+
+/*
+ * Quantizes a block of `frames` frames at step index k, in place. Channel c
+ * starts at rows[c * stride]; `errors` holds each channel's noise shaping
+ * error (kept up to date without shaping too), `residuals` gets the
+ * residuals channel after channel and `shifts` their Rice shifts. Returns
+ * the bits the block takes, header included.
+ */
+uint64_t quantize_block(int* rows, int stride, int frames, int k, bool noise_shaping, const AudioContainer& container,
+                        int first, vector<int>& errors, vector<int>& residuals, vector<int>& shifts) {
+    int channels = container.channels;
+    residuals.resize(static_cast<size_t>(frames) * channels);
+    shifts.resize(channels);
+    uint64_t bits = Golomb::codeLength(k, HEADER_M, 0);
+    for (int c = 0; c < channels; c++) {
+        int* residual = residuals.data() + static_cast<size_t>(c) * frames;
+        quantize_channel(rows + static_cast<size_t>(c) * stride, frames, container.predictorOrder, lossy_step(k),
+                         container.bitsPerSample, first, noise_shaping, errors[c], residual);
+        bits += residual_bits(residual, frames, container.golombM, shifts[c]);
+        if (container.golombM == 0) bits += Golomb::codeLength(shifts[c], HEADER_M, 0);
+    }
+    return bits;
+}
+
+// Keep the chunk's last `predictor_order` samples of each channel as the history of the next one
+void shift_history(vector<int>& window, int frames, int channels, int predictor_order) {
+    int stride = predictor_order + CHUNK_FRAMES;
+    for (int c = 0; c < channels; c++) {
+        int* row = window.data() + c * stride;
+        copy(row + frames, row + frames + predictor_order, row);
+    }
+}
 
-    // Reconstruct signal using residuals and predictions
-    for (int i = predictor_order; i < frames; i++) {
-        if(channels == 2) {
-            int left_idx = i * 2;
-            int right_idx = i * 2 + 1;
-            
-            int16_t prediction_left = predict_sample(decoded.data(), channels, left_idx, predictor_order);
-            int16_t left_sample = prediction_left + dequantize_sample(residuals[left_idx],num_bits);
-            decoded.push_back(left_sample);
-            
-            int16_t prediction_right = predict_sample(decoded.data(), channels, right_idx, predictor_order);
-            int16_t right_sample = prediction_right + dequantize_sample(residuals[right_idx],num_bits);
-            decoded.push_back(right_sample);
+/*
+ * Encode audio behind the container header, CHUNK_FRAMES frames at a time.
+ * Each chunk's residuals are entropy-coded on their own and written as
+ * uint32 byte count + bytes; the predictor history and the noise shaping
+ * error carry on across chunks. Within a chunk, blocks of
+ * LOSSY_BLOCK_FRAMES frames each have a step index (a Header value) and,
+ * when M isn't fixed, a Rice shift per channel, each channel's residuals
+ * after its shift.
+ *
+ * With a target bitrate, every block gets the finest step whose measured
+ * Golomb cost fits its share of the bits, plus a quarter of what earlier
+ * blocks left over or overspent. The cost counts Rice codes, scaled by
+ * what the last block with that step really took over its estimate (the
+ * adaptive coders beat Rice on coarse steps, not on fine ones): every block
+ * ends an entropy coder segment (sync), so the real size is known for all
+ * coders. Otherwise the step is fixed by quantizedBits.
+ *
+ * Shaped noise goes back into the prediction, which at coarse steps costs
+ * bits or settles into a limit cycle, so a block is only shaped when that
+ * fits its budget at the unshaped step or the next one, with at most four
+ * times the unshaped squared error (first-order shaping alone doubles it).
+ * The decoder doesn't need to know.
+ */
+void encode_audio_lossy(SNDFILE* input, const AudioContainer& container, ostream& output) {
+    int channels = container.channels, predictor_order = container.predictorOrder;
+    int stride = predictor_order + CHUNK_FRAMES;
+    vector<int32_t> interleaved(static_cast<size_t>(CHUNK_FRAMES) * channels);
+    vector<int> window(static_cast<size_t>(stride) * channels);
+    vector<int> errors(channels, 0), trial_errors, trial;
+    vector<int> residuals, shifts;
+    vector<uint8_t> bytes;
+    int fixed_k = 4 * (container.bitsPerSample - container.quantizedBits);
+    int max_k = max_step_index(container.bitsPerSample);
+    double bits_per_frame = static_cast<double>(container.targetBitrate) / container.sampleRate;
+    double spent = 0;  // bits written so far
+    vector<double> scale(max_k + 1, 1.0);  // real size over estimated, per step index
+
+    for (int first = 0; first < container.frames; first += CHUNK_FRAMES) {
+        int count = min(CHUNK_FRAMES, container.frames - first);
+        if (read_frames(input, interleaved.data(), count, channels, container.bitsPerSample) != count) {
+            throw runtime_error("Audio input ended early");
         }
-        else{
-            int16_t prediction = predict_sample(decoded.data(), channels, i, predictor_order);
-            int16_t sample = prediction + dequantize_sample(residuals[i],num_bits);
-            decoded.push_back(sample);
+        load_chunk(interleaved.data(), count, channels, predictor_order, window);
+
+        bytes.clear();
+        unique_ptr<EntropyCoder> encoder = makeEntropyCoder(container.backend, HEADER_M, false, bytes, 0);
+        if (container.golombM > 0) encoder->setRiceParameter(SyntaxElement::Residual, container.golombM);
+        for (int offset = 0; offset < count; offset += LOSSY_BLOCK_FRAMES) {
+            int frames = min(LOSSY_BLOCK_FRAMES, count - offset);
+            int* rows = window.data() + predictor_order + offset;
+            bool target = container.targetBitrate > 0;
+            double budget = bits_per_frame * frames + (bits_per_frame * (first + offset) - spent) / 4;
+            // Trials run on a copy of the block and its history; they give the estimated bits and the squared error
+            int trial_stride = predictor_order + frames;
+            trial.resize(static_cast<size_t>(trial_stride) * channels);
+            auto try_block = [&](int step_index, bool noise_shaping, double& squared_error) {
+                for (int c = 0; c < channels; c++) {
+                    copy(rows + c * stride - predictor_order, rows + c * stride + frames, trial.begin() + c * trial_stride);
+                }
+                trial_errors = errors;
+                double bits = quantize_block(trial.data() + predictor_order, trial_stride, frames, step_index, noise_shaping,
+                                             container, first + offset, trial_errors, residuals, shifts) * scale[step_index];
+                squared_error = 0;
+                for (int c = 0; c < channels; c++) {
+                    for (int i = 0; i < frames; i++) {
+                        double difference = trial[c * trial_stride + predictor_order + i] - rows[c * stride + i];
+                        squared_error += difference * difference;
+                    }
+                }
+                return bits;
+            };
+
+            int k = fixed_k;
+            double plain_error, shaped_error;
+            if (target) {
+                // Cost falls as the step grows: the finest step that fits
+                int low = 0, high = max_k;
+                while (low < high) {
+                    int middle = (low + high) / 2;
+                    if (try_block(middle, false, plain_error) <= budget) high = middle;
+                    else low = middle + 1;
+                }
+                k = low;
+            }
+            bool shaped = false;
+            if (container.noiseShaping) {
+                // Shaping may take the next step when the bits need it, but not more than 6 dB of extra noise
+                try_block(k, false, plain_error);
+                for (int candidate = k; candidate <= min(target ? k + 1 : k, max_k) && !shaped; candidate++) {
+                    double bits = try_block(candidate, true, shaped_error);
+                    if ((!target || bits <= budget) && shaped_error <= 4 * plain_error) {
+                        k = candidate;
+                        shaped = true;
+                    }
+                }
+            }
+            uint64_t bits = quantize_block(rows, stride, frames, k, shaped, container, first + offset, errors, residuals, shifts);
+            uint64_t before = encoder->bitsWritten();
+            encoder->encode(k, SyntaxElement::Header);
+            for (int c = 0; c < channels; c++) {
+                if (container.golombM == 0) {
+                    encoder->encode(shifts[c], SyntaxElement::Header);
+                    encoder->setRiceParameter(SyntaxElement::Residual, 1 << shifts[c]);
+                }
+                const int* residual = residuals.data() + static_cast<size_t>(c) * frames;
+                for (int i = 0; i < frames; i++) {
+                    encoder->encode(residual[i]);
+                }
+            }
+            encoder->sync();
+            uint64_t written = encoder->bitsWritten() - before;
+            spent += written;
+            scale[k] = static_cast<double>(written) / max<uint64_t>(bits, 1);
         }
-        
-    }
+        encoder->end();
+        shift_history(window, count, channels, predictor_order);
 
-    return decoded;
+        for (int i = 0; i < 4; i++) {
+            output.put(static_cast<char>(bytes.size() >> (8 * i)));
+        }
+        output.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        spent += 8.0 * bytes.size() + 32 - encoder->bitsWritten();  // the byte count and the padding
+    }
 }
 
-// Helper for lossy encoding
-void perform_lossy_encoding(int16_t *buffer, int frames, int M, int predictor_order, int num_bits, int sample_rate, int channels) {
-    // make a copy of the buffer with the original data so we don't alter the original one
-    int16_t *buffercpy = new int16_t[frames * channels]; 
-    memcpy(buffercpy,buffer,frames*channels*sizeof(int16_t));       
-
-    // auto start = high_resolution_clock::now();
-    encode_audio_lossy(buffercpy, frames, channels, M, "error_lossy.bin", predictor_order, num_bits);
-    // auto end = high_resolution_clock::now();
-    // cout << "Lossy encoding completed in " << duration_cast<milliseconds>(end - start).count() << " ms\n";
-
-    // start = high_resolution_clock::now();
-    auto decoded = decode_audio_lossy(M, "error_lossy.bin", frames, channels, predictor_order, num_bits);
-    // end = high_resolution_clock::now();
-    // cout << "Lossy decoding completed in " << duration_cast<milliseconds>(end - start).count() << " ms\n";
-
-    save_wav("reconstructed_lossy.wav", decoded, sample_rate, channels);
-    cout << "Successfully generated 'reconstructed_lossy.wav' using lossy predictive coding!" << endl;
-    vector<int16_t> original_audio(buffer,buffer+frames*channels); 
-    double snr = calculate_snr(original_audio,decoded);
-    cout << "Signal-to-Noise Ratio (SNR): " << snr << " dB" << endl;
-
-    free(buffercpy);
+/*
+ * Decode frames [first, first + count) into `output`. Every sample depends
+ * on the ones before it, so the chunks ahead of the range are decoded too,
+ * just not written. Reads back exactly frames * channels values (the Rice
+ * stream's zero padding would otherwise decode as extra values).
+ */
+void decode_audio_lossy(const AudioContainer& container, istream& input, SNDFILE* output, int first, int count) {
+    int channels = container.channels, predictor_order = container.predictorOrder;
+    int stride = predictor_order + CHUNK_FRAMES;
+    vector<int> window(static_cast<size_t>(stride) * channels);
+    vector<int32_t> interleaved, scratch;
+    vector<uint8_t> bytes;
+    for (int start = 0; start < first + count; start += CHUNK_FRAMES) {
+        int frames = min(CHUNK_FRAMES, container.frames - start);
+        uint32_t size = 0;
+        for (int i = 0; i < 4; i++) {
+            int byte = input.get();
+            if (byte == EOF) throw runtime_error("Truncated audio file");
+            size |= static_cast<uint32_t>(byte) << (8 * i);
+        }
+        bytes.resize(size);
+        if (!input.read(reinterpret_cast<char*>(bytes.data()), size)) {
+            throw runtime_error("Truncated audio file");
+        }
+        unique_ptr<EntropyCoder> decoder = makeEntropyCoder(container.backend, HEADER_M, true, bytes, 0);
+        if (container.golombM > 0) decoder->setRiceParameter(SyntaxElement::Residual, container.golombM);
+
+        // Reconstruct signal using residuals and predictions, block after block, channel after channel
+        for (int offset = 0; offset < frames; offset += LOSSY_BLOCK_FRAMES) {
+            int block_frames = min(LOSSY_BLOCK_FRAMES, frames - offset);
+            int k = decoder->decode_val(SyntaxElement::Header);
+            if (k < 0 || k > max_step_index(container.bitsPerSample)) {
+                throw runtime_error("Corrupt audio block header");
+            }
+            for (int c = 0; c < channels; c++) {
+                if (container.golombM == 0) {
+                    int shift = decoder->decode_val(SyntaxElement::Header);
+                    if (shift < 0 || shift > MAX_RICE_SHIFT) {
+                        throw runtime_error("Corrupt audio block header");
+                    }
+                    decoder->setRiceParameter(SyntaxElement::Residual, 1 << shift);
+                }
+                int* x = window.data() + c * stride + predictor_order + offset;
+                for (int i = 0; i < block_frames; i++) {
+                    int prediction = start + offset + i < predictor_order ? 0 : predict_sample(x + i, predictor_order);
+                    x[i] = reconstruct_sample(prediction, decoder->decode_val(), lossy_step(k), container.bitsPerSample);
+                }
+            }
+            decoder->sync();
+        }
+        int from = max(first, start), to = min(first + count, start + frames);
+        if (from < to) {
+            store_chunk(window, frames, channels, predictor_order, interleaved);
+            write_frames(output, interleaved.data() + static_cast<size_t>(from - start) * channels, to - from,
+                         channels, container.bitsPerSample, scratch);
+        }
+        shift_history(window, frames, channels, predictor_order);
+    }
 }
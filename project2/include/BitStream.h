@@ -5,6 +5,8 @@
 #include <cstdint>
 #include <bitset>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 #ifndef BITSTREAM_H
 #define BITSTREAM_H
@@ -15,11 +17,38 @@ class BitStream
 {
     char bit_buffer;
     int current_bit = 0;
+    uint64_t written_bits = 0;   // total number of bits written so far
 
     int readBitPos = 0;
     char readBuffer;
     fstream file;
 
+    // In-memory mode: bytes go to and come from `memory` instead of the file
+    vector<uint8_t>* memory = nullptr;
+    size_t memoryReadPos = 0;
+    bool memoryEof = false;
+
+    void putByte(char byte) {
+        if (memory) {
+            memory->push_back(static_cast<uint8_t>(byte));
+        } else {
+            file.put(byte);
+        }
+    }
+
+    bool getByte(char& byte) {
+        if (memory) {
+            if (memoryReadPos >= memory->size()) {
+                memoryEof = true;
+                return false;
+            }
+            byte = static_cast<char>((*memory)[memoryReadPos++]);
+            return true;
+        }
+        file.get(byte);
+        return !file.eof();
+    }
+
 public:
     BitStream(const string &filename, bool readMode){
         file.open(filename,readMode ? ios::in | ios::binary : ios::out | ios::binary);
@@ -28,29 +57,40 @@ public:
         }
     }
 
-    void end(){
+    // Bits are appended to / read from `buffer`, which must outlive the stream; unlike a file it needs no open mode
+    BitStream(vector<uint8_t> &buffer, bool /* readMode */) : memory(&buffer) {}
+
+    // Pad the last byte with zeros so everything written so far is in the file or buffer
+    void flush(){
         if (current_bit < 8 && current_bit > 0) {
             // printf("current_bit: %d, ",current_bit);
             bit_buffer <<= (8 - current_bit); // Pad with zeros
-            file.put(bit_buffer);
+            putByte(bit_buffer);
             // printf("buffer: %d\n",bit_buffer);
             bit_buffer = 0;
             current_bit = 0;
         }
-        file.close();
+    }
+
+    void end(){
+        flush();
+        if (!memory) {
+            file.close();
+        }
     }
     // Writes a single bit to the file.
     void writeBit(bool bit)
     {
         bit_buffer <<= 1;
         bit_buffer |= (bit); // set the last bit to the value of bit
+        written_bits++;
         // printf("bit: %d,  (binary: %s)\n",bit,bitset<8>(bit_buffer).to_string().c_str());
         current_bit++;
         if (current_bit == 8)
         {
             // printf("writing: %c, (binary: %s)\n",bit_buffer,bitset<8>(bit_buffer).to_string().c_str());
             // file << bit_buffer;
-            file.put(bit_buffer);
+            putByte(bit_buffer);
             bit_buffer = 0;
             current_bit = 0;
         }
@@ -66,8 +106,7 @@ public:
     {
         if (readBitPos == 0)
         {
-            file.get(readBuffer);
-            if (file.eof())
+            if (!getByte(readBuffer))
             {
                 // printf("Reached the end of the file\n");
                 return -1;
@@ -120,6 +159,65 @@ public:
         return result;
     }
 
+    // Whole bytes, for byte-oriented coders layered on the stream; no bit shuffling when aligned
+    void writeByte(uint8_t byte)
+    {
+        if (current_bit != 0) {
+            writeBits(byte, 8);
+            return;
+        }
+        putByte(static_cast<char>(byte));
+        written_bits += 8;
+    }
+
+    // Next byte, or -1 at the end of the file (or buffer)
+    int readByte()
+    {
+        if (readBitPos != 0) {
+            uint64_t bits = readBits(8);
+            return bits == static_cast<uint64_t>(-1) ? -1 : static_cast<int>(bits);
+        }
+        char byte;
+        if (!getByte(byte)) {
+            return -1;
+        }
+        return static_cast<uint8_t>(byte);
+    }
+
+    // Runs of whole bytes, copied straight through when the stream is byte-aligned
+    void writeBytes(const uint8_t* data, size_t count)
+    {
+        if (current_bit != 0) {
+            for (size_t i = 0; i < count; ++i) writeByte(data[i]);
+            return;
+        }
+        if (memory) {
+            memory->insert(memory->end(), data, data + count);
+        } else {
+            file.write(reinterpret_cast<const char*>(data), count);
+        }
+        written_bits += 8 * count;
+    }
+
+    // Returns the number of bytes read, short at the end of the file (or buffer)
+    size_t readBytes(uint8_t* data, size_t count)
+    {
+        if (readBitPos != 0) {
+            size_t i = 0;
+            for (int byte; i < count && (byte = readByte()) >= 0; ++i) data[i] = static_cast<uint8_t>(byte);
+            return i;
+        }
+        if (memory) {
+            size_t available = min(count, memory->size() - min(memoryReadPos, memory->size()));
+            copy(memory->begin() + memoryReadPos, memory->begin() + memoryReadPos + available, data);
+            memoryReadPos += available;
+            if (available < count) memoryEof = true;
+            return available;
+        }
+        file.read(reinterpret_cast<char*>(data), count);
+        return static_cast<size_t>(file.gcount());
+    }
+
     // Writes a string of characters to the file as a series of bits.
     void writeString(string str)
     {
@@ -147,8 +245,30 @@ public:
         return result;
     }
 
+    // Position the reader at an absolute bit offset from the start of the file (or buffer)
+    void seekToBit(uint64_t bitOffset)
+    {
+        if (memory) {
+            memoryReadPos = bitOffset / 8;
+            memoryEof = false;
+        } else {
+            file.clear();
+            file.seekg(bitOffset / 8, ios::beg);
+        }
+        readBitPos = 0;
+        for (uint64_t i = 0; i < bitOffset % 8; ++i)
+        {
+            readBit();
+        }
+    }
+
+    // Number of bits written so far (without the final padding)
+    uint64_t bitsWritten() const {
+        return written_bits;
+    }
+
     int endOfFile(){
-        if(file.eof())
+        if(memory ? memoryEof : file.eof())
             return 1;
         return 0;
     }
@@ -27,11 +27,55 @@ public:
         }
     }
 
+    // Code to / from a memory buffer instead of a file
+    Golomb(int m, bool decoder, vector<uint8_t>& buffer, int mode = 0)
+        : m(m), bs(buffer, decoder), mode(mode), numBitsR(ceil(log2(m))) {
+        if (m <= 0) {
+            throw invalid_argument("Golomb parameter 'm' must be > 0.");
+        }
+    }
+
+    // Change the parameter between values; the decoder must change it at the same point
+    void setM(int newM) {
+        if (newM <= 0) {
+            throw invalid_argument("Golomb parameter 'm' must be > 0.");
+        }
+        m = newM;
+        numBitsR = ceil(log2(m));
+    }
+
+    int getM() const {
+        return m;
+    }
+
     // End of encoding
     void end() {
         bs.end();
     }
 
+    // Byte-align what was encoded so far, e.g. to close a packet; encoding can go on after it
+    void flush() {
+        bs.flush();
+    }
+
+    // Number of bits encoded so far
+    uint64_t bitsWritten() const {
+        return bs.bitsWritten();
+    }
+
+    // Continue decoding from a bit offset previously taken with bitsWritten()
+    void seekToBit(uint64_t bitOffset) {
+        bs.seekToBit(bitOffset);
+    }
+
+    // Bits encode() spends on a value, so encoders can price a choice without writing it
+    static int codeLength(int value, int m, int mode = 0) {
+        int magnitude = (mode == 0) ? abs(value) : (value >= 0 ? 2 * value : -2 * value - 1);
+        int remainderBits = 0;
+        while ((1 << remainderBits) < m) remainderBits++;
+        return (mode == 0) + magnitude / m + 1 + remainderBits;
+    }
+
     // Zigzag encoding
     int zigzagEncode(int value) {
         return value >= 0 ? 2 * value : -2 * value - 1;
@@ -74,7 +118,7 @@ public:
             while (bs.readBit() == 1) {
                 q++;
             }
-            int r = bs.readBits(numBitsR);
+            int r = numBitsR ? bs.readBits(numBitsR) : 0;  // m = 1 has no remainder bits
             int magnitude = q * m + r;
             return isNegative ? -magnitude : magnitude;
         } else {
@@ -82,7 +126,7 @@ public:
             while (bs.readBit() == 1) {
                 q++;
             }
-            int r = bs.readBits(numBitsR);
+            int r = numBitsR ? bs.readBits(numBitsR) : 0;
             int zigzagValue = q * m + r;
             return zigzagDecode(zigzagValue);
         }
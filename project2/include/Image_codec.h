@@ -7,9 +7,11 @@
 #include <cmath> // For ceil, log2
 #include <iostream>
 #include "Golomb.h" // Include the Golomb class for encoding/decoding
+#include "entropy_backend.h"
 #include <opencv2/opencv.hpp>
 #include <filesystem> // For filesystem operations
 #include <chrono> // For measuring encoding time
+#include <stdexcept>
 
 using namespace cv;
 using namespace std;
@@ -20,6 +22,7 @@ private:
     int m;      // Golomb parameter
     int mode;   // Prediction mode (0: A, 1: Average, etc.)
     int channelsCount; // Number of channels in the image
+    EntropyBackend entropyBackend = EntropyBackend::Rice;
 
     struct PredictorMetrics {
         double psnr;
@@ -62,13 +65,31 @@ private:
             return a + b - c;
     }
 
-    // Optimal predictor selection
-    int predictPixel(int x, int y, const Mat &channel) {
-        if (x == 0 && y == 0) return 128;  // Default value for first pixel
-        if (x == 0) return predictorB(x, y, channel);  // First column: use north
-        if (y == 0) return predictorA(x, y, channel);  // First row: use west
-        
-        return JPEGLSPredictor(x, y, channel);  // Use JPEG-LS predictor for other pixels
+    /*
+     * Optimal predictor selection on row pointers: `row` is the row being
+     * coded (decoded up to x) and `above` the row before it, or nullptr on
+     * the first row. T is uchar or ushort; `mid` is the middle of the
+     * sample range (128 for 8-bit), the prediction of the first pixel
+     */
+    template<typename T>
+    static int predictPixel(const T* row, const T* above, int x, int mid) {
+        if (!above) return x > 0 ? row[x - 1] : mid;  // First row: use west, mid-range for the first pixel
+        if (x == 0) return above[0];                  // First column: use north
+
+        int a = row[x - 1];    // West
+        int b = above[x];      // North
+        int c = above[x - 1];  // Northwest
+        if (c >= max(a, b))
+            return min(a, b);
+        else if (c <= min(a, b))
+            return max(a, b);
+        else
+            return a + b - c;
+    }
+
+    // Rice parameter selection from the mean residual magnitude
+    static int optimalMForMean(double mean) {
+        return max(1, static_cast<int>(ceil(-1/log2(mean/(mean+1)))));
     }
 
     // Estimate optimal Golomb parameter m
@@ -80,10 +101,53 @@ private:
                 sum += abs(residuals.at<int>(y, x));
             }
         }
-        double mean = sum / (residuals.rows * residuals.cols);
-        
-        // Estimate optimal m based on mean (Rice parameter selection)
-        return max(1, static_cast<int>(ceil(-1/log2(mean/(mean+1)))));
+        return optimalMForMean(sum / (residuals.rows * residuals.cols));
+    }
+
+    // Same estimate for the residuals of a channel, predicted on the fly instead of stored
+    template<typename T>
+    int estimateChannelM(const Mat &channel, int bitDepth) {
+        int mid = 1 << (bitDepth - 1);
+        double sum = 0;
+        for (int y = 0; y < channel.rows; ++y) {
+            const T* row = channel.ptr<T>(y);
+            const T* above = y > 0 ? channel.ptr<T>(y - 1) : nullptr;
+            for (int x = 0; x < channel.cols; ++x) {
+                sum += abs(row[x] - predictPixel(row, above, x, mid));
+            }
+        }
+        return optimalMForMean(sum / (channel.rows * channel.cols));
+    }
+
+    int estimateChannelM(const Mat &channel, int bitDepth) {
+        return channel.depth() == CV_8U ? estimateChannelM<uchar>(channel, bitDepth)
+                                        : estimateChannelM<ushort>(channel, bitDepth);
+    }
+
+    template<typename T, typename Coder>
+    void encodeRows(const Mat &channel, Coder &encoder, int bitDepth) {
+        int mid = 1 << (bitDepth - 1);
+        for (int y = 0; y < channel.rows; ++y) {
+            const T* row = channel.ptr<T>(y);
+            const T* above = y > 0 ? channel.ptr<T>(y - 1) : nullptr;
+            for (int x = 0; x < channel.cols; ++x) {
+                encoder.encode(row[x] - predictPixel(row, above, x, mid));
+            }
+        }
+    }
+
+    template<typename T, typename Coder>
+    void decodeRows(Coder &decoder, Mat &channel, int bitDepth) {
+        int mid = 1 << (bitDepth - 1);
+        int maxValue = (1 << bitDepth) - 1;
+        for (int y = 0; y < channel.rows; ++y) {
+            T* row = channel.ptr<T>(y);
+            const T* above = y > 0 ? channel.ptr<T>(y - 1) : nullptr;
+            for (int x = 0; x < channel.cols; ++x) {
+                int value = predictPixel(row, above, x, mid) + decoder.decode_val();
+                row[x] = static_cast<T>(min(max(value, 0), maxValue));
+            }
+        }
     }
 
     // New helper method to calculate PSNR
@@ -200,82 +264,63 @@ public:
     
 
     /*
-    * Calculate residuals for a single channel using the A predictor
-    */
-    Mat calculateResiduals(const Mat &channel) {
-        Mat residuals = Mat::zeros(channel.size(), CV_32S);
-        for (int y = 0; y < channel.rows; ++y) {
-            for (int x = 0; x < channel.cols; ++x) {
-                int predicted = predictPixel(x, y, channel);
-                residuals.at<int>(y, x) = channel.at<uchar>(y, x) - predicted;
-            }
+     * Significant bits of the samples: 8 for CV_8U images, and for CV_16U
+     * images (16-bit PGM/PPM/PNG) the bits of the largest sample, at least 9
+     * @param channels Channels of the image
+     * @return Bit depth, 8 to 16
+     */
+    static int sampleBitDepth(const vector<Mat> &channels) {
+        if (channels.empty() || channels[0].depth() == CV_8U) return 8;
+        if (channels[0].depth() != CV_16U) {
+            throw invalid_argument("Only 8-bit and 16-bit unsigned images are supported");
         }
-        return residuals;
-    }
-
-    /*
-    * Reconstruct a single channel using residuals and the JPEG-LS predictor
-    */
-    Mat reconstructChannel(const Mat &residuals) {
-        Mat channel = Mat::zeros(residuals.size(), CV_8U);
-        for (int y = 0; y < residuals.rows; ++y) {
-            for (int x = 0; x < residuals.cols; ++x) {
-                int predicted = predictPixel(x, y, channel); // Use same predictor as encoding
-                int value = residuals.at<int>(y, x) + predicted;
-                channel.at<uchar>(y, x) = saturate_cast<uchar>(value);
-            }
+        double maxValue = 0;
+        for (const Mat &channel : channels) {
+            double channelMax;
+            minMaxLoc(channel, nullptr, &channelMax);
+            maxValue = max(maxValue, channelMax);
         }
-        return channel;
+        int bitDepth = 9;
+        while (bitDepth < 16 && (1 << bitDepth) <= maxValue) bitDepth++;
+        return bitDepth;
     }
 
     /*
-     * Encode residuals using Golomb coding and save to a binary file
-     * @param residuals Vector of residual matrices (one per channel)
-     * @param outputFilename Output file to store the encoded data
+     * Predict and Golomb-code a channel in one pass; residuals go straight
+     * to the encoder and are never stored
+     * @param channel CV_8U or CV_16U channel to encode
+     * @param encoder Golomb or EntropyCoder to write to
+     * @param bitDepth Bit depth of the samples (see sampleBitDepth)
      */
-    void encodeResiduals(const vector<Mat> &residuals, const string &outputFilename) {
-        Golomb encoder(m, false, outputFilename); // Initialize Golomb encoder
-        // Encode each channel sequentially in the same file
-        for (const Mat &channelResiduals : residuals) {
-            for (int y = 0; y < channelResiduals.rows; ++y) {
-                for (int x = 0; x < channelResiduals.cols; ++x) {
-                    encoder.encode(channelResiduals.at<int>(y, x));
-                }
-            }
-        }
-        
-        encoder.end(); // Finalize and close the file
+    template<typename Coder>
+    void encodeChannel(const Mat &channel, Coder &encoder, int bitDepth = 8) {
+        if (channel.depth() == CV_8U) encodeRows<uchar>(channel, encoder, bitDepth);
+        else encodeRows<ushort>(channel, encoder, bitDepth);
     }
 
     /*
-     * Decode residuals from a binary file using Golomb coding
-     * @param width Width of the image
-     * @param height Height of the image
-     * @param channels Number of channels
-     * @param inputFilename Input file with encoded data
-     * @return Vector of decoded residuals matrices
+     * Decode a channel written by encodeChannel, rebuilding each pixel as
+     * soon as its residual is read
+     * @param decoder Golomb or EntropyCoder to read from
+     * @param width Width of the channel
+     * @param height Height of the channel
+     * @param bitDepth Bit depth of the samples; above 8 the channel is CV_16U
+     * @return Decoded channel
      */
-    vector<Mat> decodeResiduals(int width, int height, int channels, const string &inputFilename) {
-        Golomb decoder(m, true, inputFilename); // Initialize Golomb decoder
-        vector<Mat> residuals(channels);
-        
-        // Initialize matrices for each channel
-        for (int c = 0; c < channels; ++c) {
-            residuals[c] = Mat::zeros(Size(width, height), CV_32S);
-        }
-
-        // Decode each channel sequentially from the same file
-        for (int c = 0; c < channels; ++c) {
-            for (int y = 0; y < height; ++y) {
-                for (int x = 0; x < width; ++x) {
-                    residuals[c].at<int>(y, x) = decoder.decode_val();
-                }
-            }
-        }
-        return residuals;
+    template<typename Coder>
+    Mat decodeChannel(Coder &decoder, int width, int height, int bitDepth = 8) {
+        Mat channel(height, width, bitDepth > 8 ? CV_16U : CV_8U);
+        if (bitDepth > 8) decodeRows<ushort>(decoder, channel, bitDepth);
+        else decodeRows<uchar>(decoder, channel, bitDepth);
+        return channel;
     }
 
     ImageCodec(int m, int mode = 0) : m(m), mode(mode), channelsCount(0) {}
+
+    // Entropy coder of the files encode writes; decode takes it from the metadata
+    void setEntropyBackend(EntropyBackend backend) {
+        entropyBackend = backend;
+    }
     
 
     /*
@@ -288,37 +333,35 @@ public:
         vector<Mat> channels;
         split(image, channels);
 
-        // Calculate residuals for all channels
-        vector<Mat> residuals(channelsCount);
-        for (int i = 0; i < channelsCount; ++i) {
-            residuals[i] = calculateResiduals(channels[i]);
-        }
-
         // Get the directory of the output file
         fs::path outputPath(outputFilename);
         fs::path outputDir = outputPath.parent_path();
         string baseFilename = outputDir / outputPath.stem().string();
 
         // Calculate optimal m for each channel
+        int bitDepth = sampleBitDepth(channels);
         vector<int> optimalMs(channelsCount);
         for (int i = 0; i < channelsCount; ++i) {
-            optimalMs[i] = estimateOptimalM(residuals[i]);
+            optimalMs[i] = estimateChannelM(channels[i], bitDepth);
         }
         
-        // Save metadata including optimal m values
+        // Save metadata including bit depth and optimal m values
         string metaFilePath = baseFilename + "_meta.txt";
         ofstream metaFile(metaFilePath);
-        metaFile << image.rows << " " << image.cols << " " << channelsCount << endl;
+        metaFile << image.rows << " " << image.cols << " " << channelsCount << " " << bitDepth << endl;
         for (int m : optimalMs) {
             metaFile << m << " ";
         }
+        metaFile << entropyBackendName(entropyBackend) << endl;
         metaFile.close();
         
         // Encode each channel with its optimal m
         for (int i = 0; i < channelsCount; ++i) {
             string binFilePath = baseFilename + "_" + to_string(i) + ".bin";
-            Golomb encoder(optimalMs[i], false, binFilePath);
-            encodeResiduals({residuals[i]}, binFilePath);
+            unique_ptr<EntropyCoder> encoder =
+                makeEntropyCoder(entropyBackend, optimalMs[i], false, binFilePath, 0);
+            encodeChannel(channels[i], *encoder, bitDepth);
+            encoder->end();
         }
     }
 
@@ -331,17 +374,26 @@ public:
         // Read metadata
         string metaFilePath = baseFilename + "_meta.txt";
         ifstream metaFile(metaFilePath);
-        int rows, cols, channels;
-        metaFile >> rows >> cols >> channels;
+        int rows, cols, channels, bitDepth;
+        metaFile >> rows >> cols >> channels >> bitDepth;
+        vector<int> optimalMs(channels);
+        for (int &channelM : optimalMs) {
+            metaFile >> channelM;
+        }
+        string backendName;
+        metaFile >> backendName;
+        if (!metaFile || bitDepth < 8 || bitDepth > 16) {
+            throw runtime_error("Invalid metadata file: " + metaFilePath);
+        }
+        EntropyBackend backend = parseEntropyBackend(backendName);
         metaFile.close();
 
-        // Decode all channels from single file
-        string binFilePath = baseFilename + ".bin";
-        vector<Mat> residuals = decodeResiduals(cols, rows, channels, binFilePath);
-        
+        // Decode each channel from its own file with the m it was encoded with
         vector<Mat> channelsDecoded(channels);
         for (int i = 0; i < channels; ++i) {
-            channelsDecoded[i] = reconstructChannel(residuals[i]);
+            string binFilePath = baseFilename + "_" + to_string(i) + ".bin";
+            unique_ptr<EntropyCoder> decoder = makeEntropyCoder(backend, optimalMs[i], true, binFilePath, 0);
+            channelsDecoded[i] = decodeChannel(*decoder, cols, rows, bitDepth);
         }
 
         Mat decodedImage;
@@ -362,23 +414,28 @@ public:
         string binPath = (outputDir / (baseName + ".bin")).string();
         string metaPath = (outputDir / (baseName + "_meta.txt")).string();
 
-        // Calculate residuals and save them to binary file
-        vector<Mat> residuals(channels.size());
-        for (int i = 0; i < channels.size(); ++i) {
-            residuals[i] = calculateResiduals(channels[i]);
+        // Residuals grow with the sample range, so m is given for 8-bit samples and scaled up
+        int bitDepth = sampleBitDepth(channels);
+        int channelM = m << (bitDepth - 8);
+
+        // Encode all channels sequentially in the same file
+        unique_ptr<EntropyCoder> encoder = makeEntropyCoder(entropyBackend, channelM, false, binPath, 0);
+        for (const Mat &channel : channels) {
+            encodeChannel(channel, *encoder, bitDepth);
         }
-        encodeResiduals(residuals, binPath);
+        encoder->end();
 
         // Save metadata
         ofstream metaFile(metaPath);
-        metaFile << image.rows << " " << image.cols << " " << channels.size() << " " << m << endl;
+        metaFile << image.rows << " " << image.cols << " " << channels.size() << " " << channelM << " " << bitDepth
+                 << " " << entropyBackendName(entropyBackend) << endl;
         metaFile.close();
 
         // Decode the binary file to get the reconstructed image
-        vector<Mat> decodedResiduals = decodeResiduals(image.cols, image.rows, channels.size(), binPath);
+        unique_ptr<EntropyCoder> decoder = makeEntropyCoder(entropyBackend, channelM, true, binPath, 0);
         vector<Mat> reconstructedChannels(channels.size());
         for (int i = 0; i < channels.size(); ++i) {
-            reconstructedChannels[i] = reconstructChannel(decodedResiduals[i]);
+            reconstructedChannels[i] = decodeChannel(*decoder, image.cols, image.rows, bitDepth);
         }
 
         // Create and save the reconstructed image
@@ -390,6 +447,9 @@ public:
     // New method to analyze all predictors
     map<string, PredictorMetrics> analyzePredictors(const Mat& image) {
         map<string, PredictorMetrics> results;
+        if (image.depth() != CV_8U) {
+            throw invalid_argument("Predictor analysis supports 8-bit images only");
+        }
         vector<Mat> channels;
         split(image, channels);
         
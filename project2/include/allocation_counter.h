@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Counts the heap allocations of the codecs' working buffers: frame-level
+ * planes and lists, and the per-thread block scratch. Buffers are sized
+ * through the helpers below, which only allocate (and count) when a buffer
+ * has to grow, so once every buffer has seen its largest frame the count
+ * stays flat. Benchmarks read count() before and after a run of frames.
+ * That includes the frames in flight between pipeline threads, a fixed set
+ * recycled through a BufferRing (see frame_pipeline.h).
+ *
+ * Not counted: the thread pool's bookkeeping of each parallel loop.
+ */
+class AllocationCounter {
+private:
+    static atomic<uint64_t>& counter() {
+        static atomic<uint64_t> allocations{0};
+        return allocations;
+    }
+
+public:
+    static uint64_t count() { return counter().load(memory_order_relaxed); }
+    static void add() { counter().fetch_add(1, memory_order_relaxed); }
+
+    // Mat::create, counted when it allocates rather than reuses the buffer
+    static void create(Mat& mat, int rows, int cols, int type) {
+        if (mat.rows != rows || mat.cols != cols || mat.type() != type) add();
+        mat.create(rows, cols, type);
+    }
+
+    static void create(Mat& mat, Size size, int type) { create(mat, size.height, size.width, type); }
+
+    /*
+     * rows x cols top-left region of buffer, which only grows: blocks cut by
+     * the frame edge come in several sizes and would resize a buffer back
+     * and forth. The region is a header on the buffer, nothing is allocated.
+     */
+    static Mat view(Mat& buffer, int rows, int cols, int type) {
+        if (buffer.rows < rows || buffer.cols < cols || buffer.type() != type) {
+            add();
+            buffer.create(max(rows, buffer.rows), max(cols, buffer.cols), type);
+        }
+        return buffer(Rect(0, 0, cols, rows));
+    }
+
+    template<typename T>
+    static void resize(vector<T>& buffer, size_t size) {
+        if (size > buffer.capacity()) add();
+        buffer.resize(size);
+    }
+
+    template<typename T>
+    static void assign(vector<T>& buffer, size_t size, const T& value) {
+        if (size > buffer.capacity()) add();
+        buffer.assign(size, value);
+    }
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "BitStream.h"
+#include "entropy_coder.h"
+
+using namespace std;
+
+/*
+ * Adaptive binary arithmetic coder (a range coder in the LZMA style, with
+ * CABAC-like binarization), for symbols Rice codes poorly: flags, modes and
+ * mostly-zero quantized residuals, which cost well under a bit each here.
+ *
+ * Binarization of a value v of an adaptive element:
+ *   - v == 0 flag,
+ *   - sign,
+ *   - |v| - 1 in truncated unary up to PREFIX_LENGTH bins,
+ *   - then the rest in Exp-Golomb with equiprobable (bypass) bins.
+ * Each element has its own contexts, selected by the magnitude of the
+ * element's previous value (0, 1 or more), so runs of zeros and of busy
+ * blocks adapt separately. Header values are Exp-Golomb in bypass bins.
+ *
+ * Probabilities are 11-bit and move by 1/32 of the distance per bin; the
+ * bin coding steps are branch-free, and renormalization reads or writes at
+ * most one byte per bin.
+ */
+class ArithmeticCoder : public EntropyCoder {
+private:
+    static const int PROBABILITY_BITS = 11;
+    static const uint32_t PROBABILITY_ONE = 1u << PROBABILITY_BITS;
+    static const int ADAPTATION_SHIFT = 5;
+    static const uint32_t RANGE_TOP = 1u << 24;
+    static const unsigned PREFIX_LENGTH = 14;  // unary bins before the Exp-Golomb escape
+    static const unsigned PREFIX_CONTEXTS = 8; // later prefix bins share the last context
+    static const int NEIGHBOURHOODS = 3;       // previous magnitude 0, 1, 2+
+    static const int MAX_ESCAPE_BITS = 32;
+
+    struct Contexts {
+        uint16_t zero[NEIGHBOURHOODS];
+        uint16_t sign[NEIGHBOURHOODS];
+        uint16_t magnitude[NEIGHBOURHOODS][PREFIX_CONTEXTS];
+        unsigned neighbourhood;
+    };
+
+    BitStream bs;
+    bool decoder;
+    Contexts contexts[static_cast<int>(SyntaxElement::Count)];
+
+    // Encoder state: low carries into the bytes held back in cache / cacheSize
+    uint64_t low = 0;
+    uint32_t range = 0xFFFFFFFF;
+    uint8_t cache = 0;
+    uint64_t cacheSize = 1;
+    // Decoder state
+    uint32_t code = 0;
+    bool needsStart = true;
+    bool segmentOpen = false;  // symbols coded since the segment started
+
+    void shiftLow() {
+        if (static_cast<uint32_t>(low) < 0xFF000000u || (low >> 32) != 0) {
+            uint8_t carry = static_cast<uint8_t>(low >> 32);
+            uint8_t byte = cache;
+            do {
+                bs.writeByte(static_cast<uint8_t>(byte + carry));
+                byte = 0xFF;
+            } while (--cacheSize != 0);
+            cache = static_cast<uint8_t>(low >> 24);
+        }
+        cacheSize++;
+        low = (low & 0x00FFFFFFu) << 8;
+    }
+
+    uint8_t nextByte() {
+        int byte = bs.readByte();
+        return byte < 0 ? 0 : static_cast<uint8_t>(byte);  // past the end reads as zeros
+    }
+
+    void startEncoder() {
+        low = 0;
+        range = 0xFFFFFFFF;
+        cache = 0;
+        cacheSize = 1;
+    }
+
+    void startDecoder() {
+        range = 0xFFFFFFFF;
+        code = 0;
+        for (int i = 0; i < 5; ++i) {
+            code = (code << 8) | nextByte();
+        }
+        needsStart = false;
+    }
+
+    // Probability of a 0 after coding a bin; mask is all ones when the bin was 1
+    static void adapt(uint16_t& probability, uint32_t mask) {
+        uint32_t afterZero = probability + ((PROBABILITY_ONE - probability) >> ADAPTATION_SHIFT);
+        uint32_t afterOne = probability - (probability >> ADAPTATION_SHIFT);
+        probability = static_cast<uint16_t>(afterZero + ((afterOne - afterZero) & mask));
+    }
+
+    // Bins select their half of the range with masks rather than branches, they are hard to predict
+    void encodeBit(uint16_t& probability, unsigned bit) {
+        uint32_t bound = (range >> PROBABILITY_BITS) * probability;
+        uint32_t mask = 0u - bit;
+        low += bound & mask;
+        range = bound + ((range - 2 * bound) & mask);
+        adapt(probability, mask);
+        if (range < RANGE_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    unsigned decodeBit(uint16_t& probability) {
+        uint32_t bound = (range >> PROBABILITY_BITS) * probability;
+        unsigned bit = code >= bound;
+        uint32_t mask = 0u - bit;
+        code -= bound & mask;
+        range = bound + ((range - 2 * bound) & mask);
+        adapt(probability, mask);
+        if (range < RANGE_TOP) {
+            range <<= 8;
+            code = (code << 8) | nextByte();
+        }
+        return bit;
+    }
+
+    void encodeBypass(unsigned bit) {
+        range >>= 1;
+        low += bit ? range : 0;
+        if (range < RANGE_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    unsigned decodeBypass() {
+        range >>= 1;
+        unsigned bit = code >= range;
+        code -= bit ? range : 0;
+        if (range < RANGE_TOP) {
+            range <<= 8;
+            code = (code << 8) | nextByte();
+        }
+        return bit;
+    }
+
+    // Exp-Golomb (k = 0) in bypass bins: the length of value + 1 in unary, then its low bits
+    void encodeExpGolomb(uint32_t value) {
+        uint64_t shifted = static_cast<uint64_t>(value) + 1;
+        int length = 0;
+        while ((shifted >> (length + 1)) != 0) length++;
+        for (int i = 0; i < length; ++i) encodeBypass(1);
+        encodeBypass(0);
+        for (int i = length - 1; i >= 0; --i) encodeBypass((shifted >> i) & 1);
+    }
+
+    uint32_t decodeExpGolomb() {
+        int length = 0;
+        while (decodeBypass()) {
+            if (++length > MAX_ESCAPE_BITS) {
+                throw runtime_error("Corrupt arithmetic-coded stream");
+            }
+        }
+        uint64_t shifted = 1;
+        for (int i = 0; i < length; ++i) shifted = (shifted << 1) | decodeBypass();
+        return static_cast<uint32_t>(shifted - 1);
+    }
+
+    static uint32_t zigzag(int value) {
+        return value >= 0 ? 2u * value : 2u * static_cast<uint32_t>(-(value + 1)) + 1;
+    }
+
+    static int unzigzag(uint32_t value) {
+        return (value & 1) ? -static_cast<int>(value >> 1) - 1 : static_cast<int>(value >> 1);
+    }
+
+protected:
+    void encodeValue(int value, SyntaxElement element) override {
+        segmentOpen = true;
+        if (element == SyntaxElement::Header) {
+            encodeExpGolomb(zigzag(value));
+            return;
+        }
+
+        Contexts& c = contexts[static_cast<int>(element)];
+        unsigned n = c.neighbourhood;
+        uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+        encodeBit(c.zero[n], magnitude != 0);
+        if (magnitude != 0) {
+            encodeBit(c.sign[n], value < 0);
+            uint32_t rest = magnitude - 1;
+            unsigned prefix = min<uint32_t>(rest, PREFIX_LENGTH);
+            uint16_t* prefixContexts = c.magnitude[n];
+            for (unsigned i = 0; i < prefix; ++i) {
+                encodeBit(prefixContexts[min(i, PREFIX_CONTEXTS - 1)], 1);
+            }
+            if (rest < PREFIX_LENGTH) {
+                encodeBit(prefixContexts[min(prefix, PREFIX_CONTEXTS - 1)], 0);
+            } else {
+                encodeExpGolomb(rest - PREFIX_LENGTH);
+            }
+        }
+        c.neighbourhood = min<uint32_t>(magnitude, NEIGHBOURHOODS - 1);
+    }
+
+    int decodeValue(SyntaxElement element) override {
+        if (needsStart) {
+            startDecoder();
+        }
+        segmentOpen = true;
+        if (element == SyntaxElement::Header) {
+            return unzigzag(decodeExpGolomb());
+        }
+
+        Contexts& c = contexts[static_cast<int>(element)];
+        unsigned n = c.neighbourhood;
+        uint32_t magnitude = 0;
+        if (decodeBit(c.zero[n])) {
+            bool negative = decodeBit(c.sign[n]);
+            uint16_t* prefixContexts = c.magnitude[n];
+            uint32_t rest = 0;
+            while (rest < PREFIX_LENGTH && decodeBit(prefixContexts[min<unsigned>(rest, PREFIX_CONTEXTS - 1)])) {
+                rest++;
+            }
+            if (rest == PREFIX_LENGTH) {
+                rest += decodeExpGolomb();
+            }
+            magnitude = rest + 1;
+            c.neighbourhood = min<uint32_t>(magnitude, NEIGHBOURHOODS - 1);
+            return negative ? -static_cast<int>(magnitude) : static_cast<int>(magnitude);
+        }
+        c.neighbourhood = 0;
+        return 0;
+    }
+
+public:
+    ArithmeticCoder(bool decoder, const string& file) : bs(file, decoder), decoder(decoder) {
+        resetContexts();
+    }
+
+    // Code to / from a memory buffer instead of a file
+    ArithmeticCoder(bool decoder, vector<uint8_t>& buffer) : bs(buffer, decoder), decoder(decoder) {
+        resetContexts();
+    }
+
+    void resetContexts() override {
+        for (Contexts& c : contexts) {
+            fill(std::begin(c.zero), std::end(c.zero), PROBABILITY_ONE / 2);
+            fill(std::begin(c.sign), std::end(c.sign), PROBABILITY_ONE / 2);
+            for (auto& prefixContexts : c.magnitude) {
+                fill(std::begin(prefixContexts), std::end(prefixContexts), PROBABILITY_ONE / 2);
+            }
+            c.neighbourhood = 0;
+        }
+    }
+
+    /*
+     * The encoder flushes the segment (5 bytes at most) and restarts; the
+     * decoder, which has read exactly those bytes, restarts on the next.
+     * Nothing happens when no symbol was coded since the last start.
+     */
+    void sync() override {
+        if (!segmentOpen) {
+            return;
+        }
+        segmentOpen = false;
+        if (decoder) {
+            needsStart = true;
+            return;
+        }
+        for (int i = 0; i < 5; ++i) {
+            shiftLow();
+        }
+        startEncoder();
+    }
+
+    void flush() override {
+        sync();
+        if (!decoder) {
+            bs.flush();
+        }
+    }
+
+    void end() override {
+        sync();
+        bs.end();
+    }
+
+    // Exact at segment starts; within a segment it counts the bytes still held back as well
+    uint64_t bitsWritten() const override {
+        return bs.bitsWritten() + (segmentOpen ? 8 * (cacheSize + 4) : 0);
+    }
+
+    void seekToBit(uint64_t bitOffset) override {
+        bs.seekToBit(bitOffset);
+        needsStart = true;
+        segmentOpen = false;
+    }
+};
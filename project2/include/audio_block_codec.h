@@ -0,0 +1,585 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "entropy_backend.h"
+#include "linear_prediction.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+/*
+ * Lossless audio coding in independent blocks, in the style of FLAC. Every
+ * channel of a block is predicted on its own, with whichever costs fewer
+ * bits of the best fixed polynomial predictor (order up to 4) and a linear
+ * predictor fitted to the block (order up to maxOrder, see
+ * LinearPrediction), and its residuals get their own Rice parameter. The
+ * first `order` samples of a channel are stored verbatim as warm-up, so no
+ * block depends on another: blocks are coded in parallel and written behind
+ * a seek table, and decoding can start at any block.
+ *
+ * Stereo blocks code one of the channel pairs of StereoMode, the cheapest
+ * one once all four signals are predicted. The side channel L - R takes one
+ * bit more than the samples; mid is (L + R) >> 1, its lost bit is the
+ * parity of the side. Other channel counts (5.1, 7.1, ...) code every
+ * channel on its own.
+ *
+ * Samples are int32 of sampleBits bits, up to 24 so residuals stay in int;
+ * the linear predictor switches to int64 sums when int32 could overflow.
+ *
+ * File layout, all fields little-endian:
+ *   uint32 blockFrames  uint32 blockCount  blockCount x uint64 block offset
+ *   blocks, each:
+ *     stereo only: uint8 StereoMode
+ *     per channel: uint8 predictor (order, LPC_FLAG for a linear predictor)
+ *                  LPC only: uint8 shift  order x int16 coefficients
+ *                  uint8 riceShift  order x warm-up samples (whole bytes of sampleBits,
+ *                                   sampleBits + 1 for side)
+ *     entropy-coded residuals, channel after channel (Rice m = 1 << riceShift)
+ * Offsets count from the end of the table. The number of frames and channels
+ * is not stored, the caller knows them (see AudioContainer). The stream
+ * can follow other data in a file; it runs to the end of the file.
+ *
+ * The streaming encode and decode hold CHUNK_BLOCKS blocks at a time, so
+ * their memory doesn't grow with the length of the audio.
+ */
+class AudioBlockCodec {
+public:
+    static const int DEFAULT_BLOCK_FRAMES = 4096;
+    static const int MAX_BLOCK_FRAMES = 1 << 20;  // bounds what a stream's header can make the decoder allocate
+    static const int MAX_FIXED_ORDER = 4;
+    static const int MAX_SAMPLE_BITS = 24;
+    static const int CHUNK_BLOCKS = 16;  // blocks in memory at a time when streaming
+
+    // Reads up to `frames` interleaved frames into the buffer and returns how many it read
+    using FrameReader = function<int(int32_t*, int)>;
+    // Takes the next `frames` decoded interleaved frames
+    using FrameWriter = function<void(const int32_t*, int)>;
+
+    // Signals coded for the two channels of a stereo block
+    enum class StereoMode : uint8_t {
+        Independent,  // left, right
+        LeftSide,     // left, left - right
+        SideRight,    // left - right, right
+        MidSide,      // (left + right) >> 1, left - right
+        Count
+    };
+
+private:
+    static const int RICE_SHIFTS = 30;
+    static const int LPC_FLAG = 0x80;
+    static const int MIN_PRECISION = 8;
+
+    int maxOrder;
+    int sampleBits;
+    int fixedM;  // Rice parameter of every block, 0 to choose it per block
+    EntropyBackend backend;
+    int blockFrames;
+
+    struct ChannelHeader {
+        bool lpc = false;
+        LinearPrediction::Coefficients coefficients;  // order and, for LPC, the predictor
+        int riceShift = 0;
+        uint64_t bits = 0;  // cost of the channel, header included
+    };
+
+    static void writeValue(vector<uint8_t>& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static uint64_t readValue(const uint8_t*& data, const uint8_t* end, int bytes) {
+        if (end - data < bytes) {
+            throw runtime_error("Truncated audio block");
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            value |= static_cast<uint64_t>(*data++) << (8 * i);
+        }
+        return value;
+    }
+
+    // Bytes of a verbatim sample of sampleBits bits
+    static int sampleBytes(int sampleBits) {
+        return (sampleBits + 7) / 8;
+    }
+
+    static int readSample(const uint8_t*& data, const uint8_t* end, int sampleBits) {
+        int bits = 8 * sampleBytes(sampleBits);
+        uint64_t value = readValue(data, end, bits / 8);
+        return static_cast<int>(static_cast<int64_t>(value << (64 - bits)) >> (64 - bits));  // sign-extend
+    }
+
+    // Polynomial predictors of FLAC's fixed subframes: order p fits a degree p - 1 polynomial
+    static int fixedPrediction(const int* x, int i, int order) {
+        switch (order) {
+            case 0: return 0;
+            case 1: return x[i - 1];
+            case 2: return 2 * x[i - 1] - x[i - 2];
+            case 3: return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+            default: return 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+        }
+    }
+
+    // Bits of a residual under Golomb mode 0 (sign, unary quotient, shift remainder bits)
+    static uint64_t riceBits(int residual, int shift) {
+        return 2 + (static_cast<uint32_t>(abs(residual)) >> shift) + shift;
+    }
+
+    int blockCount(int frames) const {
+        return static_cast<int>((static_cast<int64_t>(frames) + blockFrames - 1) / blockFrames);
+    }
+
+    // Cheapest Rice parameter of residuals [from, n), and the bits they take with it
+    int riceParameter(const int* residuals, int from, int n, uint64_t& bestBits) const {
+        if (fixedM > 0) {
+            int shift = 0;
+            while ((1 << shift) < fixedM) shift++;
+            bestBits = 0;
+            for (int i = from; i < n; ++i) bestBits += riceBits(residuals[i], shift);
+            return shift;
+        }
+        // The best shift is near log2 of the mean magnitude; only its neighbours are counted exactly
+        uint64_t total = 0;
+        for (int i = from; i < n; ++i) total += abs(residuals[i]);
+        uint64_t mean = total / max(n - from, 1);
+        int estimate = 0;
+        while (estimate + 1 < RICE_SHIFTS && (uint64_t(1) << (estimate + 1)) <= mean) estimate++;
+        int best = 0;
+        bestBits = UINT64_MAX;
+        for (int shift = max(estimate - 1, 0); shift <= min(estimate + 2, RICE_SHIFTS - 1); ++shift) {
+            uint64_t bits = 0;
+            for (int i = from; i < n; ++i) bits += riceBits(residuals[i], shift);
+            if (bits < bestBits) {
+                bestBits = bits;
+                best = shift;
+            }
+        }
+        return best;
+    }
+
+    // Fixed predictor with the smallest residuals, as FLAC picks it
+    ChannelHeader fixedPredictor(const int* x, int n, int sampleBits, vector<int>& residuals) const {
+        int orders = min(min(maxOrder, MAX_FIXED_ORDER), n) + 1;
+        uint64_t magnitude[MAX_FIXED_ORDER + 1] = {};
+        for (int i = orders - 1; i < n; ++i) {
+            for (int order = 0; order < orders; ++order) {
+                magnitude[order] += abs(x[i] - fixedPrediction(x, i, order));
+            }
+        }
+        ChannelHeader header;
+        header.coefficients.order = static_cast<int>(min_element(magnitude, magnitude + orders) - magnitude);
+        residuals.resize(n);
+        for (int i = header.coefficients.order; i < n; ++i) {
+            residuals[i] = x[i] - fixedPrediction(x, i, header.coefficients.order);
+        }
+        header.riceShift = riceParameter(residuals.data(), header.coefficients.order, n, header.bits);
+        header.bits += 16 + 8 * sampleBytes(sampleBits) * header.coefficients.order;
+        return header;
+    }
+
+    /*
+     * Linear predictor of the order whose expected cost is lowest: residual
+     * bits estimated from the Levinson-Durbin error, plus its coefficients
+     * and warm-up. Coefficients get the highest precision that keeps the
+     * prediction in int32, or full precision with int64 sums if none does
+     * (wide samples). Returns a header with no order if LPC doesn't apply.
+     */
+    ChannelHeader linearPredictor(const int* x, int n, int sampleBits, vector<int>& residuals) const {
+        ChannelHeader header;
+        header.lpc = true;
+        int lpcOrder = min(maxOrder, n / 4);
+        if (lpcOrder < 1) return header;
+
+        vector<double> windowed;
+        double r[LinearPrediction::MAX_ORDER + 1];
+        LinearPrediction::autocorrelation(x, n, lpcOrder, windowed, r);
+        double lp[LinearPrediction::MAX_ORDER][LinearPrediction::MAX_ORDER];
+        double errors[LinearPrediction::MAX_ORDER];
+        int reached = LinearPrediction::levinsonDurbin(r, lpcOrder, lp, errors);
+        if (reached < 1) return header;
+
+        double energy = 0;
+        for (int i = 0; i < n; ++i) energy += double(x[i]) * x[i];
+        double bestCost = 0;
+        int order = 0;
+        for (int m = 1; m <= reached; ++m) {
+            double variance = errors[m - 1] / r[0] * energy / n;
+            double cost = (n - m) * 0.5 * log2(max(variance, 1.0)) + m * (LinearPrediction::MAX_PRECISION + sampleBits);
+            if (order == 0 || cost < bestCost) {
+                bestCost = cost;
+                order = m;
+            }
+        }
+
+        header.coefficients = LinearPrediction::quantize(lp[order - 1], order, LinearPrediction::MAX_PRECISION);
+        for (int precision = LinearPrediction::MAX_PRECISION - 1;
+             precision >= MIN_PRECISION && !LinearPrediction::fitsInt32(header.coefficients, sampleBits); --precision) {
+            LinearPrediction::Coefficients lower = LinearPrediction::quantize(lp[order - 1], order, precision);
+            if (LinearPrediction::fitsInt32(lower, sampleBits)) header.coefficients = lower;
+        }
+        residuals.resize(n);
+        LinearPrediction::residuals(x, n, header.coefficients, sampleBits, residuals.data());
+        header.riceShift = riceParameter(residuals.data(), order, n, header.bits);
+        header.bits += 24 + (16 + 8 * sampleBytes(sampleBits)) * order;
+        return header;
+    }
+
+    // The cheaper of the two kinds of predictor for one signal of the block
+    ChannelHeader channelPredictor(const int* x, int n, int sampleBits, vector<int>& residuals,
+                                   vector<int>& scratch) const {
+        ChannelHeader header = fixedPredictor(x, n, sampleBits, residuals);
+        ChannelHeader lpc = linearPredictor(x, n, sampleBits, scratch);
+        if (lpc.coefficients.order > 0 && lpc.bits < header.bits) {
+            residuals.swap(scratch);
+            return lpc;
+        }
+        return header;
+    }
+
+    static void writeChannelHeader(vector<uint8_t>& out, const ChannelHeader& header, const int* x, int sampleBits) {
+        int order = header.coefficients.order;
+        writeValue(out, order | (header.lpc ? LPC_FLAG : 0), 1);
+        if (header.lpc) {
+            writeValue(out, header.coefficients.shift, 1);
+            for (int j = 0; j < order; ++j) {
+                writeValue(out, static_cast<uint16_t>(header.coefficients.values[j]), 2);
+            }
+        }
+        writeValue(out, header.riceShift, 1);
+        for (int i = 0; i < order; ++i) {
+            writeValue(out, static_cast<uint32_t>(x[i]), sampleBytes(sampleBits));
+        }
+    }
+
+    static bool isSide(StereoMode mode, int channel) {
+        return (mode == StereoMode::SideRight) ? channel == 0 : (mode != StereoMode::Independent && channel == 1);
+    }
+
+    // One block of `frames` interleaved frames, appended to `out`
+    void encodeBlock(const int32_t* samples, int frames, int channels, vector<uint8_t>& out) const {
+        // Stereo blocks have four candidate signals: left, right, side and mid
+        int signals = channels == 2 ? 4 : channels;
+        vector<vector<int>> x(signals, vector<int>(frames));
+        for (int c = 0; c < channels; ++c) {
+            for (int i = 0; i < frames; ++i) {
+                x[c][i] = samples[i * channels + c];
+            }
+        }
+        if (channels == 2) {
+            for (int i = 0; i < frames; ++i) {
+                x[2][i] = x[0][i] - x[1][i];
+                x[3][i] = (x[0][i] + x[1][i]) >> 1;
+            }
+        }
+
+        // Signal 2 of a stereo block is the side
+        auto bitsOf = [&](int signal) { return channels == 2 && signal == 2 ? sampleBits + 1 : sampleBits; };
+
+        vector<vector<int>> residuals(signals);
+        vector<int> scratch;
+        vector<ChannelHeader> headers(signals);
+        for (int s = 0; s < signals; ++s) {
+            headers[s] = channelPredictor(x[s].data(), frames, bitsOf(s), residuals[s], scratch);
+        }
+
+        // Signal coded in each channel slot
+        vector<int> coded(channels);
+        for (int c = 0; c < channels; ++c) coded[c] = c;
+        if (channels == 2) {
+            static const int pairs[][2] = {{0, 1}, {0, 2}, {2, 1}, {3, 2}};
+            int mode = 0;
+            for (int m = 1; m < static_cast<int>(StereoMode::Count); ++m) {
+                if (headers[pairs[m][0]].bits + headers[pairs[m][1]].bits <
+                    headers[pairs[mode][0]].bits + headers[pairs[mode][1]].bits) {
+                    mode = m;
+                }
+            }
+            writeValue(out, mode, 1);
+            coded[0] = pairs[mode][0];
+            coded[1] = pairs[mode][1];
+        }
+        for (int s : coded) {
+            writeChannelHeader(out, headers[s], x[s].data(), bitsOf(s));
+        }
+
+        // The coder appends its bytes behind the headers
+        unique_ptr<EntropyCoder> coder = makeEntropyCoder(backend, 1 << headers[coded[0]].riceShift, false, out, 0);
+        for (int s : coded) {
+            coder->setRiceParameter(SyntaxElement::Residual, 1 << headers[s].riceShift);
+            for (int i = headers[s].coefficients.order; i < frames; ++i) {
+                coder->encode(residuals[s][i]);
+            }
+        }
+        coder->end();
+    }
+
+    void decodeBlock(const uint8_t* data, const uint8_t* end, int frames, int channels, int32_t* samples) const {
+        StereoMode mode = StereoMode::Independent;
+        if (channels == 2) {
+            mode = static_cast<StereoMode>(readValue(data, end, 1));
+            if (mode >= StereoMode::Count) {
+                throw runtime_error("Corrupt audio block header");
+            }
+        }
+        vector<ChannelHeader> headers(channels);
+        vector<vector<int>> x(channels, vector<int>(frames));
+        for (int c = 0; c < channels; ++c) {
+            ChannelHeader& header = headers[c];
+            int bits = isSide(mode, c) ? sampleBits + 1 : sampleBits;
+            int predictor = static_cast<int>(readValue(data, end, 1));
+            header.lpc = (predictor & LPC_FLAG) != 0;
+            int order = predictor & ~LPC_FLAG;
+            header.coefficients.order = order;
+            if (order > min(header.lpc ? LinearPrediction::MAX_ORDER : MAX_FIXED_ORDER, frames)) {
+                throw runtime_error("Corrupt audio block header");
+            }
+            if (header.lpc) {
+                header.coefficients.shift = static_cast<int>(readValue(data, end, 1));
+                if (header.coefficients.shift > 31) {
+                    throw runtime_error("Corrupt audio block header");
+                }
+                for (int j = 0; j < order; ++j) {
+                    header.coefficients.values[j] = static_cast<int16_t>(readValue(data, end, 2));
+                }
+            }
+            header.riceShift = static_cast<int>(readValue(data, end, 1));
+            if (header.riceShift >= RICE_SHIFTS) {
+                throw runtime_error("Corrupt audio block header");
+            }
+            for (int i = 0; i < order; ++i) {
+                x[c][i] = readSample(data, end, bits);
+            }
+        }
+
+        vector<uint8_t> payload(data, end);
+        unique_ptr<EntropyCoder> coder = makeEntropyCoder(backend, 1 << headers[0].riceShift, true, payload, 0);
+        for (int c = 0; c < channels; ++c) {
+            const ChannelHeader& header = headers[c];
+            int order = header.coefficients.order;
+            coder->setRiceParameter(SyntaxElement::Residual, 1 << header.riceShift);
+            int* channel = x[c].data();
+            if (header.lpc) {
+                for (int i = order; i < frames; ++i) {
+                    channel[i] = coder->decode_val();
+                }
+                LinearPrediction::restore(channel, frames, header.coefficients,
+                                          isSide(mode, c) ? sampleBits + 1 : sampleBits);
+            } else {
+                for (int i = order; i < frames; ++i) {
+                    channel[i] = coder->decode_val() + fixedPrediction(channel, i, order);
+                }
+            }
+        }
+
+        // Back to left and right
+        for (int i = 0; i < frames && mode != StereoMode::Independent; ++i) {
+            int a = x[0][i], b = x[1][i];
+            switch (mode) {
+                case StereoMode::LeftSide: x[1][i] = a - b; break;
+                case StereoMode::SideRight: x[0][i] = a + b; break;
+                default: {
+                    int mid = (a << 1) | (b & 1);
+                    x[0][i] = (mid + b) >> 1;
+                    x[1][i] = (mid - b) >> 1;
+                }
+            }
+        }
+        for (int c = 0; c < channels; ++c) {
+            for (int i = 0; i < frames; ++i) {
+                samples[i * channels + c] = x[c][i];
+            }
+        }
+    }
+
+public:
+    // maxOrder 0 to 32 (fixed predictors stop at 4); m > 0 fixes the Rice parameter (rounded up to a power of two)
+    AudioBlockCodec(int maxOrder, int m = 0, EntropyBackend backend = EntropyBackend::Rice,
+                    int sampleBits = 16, int blockFrames = DEFAULT_BLOCK_FRAMES)
+        : maxOrder(maxOrder), sampleBits(sampleBits), fixedM(m), backend(backend), blockFrames(blockFrames) {
+        if (maxOrder < 0 || maxOrder > LinearPrediction::MAX_ORDER) {
+            throw invalid_argument("Predictor order must be between 0 and 32");
+        }
+        if (sampleBits < 1 || sampleBits > MAX_SAMPLE_BITS) {
+            throw invalid_argument("Samples must have between 1 and 24 bits");
+        }
+        if (blockFrames <= 0 || blockFrames > MAX_BLOCK_FRAMES) {
+            throw invalid_argument("Block size must be between 1 and " + to_string(MAX_BLOCK_FRAMES));
+        }
+    }
+
+    /*
+     * Encodes the `frames` frames `read` delivers at the current position
+     * of `file`. The seek table is reserved up front and each chunk's
+     * entries are filled in once its blocks are written.
+     */
+    void encode(const FrameReader& read, int frames, int channels, ostream& file) const {
+        int blocks = blockCount(frames);
+        uint64_t start = file.tellp();
+        vector<uint8_t> bytes;
+        writeValue(bytes, blockFrames, 4);
+        writeValue(bytes, blocks, 4);
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        bytes.assign(8 * min(blocks, CHUNK_BLOCKS), 0);
+        for (int b = 0; b < blocks; b += CHUNK_BLOCKS) {
+            file.write(reinterpret_cast<const char*>(bytes.data()), 8 * min(blocks - b, CHUNK_BLOCKS));
+        }
+
+        vector<int32_t> chunk(static_cast<size_t>(CHUNK_BLOCKS) * blockFrames * channels);
+        vector<vector<uint8_t>> encoded(CHUNK_BLOCKS);
+        uint64_t offset = 0;
+        for (int firstBlock = 0; firstBlock < blocks; firstBlock += CHUNK_BLOCKS) {
+            int count = min(CHUNK_BLOCKS, blocks - firstBlock);
+            int chunkFrames = min(count * blockFrames, frames - firstBlock * blockFrames);
+            for (int done = 0; done < chunkFrames;) {
+                int got = read(chunk.data() + static_cast<size_t>(done) * channels, chunkFrames - done);
+                if (got <= 0) {
+                    throw runtime_error("Audio input ended early");
+                }
+                done += got;
+            }
+            ThreadPool::shared().parallelFor(0, count, [&](int b) {
+                int first = b * blockFrames;
+                encoded[b].clear();
+                encodeBlock(chunk.data() + static_cast<size_t>(first) * channels, min(blockFrames, chunkFrames - first),
+                            channels, encoded[b]);
+            });
+
+            bytes.clear();
+            for (int b = 0; b < count; ++b) {
+                writeValue(bytes, offset, 8);
+                offset += encoded[b].size();
+            }
+            file.seekp(start + 8 + 8 * static_cast<uint64_t>(firstBlock));
+            file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            file.seekp(0, ios::end);
+            for (int b = 0; b < count; ++b) {
+                file.write(reinterpret_cast<const char*>(encoded[b].data()), encoded[b].size());
+            }
+        }
+        if (!file) {
+            throw runtime_error("Unable to write file");
+        }
+    }
+
+    void encode(const FrameReader& read, int frames, int channels, const string& outputFile) const {
+        ofstream file(outputFile, ios::binary);
+        if (!file) {
+            throw runtime_error("Unable to open file");
+        }
+        encode(read, frames, channels, file);
+    }
+
+    // Interleaved samples, frames x channels
+    void encode(const int32_t* samples, int frames, int channels, const string& outputFile) const {
+        size_t position = 0;
+        encode([&](int32_t* out, int count) {
+            copy(samples + position, samples + position + static_cast<size_t>(count) * channels, out);
+            position += static_cast<size_t>(count) * channels;
+            return count;
+        }, frames, channels, outputFile);
+    }
+
+    /*
+     * Frames [firstFrame, firstFrame + frameCount) of a stream of `frames`
+     * frames starting at the current position of `file`, handed to `write`
+     * a chunk at a time; frameCount -1 decodes to the end. Only the blocks
+     * holding them are read, and only their part of the seek table.
+     */
+    void decode(istream& file, int frames, int channels, const FrameWriter& write,
+                int firstFrame = 0, int frameCount = -1) const {
+        if (frameCount < 0) frameCount = frames - firstFrame;
+        if (firstFrame < 0 || frameCount < 0 || firstFrame + frameCount > frames) {
+            throw invalid_argument("Frame range outside the file");
+        }
+        if (frameCount == 0) return;
+
+        uint64_t start = file.tellg();
+        file.seekg(0, ios::end);
+        uint64_t fileSize = static_cast<uint64_t>(file.tellg()) - start;
+        file.seekg(start);
+        vector<uint8_t> bytes(8);
+        file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+        const uint8_t* data = bytes.data();
+        int storedBlockFrames = static_cast<int>(readValue(data, bytes.data() + 8, 4));
+        int blocks = static_cast<int>(readValue(data, bytes.data() + 8, 4));
+        if (storedBlockFrames <= 0 || storedBlockFrames > MAX_BLOCK_FRAMES ||
+            blocks != (static_cast<int64_t>(frames) + storedBlockFrames - 1) / storedBlockFrames) {
+            throw runtime_error("Audio file doesn't match the given frame count");
+        }
+        uint64_t dataStart = 8 + 8 * static_cast<uint64_t>(blocks);
+        if (fileSize < dataStart) {
+            throw runtime_error("Truncated audio file");
+        }
+
+        int firstBlock = firstFrame / storedBlockFrames;
+        int lastBlock = (firstFrame + frameCount - 1) / storedBlockFrames;
+        vector<uint64_t> offsets(CHUNK_BLOCKS + 1);
+        vector<uint8_t> span;
+        vector<int32_t> chunk(static_cast<size_t>(CHUNK_BLOCKS) * storedBlockFrames * channels);
+        for (int chunkStart = firstBlock; chunkStart <= lastBlock; chunkStart += CHUNK_BLOCKS) {
+            int count = min(CHUNK_BLOCKS, lastBlock + 1 - chunkStart);
+
+            // This chunk's table entries, and where the block after it starts
+            int entries = min(count + 1, blocks - chunkStart);
+            bytes.resize(8 * entries);
+            file.seekg(start + 8 + 8 * static_cast<uint64_t>(chunkStart));
+            file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+            data = bytes.data();
+            for (int b = 0; b < entries; ++b) {
+                offsets[b] = readValue(data, bytes.data() + bytes.size(), 8);
+            }
+            if (entries == count) offsets[count] = fileSize - dataStart;
+            for (int b = 0; b < count; ++b) {
+                if (offsets[b + 1] < offsets[b] || offsets[b + 1] > fileSize - dataStart) {
+                    throw runtime_error("Corrupt audio seek table");
+                }
+            }
+
+            // Read the chunk's blocks in one go, then decode them in parallel
+            span.resize(offsets[count] - offsets[0]);
+            file.seekg(start + dataStart + offsets[0]);
+            file.read(reinterpret_cast<char*>(span.data()), span.size());
+            if (static_cast<size_t>(file.gcount()) != span.size()) {
+                throw runtime_error("Truncated audio file");
+            }
+            ThreadPool::shared().parallelFor(0, count, [&](int b) {
+                int first = (chunkStart + b) * storedBlockFrames;
+                decodeBlock(span.data() + (offsets[b] - offsets[0]), span.data() + (offsets[b + 1] - offsets[0]),
+                            min(storedBlockFrames, frames - first), channels,
+                            chunk.data() + static_cast<size_t>(b) * storedBlockFrames * channels);
+            });
+
+            int chunkFirst = chunkStart * storedBlockFrames;
+            int from = max(firstFrame, chunkFirst);
+            int to = static_cast<int>(min<int64_t>(firstFrame + frameCount, chunkFirst + static_cast<int64_t>(count) * storedBlockFrames));
+            write(chunk.data() + static_cast<size_t>(from - chunkFirst) * channels, to - from);
+        }
+    }
+
+    void decode(const string& inputFile, int frames, int channels, const FrameWriter& write,
+                int firstFrame = 0, int frameCount = -1) const {
+        ifstream file(inputFile, ios::binary);
+        if (!file) {
+            throw runtime_error("Unable to open file");
+        }
+        decode(file, frames, channels, write, firstFrame, frameCount);
+    }
+
+    // Frames [firstFrame, firstFrame + frameCount), interleaved
+    vector<int32_t> decode(const string& inputFile, int frames, int channels,
+                           int firstFrame = 0, int frameCount = -1) const {
+        vector<int32_t> samples;
+        decode(inputFile, frames, channels, [&](const int32_t* decoded, int count) {
+            samples.insert(samples.end(), decoded, decoded + static_cast<size_t>(count) * channels);
+        }, firstFrame, frameCount);
+        return samples;
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include "entropy_backend.h"
+
+using namespace std;
+
+/*
+ * Header of an encoded audio file: everything the decoder needs besides the
+ * payload, so a file decodes on its own. All fields little-endian:
+ *   char[4] "AUDC"  uint8 version
+ *   uint32 sampleRate  uint16 channels  uint8 bitsPerSample  uint64 frames
+ *   uint8 mode  uint8 entropy backend  uint8 predictorOrder
+ *   uint32 golombM (0: chosen per block)
+ *   lossy encoder settings, informative only (steps are in the payload):
+ *   uint8 quantizedBits (constant step)  uint32 targetBitrate (bits/s, 0 for
+ *   a constant step)  uint8 noiseShaping
+ * The payload follows: an AudioBlockCodec stream (block table and blocks)
+ * for lossless files, chunks of quantized residuals for lossy ones. Samples
+ * have bitsPerSample bits, 8 to 24.
+ */
+struct AudioContainer {
+    enum class Mode : uint8_t { Lossless, Lossy };
+
+    static const uint8_t VERSION = 3;
+
+    int sampleRate = 0;
+    int channels = 0;
+    int bitsPerSample = 16;
+    int frames = 0;
+    Mode mode = Mode::Lossless;
+    EntropyBackend backend = EntropyBackend::Rice;
+    int predictorOrder = 0;
+    int golombM = 0;
+    int quantizedBits = 16;
+    int targetBitrate = 0;
+    bool noiseShaping = false;
+
+    void write(ostream& out) const {
+        out.write("AUDC", 4);
+        put(out, VERSION, 1);
+        put(out, sampleRate, 4);
+        put(out, channels, 2);
+        put(out, bitsPerSample, 1);
+        put(out, frames, 8);
+        put(out, static_cast<uint8_t>(mode), 1);
+        put(out, static_cast<uint8_t>(backend), 1);
+        put(out, predictorOrder, 1);
+        put(out, golombM, 4);
+        put(out, quantizedBits, 1);
+        put(out, targetBitrate, 4);
+        put(out, noiseShaping, 1);
+        if (!out) {
+            throw runtime_error("Unable to write audio header");
+        }
+    }
+
+    static AudioContainer read(istream& in) {
+        char magic[4];
+        if (!in.read(magic, 4) || memcmp(magic, "AUDC", 4) != 0) {
+            throw runtime_error("Not an encoded audio file");
+        }
+        if (get(in, 1) != VERSION) {
+            throw runtime_error("Unsupported encoded audio version");
+        }
+        AudioContainer container;
+        container.sampleRate = static_cast<int>(get(in, 4));
+        container.channels = static_cast<int>(get(in, 2));
+        container.bitsPerSample = static_cast<int>(get(in, 1));
+        uint64_t frames = get(in, 8);
+        uint64_t mode = get(in, 1);
+        uint64_t backend = get(in, 1);
+        container.predictorOrder = static_cast<int>(get(in, 1));
+        container.golombM = static_cast<int>(get(in, 4));
+        container.quantizedBits = static_cast<int>(get(in, 1));
+        uint64_t targetBitrate = get(in, 4);
+        container.noiseShaping = get(in, 1) != 0;
+        if (container.channels < 1 || container.bitsPerSample < 8 || container.bitsPerSample > 24 || frames > INT_MAX || mode > static_cast<uint8_t>(Mode::Lossy) ||
+            backend > static_cast<uint8_t>(EntropyBackend::Rans) || container.golombM < 0 ||
+            container.quantizedBits < 1 || container.quantizedBits > container.bitsPerSample || targetBitrate > INT_MAX) {
+            throw runtime_error("Corrupt encoded audio header");
+        }
+        container.frames = static_cast<int>(frames);
+        container.targetBitrate = static_cast<int>(targetBitrate);
+        container.mode = static_cast<Mode>(mode);
+        container.backend = static_cast<EntropyBackend>(backend);
+        return container;
+    }
+
+private:
+    static void put(ostream& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out.put(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    static uint64_t get(istream& in, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            int byte = in.get();
+            if (byte == EOF) {
+                throw runtime_error("Truncated encoded audio header");
+            }
+            value |= static_cast<uint64_t>(byte) << (8 * i);
+        }
+        return value;
+    }
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "entropy_coder.h"
+#include "arithmetic_coder.h"
+#include "rans_coder.h"
+
+using namespace std;
+
+// Entropy coder of a stream, chosen at encode time and recorded in its metadata
+enum class EntropyBackend {
+    Rice,        // Golomb / Rice codes, the original format
+    Arithmetic,  // adaptive binary arithmetic coding, see ArithmeticCoder
+    Rans         // static interleaved rANS, see RansCoder
+};
+
+inline string entropyBackendName(EntropyBackend backend) {
+    switch (backend) {
+        case EntropyBackend::Arithmetic: return "arithmetic";
+        case EntropyBackend::Rans: return "rans";
+        default: return "rice";
+    }
+}
+
+inline EntropyBackend parseEntropyBackend(const string& name) {
+    if (name == "rice") return EntropyBackend::Rice;
+    if (name == "arithmetic") return EntropyBackend::Arithmetic;
+    if (name == "rans") return EntropyBackend::Rans;
+    throw invalid_argument("Unknown entropy coder: " + name);
+}
+
+// m and mode are the Rice parameters (see Golomb) and unused by the other coders
+inline unique_ptr<EntropyCoder> makeEntropyCoder(EntropyBackend backend, int m, bool decoder,
+                                                 const string& file, int mode = 1) {
+    if (backend == EntropyBackend::Arithmetic) {
+        return make_unique<ArithmeticCoder>(decoder, file);
+    }
+    if (backend == EntropyBackend::Rans) {
+        return make_unique<RansCoder>(decoder, file);
+    }
+    return make_unique<GolombCoder>(m, decoder, file, mode);
+}
+
+inline unique_ptr<EntropyCoder> makeEntropyCoder(EntropyBackend backend, int m, bool decoder,
+                                                 vector<uint8_t>& buffer, int mode = 1) {
+    if (backend == EntropyBackend::Arithmetic) {
+        return make_unique<ArithmeticCoder>(decoder, buffer);
+    }
+    if (backend == EntropyBackend::Rans) {
+        return make_unique<RansCoder>(decoder, buffer);
+    }
+    return make_unique<GolombCoder>(m, decoder, buffer, mode);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Golomb.h"
+
+using namespace std;
+
+/*
+ * What a coded value stands for. Adaptive backends keep separate statistics
+ * per element; Rice ignores it. Header values (frame types, sizes, counts)
+ * are rare and coded without adaptive state.
+ */
+enum class SyntaxElement {
+    Header,
+    Flag,
+    IntraMode,
+    MotionVector,
+    Residual,
+    Level,
+    Run,
+    Count
+};
+
+/*
+ * Entropy coder of the codecs' signed integer symbols, one object for
+ * either direction like Golomb.
+ *
+ * Adaptive backends code the stream in segments: sync() ends one and starts
+ * the next, and decoding can begin at any segment start (seekToBit with an
+ * offset taken with bitsWritten() right after sync()). Encoder and decoder
+ * must call sync() and resetContexts() at the same points of the symbol
+ * sequence. Both are free for Rice, whose stream is unchanged by them.
+ * bitsWritten() is exact right after sync(); within a segment, coders that
+ * hold symbols back may not count all of them yet.
+ */
+class EntropyCoder {
+protected:
+    virtual void encodeValue(int value, SyntaxElement element) = 0;
+    virtual int decodeValue(SyntaxElement element) = 0;
+
+public:
+    virtual ~EntropyCoder() = default;
+
+    void encode(int value, SyntaxElement element = SyntaxElement::Residual) {
+        encodeValue(value, element);
+    }
+
+    int decode_val(SyntaxElement element = SyntaxElement::Residual) {
+        return decodeValue(element);
+    }
+
+    // Golomb parameter of one element's values from here on; only Rice has one
+    virtual void setRiceParameter(SyntaxElement, int) {}
+
+    virtual void sync() {}
+    // Forget the adapted statistics, as in a freshly built coder
+    virtual void resetContexts() {}
+
+    // Close the current segment and byte-align, e.g. to close a packet; encoding can go on after it
+    virtual void flush() = 0;
+    // End of encoding
+    virtual void end() = 0;
+    virtual uint64_t bitsWritten() const = 0;
+    virtual void seekToBit(uint64_t bitOffset) = 0;
+};
+
+// The codecs' Rice coding behind the EntropyCoder interface
+class GolombCoder : public EntropyCoder {
+private:
+    Golomb golomb;
+    int parameters[static_cast<int>(SyntaxElement::Count)];  // m of each element, the constructor's by default
+
+    void useParameterOf(SyntaxElement element) {
+        int m = parameters[static_cast<int>(element)];
+        if (m != golomb.getM()) golomb.setM(m);
+    }
+
+protected:
+    void encodeValue(int value, SyntaxElement element) override {
+        useParameterOf(element);
+        golomb.encode(value);
+    }
+
+    int decodeValue(SyntaxElement element) override {
+        useParameterOf(element);
+        return golomb.decode_val();
+    }
+
+public:
+    GolombCoder(int m, bool decoder, const string& file, int mode = 1)
+        : golomb(m, decoder, file, mode) {
+        fill(std::begin(parameters), std::end(parameters), m);
+    }
+
+    GolombCoder(int m, bool decoder, vector<uint8_t>& buffer, int mode = 1)
+        : golomb(m, decoder, buffer, mode) {
+        fill(std::begin(parameters), std::end(parameters), m);
+    }
+
+    void setRiceParameter(SyntaxElement element, int m) override {
+        if (m <= 0) {
+            throw invalid_argument("Golomb parameter 'm' must be > 0.");
+        }
+        parameters[static_cast<int>(element)] = m;
+    }
+
+    void flush() override { golomb.flush(); }
+    void end() override { golomb.end(); }
+    uint64_t bitsWritten() const override { return golomb.bitsWritten(); }
+    void seekToBit(uint64_t bitOffset) override { golomb.seekToBit(bitOffset); }
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Building blocks for the codecs' frame pipelines: stages on their own
+ * threads joined by bounded single-producer single-consumer rings, so
+ * reading, entropy decoding, reconstruction and writing overlap. The frames
+ * in flight are a fixed set of buffers that cycle between two stages
+ * (BufferRing), so once they have grown to frame size a pipeline allocates
+ * nothing per frame.
+ */
+
+/*
+ * Lock-free bounded SPSC ring. The producer alone advances `tail`, the
+ * consumer alone advances `head`; a slot is handed over by the release store
+ * of the index that publishes it. Blocking push/pop spin with yield, which is
+ * cheap next to the milliseconds a frame takes to code.
+ *
+ * close() ends the stream from either side: the consumer still drains what
+ * was pushed, and the producer's next push fails, so a failing stage never
+ * leaves the other one waiting.
+ */
+template<typename T>
+class SpscRing {
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};  // next slot to pop
+    alignas(64) atomic<size_t> tail{0};  // next slot to fill
+    atomic<bool> closed{false};
+
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    bool tryPush(T& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = move(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        value = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Wait for a free slot; false once the ring is closed
+    bool push(T value) {
+        while (!closed.load(memory_order_acquire)) {
+            if (tryPush(value)) return true;
+            this_thread::yield();
+        }
+        return false;
+    }
+
+    // Wait for an item; false once the ring is closed and drained
+    bool pop(T& value) {
+        while (!tryPop(value)) {
+            if (closed.load(memory_order_acquire)) {
+                return tryPop(value);  // items pushed just before close
+            }
+            this_thread::yield();
+        }
+        return true;
+    }
+
+    void close() { closed.store(true, memory_order_release); }
+};
+
+/*
+ * A fixed set of `count` buffers cycling producer -> consumer -> producer:
+ * the filled ring carries them forward and the returned ring brings them back, so
+ * the producer refills storage the consumer is done with instead of
+ * building a new frame. The buffers start out default-constructed and grow
+ * on first use.
+ */
+template<typename T>
+class BufferRing {
+private:
+    SpscRing<T> filled;
+    SpscRing<T> returned;
+
+public:
+    explicit BufferRing(size_t count) : filled(count), returned(count) {
+        for (size_t i = 0; i < count; ++i) {
+            T buffer;
+            returned.tryPush(buffer);
+        }
+    }
+
+    // Producer: a buffer to fill, waiting for the consumer to return one; false once closed
+    bool acquire(T& buffer) { return returned.pop(buffer); }
+    // Producer: hand a filled buffer over; false once closed
+    bool publish(T& buffer) { return filled.push(move(buffer)); }
+
+    // Consumer: the next filled buffer; false once closed and drained
+    bool receive(T& buffer) { return filled.pop(buffer); }
+    // Consumer: give a buffer back for refilling; one more than the ring holds is dropped
+    void release(T& buffer) { returned.tryPush(buffer); }
+
+    void close() {
+        filled.close();
+        returned.close();
+    }
+};
+
+// Closes a ring when leaving a scope, normally or by an exception
+template<typename Ring>
+class RingCloser {
+private:
+    Ring& ring;
+
+public:
+    explicit RingCloser(Ring& ring) : ring(ring) {}
+    ~RingCloser() { ring.close(); }
+};
+
+/*
+ * One pipeline stage on its own thread. join() waits for it and rethrows
+ * what the stage threw; the destructor only waits, so declare the rings a
+ * stage uses before it and close them (RingCloser) on both sides.
+ */
+class PipelineStage {
+private:
+    thread worker;
+    exception_ptr error;
+
+public:
+    PipelineStage() = default;
+    PipelineStage(const PipelineStage&) = delete;
+    PipelineStage& operator=(const PipelineStage&) = delete;
+
+    void start(function<void()> body) {
+        worker = thread([this, body = move(body)]() {
+            try {
+                body();
+            } catch (...) {
+                error = current_exception();
+            }
+        });
+    }
+
+    void join() {
+        if (worker.joinable()) worker.join();
+        if (error) {
+            exception_ptr pending = error;
+            error = nullptr;
+            rethrow_exception(pending);
+        }
+    }
+
+    ~PipelineStage() {
+        if (worker.joinable()) worker.join();
+    }
+};
+
+/*
+ * Producer stage: calls produce() on its own thread until it returns false
+ * and queues the results, e.g. Y4M frames read ahead of the encoder from a
+ * stream of unknown length. produce() fills a recycled frame: it must
+ * overwrite all of it, reusing the storage where the sizes match.
+ */
+template<typename Frame>
+class FrameSource {
+private:
+    BufferRing<Frame> ring;
+    PipelineStage stage;  // declared after the ring, so it is joined first
+
+public:
+    FrameSource(size_t depth, function<bool(Frame&)> produce) : ring(depth) {
+        stage.start([this, produce = move(produce)]() {
+            RingCloser<BufferRing<Frame>> done(ring);
+            Frame frame;
+            while (ring.acquire(frame) && produce(frame)) {
+                if (!ring.publish(frame)) break;
+            }
+        });
+    }
+
+    /*
+     * Next frame, in place of the one `frame` held, which goes back to the
+     * producer for refilling: keep nothing that shares its buffers (swap a
+     * frame out of `frame` to hold on to it). False at the end of the
+     * stream; rethrows the producer's error.
+     */
+    bool next(Frame& frame) {
+        ring.release(frame);
+        if (!ring.receive(frame)) {
+            stage.join();
+            return false;
+        }
+        return true;
+    }
+
+    ~FrameSource() { ring.close(); }
+};
+
+/*
+ * Consumer stage: calls consume() on its own thread for every frame pushed,
+ * in order, e.g. Y4M frames written behind the decoder. Consumed frames
+ * return to the ring, and acquire() hands them out again for the next
+ * frames to be built in.
+ */
+template<typename Frame>
+class FrameSink {
+private:
+    BufferRing<Frame> ring;
+    PipelineStage stage;
+
+public:
+    FrameSink(size_t depth, function<void(Frame&)> consume) : ring(depth) {
+        stage.start([this, consume = move(consume)]() {
+            RingCloser<BufferRing<Frame>> stopProducer(ring);  // if consume() throws
+            Frame frame;
+            while (ring.receive(frame)) {
+                consume(frame);
+                ring.release(frame);
+            }
+        });
+    }
+
+    /*
+     * A consumed frame to build the next one in, holding its old contents;
+     * waits while every frame is queued. Rethrows the consumer's error if
+     * it has stopped.
+     */
+    void acquire(Frame& frame) {
+        if (!ring.acquire(frame)) {
+            stopped();
+        }
+    }
+
+    // Queue a frame; rethrows the consumer's error if it has stopped
+    void push(Frame frame) {
+        if (!ring.publish(frame)) {
+            stopped();
+        }
+    }
+
+    // Wait until every queued frame is consumed
+    void finish() {
+        ring.close();
+        stage.join();
+    }
+
+    ~FrameSink() { ring.close(); }
+
+private:
+    void stopped() {
+        stage.join();
+        throw runtime_error("Frame pipeline stopped");
+    }
+};
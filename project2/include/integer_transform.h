@@ -0,0 +1,274 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/*
+ * 4x4 / 8x8 integer DCT approximation with the H.264 butterflies.
+ *
+ * The forward transform is C = T X T' with the integer H.264 matrices, whose
+ * rows are orthogonal but not normalized (T T' = D). The missing 1/sqrt(D)
+ * factors are folded into the quantization and dequantization tables, so the
+ * quantizer step is expressed in the orthonormal domain and keeps the meaning
+ * of the spatial quantization step (same MSE per step).
+ */
+class IntegerTransform {
+public:
+    // Quantization / dequantization factors for one step size, raster order
+    struct QuantTable {
+        vector<int64_t> multiplier;  // level = (|c| * multiplier + rounding) >> QUANT_SHIFT
+        vector<int> scale;           // dequantized = level * scale (pre-shifted by dequantShift)
+        int64_t rounding;
+    };
+
+private:
+    static const int QUANT_SHIFT = 20;
+
+    int n;
+    int dequantShift;      // precision of the dequantized coefficients
+    vector<int> rowNorms;  // squared norm of each row of T
+    vector<int> zigzag;    // scan position -> raster index
+
+    // Shift-and-add constant multiplies, shared by the scalar and SIMD code
+    template<typename T> static T times2(T x) { return x + x; }
+    template<typename T> static T times3(T x) { return x + x + x; }
+    template<typename T> static T times6(T x) { return times3(x) + times3(x); }
+    template<typename T> static T times10(T x) { T x2 = times2(x); return times2(times2(x2)) + x2; }
+    template<typename T> static T times12(T x) { return times2(times6(x)); }
+
+    // 1D forward transforms: x holds n samples, replaced by n coefficients
+    template<typename T> static void forward4(T* x) {
+        T a0 = x[0] + x[3], a1 = x[1] + x[2];
+        T b0 = x[0] - x[3], b1 = x[1] - x[2];
+        x[0] = a0 + a1;
+        x[2] = a0 - a1;
+        x[1] = times2(b0) + b1;
+        x[3] = b0 - times2(b1);
+    }
+
+    template<typename T> static void forward8(T* x) {
+        T a[4] = {x[0] + x[7], x[1] + x[6], x[2] + x[5], x[3] + x[4]};
+        T b0 = x[0] - x[7], b1 = x[1] - x[6], b2 = x[2] - x[5], b3 = x[3] - x[4];
+        // The even half is the 4-point transform of the folded samples
+        forward4(a);
+        x[0] = a[0]; x[2] = a[1]; x[4] = a[2]; x[6] = a[3];
+        x[1] = times12(b0) + times10(b1) + times6(b2) + times3(b3);
+        x[3] = times10(b0) - times3(b1) - times12(b2) - times6(b3);
+        x[5] = times6(b0) - times12(b1) + times3(b2) + times10(b3);
+        x[7] = times3(b0) - times6(b1) + times10(b2) - times12(b3);
+    }
+
+    // 1D inverse transforms: x = T' z
+    template<typename T> static void inverse4(T* z) {
+        T p0 = z[0] + z[2], p1 = z[0] - z[2];
+        T q0 = times2(z[1]) + z[3], q1 = z[1] - times2(z[3]);
+        z[0] = p0 + q0;
+        z[1] = p1 + q1;
+        z[2] = p1 - q1;
+        z[3] = p0 - q0;
+    }
+
+    template<typename T> static void inverse8(T* z) {
+        T e[4] = {z[0], z[2], z[4], z[6]};
+        inverse4(e);
+        T o0 = times12(z[1]) + times10(z[3]) + times6(z[5]) + times3(z[7]);
+        T o1 = times10(z[1]) - times3(z[3]) - times12(z[5]) - times6(z[7]);
+        T o2 = times6(z[1]) - times12(z[3]) + times3(z[5]) + times10(z[7]);
+        T o3 = times3(z[1]) - times6(z[3]) + times10(z[5]) - times12(z[7]);
+        z[0] = e[0] + o0; z[7] = e[0] - o0;
+        z[1] = e[1] + o1; z[6] = e[1] - o1;
+        z[2] = e[2] + o2; z[5] = e[2] - o2;
+        z[3] = e[3] + o3; z[4] = e[3] - o3;
+    }
+
+#ifdef __SSE2__
+    // Four int32 lanes, so the butterflies above run on four columns at once
+    struct Lanes {
+        __m128i v;
+        Lanes operator+(Lanes o) const { return {_mm_add_epi32(v, o.v)}; }
+        Lanes operator-(Lanes o) const { return {_mm_sub_epi32(v, o.v)}; }
+    };
+
+    static void transpose4(Lanes& r0, Lanes& r1, Lanes& r2, Lanes& r3) {
+        __m128i t0 = _mm_unpacklo_epi32(r0.v, r1.v);
+        __m128i t1 = _mm_unpacklo_epi32(r2.v, r3.v);
+        __m128i t2 = _mm_unpackhi_epi32(r0.v, r1.v);
+        __m128i t3 = _mm_unpackhi_epi32(r2.v, r3.v);
+        r0.v = _mm_unpacklo_epi64(t0, t1);
+        r1.v = _mm_unpackhi_epi64(t0, t1);
+        r2.v = _mm_unpacklo_epi64(t2, t3);
+        r3.v = _mm_unpackhi_epi64(t2, t3);
+    }
+
+    // lo[i] / hi[i] hold columns 0-3 / 4-7 of row i
+    static void transpose8(Lanes* lo, Lanes* hi) {
+        transpose4(lo[0], lo[1], lo[2], lo[3]);
+        transpose4(hi[0], hi[1], hi[2], hi[3]);
+        transpose4(lo[4], lo[5], lo[6], lo[7]);
+        transpose4(hi[4], hi[5], hi[6], hi[7]);
+        for (int i = 0; i < 4; ++i) {
+            Lanes t = hi[i];
+            hi[i] = lo[i + 4];
+            lo[i + 4] = t;
+        }
+    }
+
+    template<bool inverse> void transformSIMD(const int* in, int* out) const {
+        if (n == 4) {
+            Lanes r[4];
+            for (int i = 0; i < 4; ++i) r[i].v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+            inverse ? inverse4(r) : forward4(r);
+            transpose4(r[0], r[1], r[2], r[3]);
+            inverse ? inverse4(r) : forward4(r);
+            transpose4(r[0], r[1], r[2], r[3]);
+            for (int i = 0; i < 4; ++i) _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), r[i].v);
+        } else {
+            Lanes lo[8], hi[8];
+            for (int i = 0; i < 8; ++i) {
+                lo[i].v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 * i));
+                hi[i].v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 * i + 4));
+            }
+            inverse ? inverse8(lo) : forward8(lo);
+            inverse ? inverse8(hi) : forward8(hi);
+            transpose8(lo, hi);
+            inverse ? inverse8(lo) : forward8(lo);
+            inverse ? inverse8(hi) : forward8(hi);
+            transpose8(lo, hi);
+            for (int i = 0; i < 8; ++i) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8 * i), lo[i].v);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8 * i + 4), hi[i].v);
+            }
+        }
+    }
+#endif
+
+    // Portable version: columns first, then rows
+    template<bool inverse> void transformScalar(const int* in, int* out) const {
+        int line[8];
+        for (int i = 0; i < n * n; ++i) out[i] = in[i];
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int k = 0; k < n; ++k) {
+                for (int i = 0; i < n; ++i) line[i] = pass == 0 ? out[i * n + k] : out[k * n + i];
+                if (n == 4) inverse ? inverse4(line) : forward4(line);
+                else inverse ? inverse8(line) : forward8(line);
+                for (int i = 0; i < n; ++i) (pass == 0 ? out[i * n + k] : out[k * n + i]) = line[i];
+            }
+        }
+    }
+
+    // Drops the dequantization precision from an inverse transform's output
+    void roundInverse(int* block) const {
+        const int half = 1 << (dequantShift - 1);
+        for (int i = 0; i < n * n; ++i) {
+            block[i] = (block[i] + half) >> dequantShift;
+        }
+    }
+
+    // H.264 default scaling lists (16 = neutral), upsampled for 8x8 as in HEVC
+    int matrixWeight(int row, int col, bool intra) const {
+        static const int intra4x4[16] = { 6, 13, 20, 28, 13, 20, 28, 32, 20, 28, 32, 37, 28, 32, 37, 42};
+        static const int inter4x4[16] = {10, 14, 20, 24, 14, 20, 24, 27, 20, 24, 27, 30, 24, 27, 30, 34};
+        if (n == 8) {
+            row /= 2;
+            col /= 2;
+        }
+        return intra ? intra4x4[row * 4 + col] : inter4x4[row * 4 + col];
+    }
+
+public:
+    // Deeper samples need larger steps anyway, so they trade dequantization
+    // precision for headroom to keep the inverse within 32 bits
+    explicit IntegerTransform(int size = 8, int bitDepth = 8)
+        : n(size), dequantShift(max(7, 15 - (bitDepth - 8))) {
+        if (n != 4 && n != 8) {
+            throw invalid_argument("Transform size must be 4 or 8");
+        }
+        rowNorms = (n == 4) ? vector<int>{4, 10, 4, 10}
+                            : vector<int>{8, 578, 20, 578, 8, 578, 20, 578};
+
+        // Classic zig-zag: walk the anti-diagonals, alternating direction
+        for (int d = 0; d < 2 * n - 1; ++d) {
+            for (int i = 0; i <= d; ++i) {
+                int row = (d % 2 == 0) ? d - i : i;
+                int col = d - row;
+                if (row < n && col < n) zigzag.push_back(row * n + col);
+            }
+        }
+    }
+
+    int size() const { return n; }
+    int area() const { return n * n; }
+
+    // Raster block (n*n ints) -> raster coefficients
+    void forward(const int* block, int* coeffs) const {
+#ifdef __SSE2__
+        transformSIMD<false>(block, coeffs);
+#else
+        transformScalar<false>(block, coeffs);
+#endif
+    }
+
+    // Dequantized coefficients (see dequantize) -> raster block
+    void inverse(const int* coeffs, int* block) const {
+#ifdef __SSE2__
+        transformSIMD<true>(coeffs, block);
+#else
+        transformScalar<true>(coeffs, block);
+#endif
+        roundInverse(block);
+    }
+
+    // The portable transforms whatever the build, which the SSE2 ones must match exactly
+    void forwardScalar(const int* block, int* coeffs) const {
+        transformScalar<false>(block, coeffs);
+    }
+
+    void inverseScalar(const int* coeffs, int* block) const {
+        transformScalar<true>(coeffs, block);
+        roundInverse(block);
+    }
+
+    // Tables for a quantizer step; intra blocks use a finer dead zone
+    QuantTable makeQuantTable(double step, bool intra) const {
+        QuantTable table;
+        table.multiplier.resize(n * n);
+        table.scale.resize(n * n);
+        for (int row = 0; row < n; ++row) {
+            for (int col = 0; col < n; ++col) {
+                double norm = sqrt(static_cast<double>(rowNorms[row]) * rowNorms[col]);
+                double positionStep = step * matrixWeight(row, col, intra) / 16.0;
+                table.multiplier[row * n + col] = llround(ldexp(1.0, QUANT_SHIFT) / (norm * positionStep));
+                table.scale[row * n + col] = static_cast<int>(lround(ldexp(positionStep, dequantShift) / norm));
+            }
+        }
+        table.rounding = (int64_t(1) << QUANT_SHIFT) / (intra ? 3 : 6);
+        return table;
+    }
+
+    // Raster coefficients -> levels in zig-zag scan order
+    void quantize(const int* coeffs, const QuantTable& table, int* levels) const {
+        for (int s = 0; s < n * n; ++s) {
+            int pos = zigzag[s];
+            int64_t magnitude = (llabs(coeffs[pos]) * table.multiplier[pos] + table.rounding) >> QUANT_SHIFT;
+            levels[s] = coeffs[pos] < 0 ? -static_cast<int>(magnitude) : static_cast<int>(magnitude);
+        }
+    }
+
+    // Levels in zig-zag scan order -> raster input for inverse()
+    void dequantize(const int* levels, const QuantTable& table, int* coeffs) const {
+        for (int s = 0; s < n * n; ++s) {
+            int pos = zigzag[s];
+            coeffs[pos] = levels[s] * table.scale[pos];
+        }
+    }
+};
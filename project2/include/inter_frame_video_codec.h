@@ -3,7 +3,18 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cctype>
+#include <climits>
+#include <type_traits>
 #include "Image_codec.h"
+#include "thread_pool.h"
+#include "intra_prediction.h"
+#include "residual_kernels.h"
+#include "seek_index.h"
+#include "frame_pipeline.h"
+#include "allocation_counter.h"
+#include "stream_io.h"
+#include "entropy_backend.h"
 #include <opencv2/opencv.hpp>
 
 using namespace cv;
@@ -27,32 +38,53 @@ protected:
     int blockSize;         
     int searchRange;       
     string y4mHeader;
-    int sourceFormat;
+    int sourceFormat = 420;
+    int bitDepth = 8;      // 9 to 16-bit samples are stored in CV_16UC1 planes
+    EntropyBackend entropyBackend = EntropyBackend::Rice;
 
     // Add new member variables for improved motion estimation
     const int EARLY_EXIT_THRESHOLD = 256;
+    const int PIPELINE_DEPTH = 4;      // Frames in flight between pipeline stages
+
+    // Frame type codes; the stream ends with its own marker, the count isn't known up front
+    const int P_FRAME = 0;
+    const int I_FRAME = 1;
+    const int END_OF_STREAM = 2;
 
     // New constants for improved compression
     const int SKIP_THRESHOLD = 3;      // Maximum absolute sum for skip mode
     const int SEARCH_STEP = 2;         // Step size for fast motion search
     const int MAX_ZERO_RUN = 1024;     // Maximum zero run length
-    const float LAMBDA = 0.9;          // Rate-distortion trade-off factor
 
     // Helper functions from previous implementation
-    size_t getYSize() const { return width * height; }
-    size_t getUVSize() const { return (width/2) * (height/2); }
-    size_t getSourceUVSize() const {
+    int sampleBytes() const { return bitDepth > 8 ? 2 : 1; }
+    int planeType() const { return bitDepth > 8 ? CV_16UC1 : CV_8UC1; }
+    // Residual planes: int16 holds any 8-bit difference at half the size of int
+    int residualType() const { return bitDepth > 8 ? CV_32SC1 : CV_16SC1; }
+    template<typename T> using Residual = typename conditional<is_same<T, uchar>::value, short, int>::type;
+    size_t getYSize() const { return width * height * sampleBytes(); }
+    // Chroma planes are coded at the source's own subsampling
+    Size chromaSize() const {
         switch(sourceFormat) {
-            case 420: return (width/2) * (height/2);
-            case 422: return (width/2) * height;
-            case 444: return width * height;
+            case 420: return Size(width/2, height/2);
+            case 422: return Size(width/2, height);
+            case 444: return Size(width, height);
             default: throw runtime_error("Unsupported format");
         }
     }
+    Size planeSize(int plane) const { return plane == 0 ? Size(width, height) : chromaSize(); }
+    size_t getUVSize() const { return chromaSize().area() * sampleBytes(); }
+
+    // Chroma blocks cover the same picture area as luma blocks horizontally
+    int planeBlockSize(int plane) const {
+        return (plane == 0 || sourceFormat == 444) ? blockSize : blockSize/2;
+    }
     
     void validateDimensions() const {
-        if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0) {
-            throw runtime_error("Invalid dimensions for YUV420p");
+        // Subsampled chroma needs even luma dimensions in the subsampled directions
+        if (width <= 0 || height <= 0 ||
+            (sourceFormat != 444 && width % 2 != 0) || (sourceFormat == 420 && height % 2 != 0)) {
+            throw runtime_error("Invalid dimensions for YUV" + to_string(sourceFormat) + "p");
         }
     }
 
@@ -70,6 +102,26 @@ protected:
         throw runtime_error("Unsupported YUV format in Y4M header");
     }
 
+    // Sample bit depth from the colour space tag, e.g. C420p10; 8 when absent
+    int parseBitDepth(const string& header) {
+        size_t c_pos = header.find("C");
+        if (c_pos == string::npos) {
+            return 8;
+        }
+
+        string formatStr = header.substr(c_pos, header.find(' ', c_pos) - c_pos);
+        for (size_t p_pos = formatStr.find('p'); p_pos != string::npos; p_pos = formatStr.find('p', p_pos + 1)) {
+            if (p_pos + 1 < formatStr.size() && isdigit(static_cast<unsigned char>(formatStr[p_pos + 1]))) {
+                int depth = stoi(formatStr.substr(p_pos + 1));
+                if (depth < 8 || depth > 16) {
+                    throw runtime_error("Unsupported bit depth in Y4M header");
+                }
+                return depth;
+            }
+        }
+        return 8;
+    }
+
     bool parseY4MHeader(istream& file) {
         string header;
         getline(file, header);
@@ -79,15 +131,8 @@ protected:
         }
 
         sourceFormat = parseFormat(header);
+        bitDepth = parseBitDepth(header);
         
-        // Modify header to always indicate 420 format
-        size_t c_pos = header.find("C");
-        if (c_pos != string::npos) {
-            size_t space_pos = header.find(' ', c_pos);
-            header = header.substr(0, c_pos) + "C420" + 
-                    (space_pos != string::npos ? header.substr(space_pos) : "");
-        }
-
         y4mHeader = header + "\n";
         
         size_t w_pos = header.find("W");
@@ -106,60 +151,37 @@ protected:
         return true;
     }
 
-    Mat convertUVto420(const Mat& uv, int srcFormat) {
-        Mat result;
-        switch(srcFormat) {
-            case 420:
-                return uv.clone();
-            case 422:
-                resize(uv, result, Size(uv.cols, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            case 444:
-                resize(uv, result, Size(uv.cols/2, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            default:
-                throw runtime_error("Unsupported format conversion");
-        }
-    }
-
-    vector<Mat> readY4MFrame(ifstream& file) {
+    // Read the next frame; false at the end of the stream, which is never sought
+    bool readY4MFrame(istream& file, vector<Mat>& planes) {
         string frameHeader;
-        getline(file, frameHeader);
+        if (!getline(file, frameHeader)) {
+            return false;
+        }
         
-        if (frameHeader != "FRAME") {
+        // Frame headers may carry parameters after the tag
+        if (frameHeader.compare(0, 5, "FRAME") != 0) {
             throw runtime_error("Invalid frame marker");
         }
 
-        vector<Mat> planes;
-        
-        // Read Y plane (same for all formats)
-        Mat Y(height, width, CV_8UC1);
-        file.read(reinterpret_cast<char*>(Y.data), width * height);
-        planes.push_back(Y);
+        // Into the planes' own buffers, which pipelines recycle from frame to frame
+        planes.resize(3);
+        AllocationCounter::create(planes[0], height, width, planeType());
+        AllocationCounter::create(planes[1], chromaSize(), planeType());
+        AllocationCounter::create(planes[2], chromaSize(), planeType());
 
-        // Read U and V planes based on source format
-        size_t uvWidth = (sourceFormat == 444) ? width : width/2;
-        size_t uvHeight = (sourceFormat == 420) ? height/2 : height;
-        
-        Mat U(uvHeight, uvWidth, CV_8UC1);
-        Mat V(uvHeight, uvWidth, CV_8UC1);
-        
-        file.read(reinterpret_cast<char*>(U.data), uvWidth * uvHeight);
-        file.read(reinterpret_cast<char*>(V.data), uvWidth * uvHeight);
-        
-        // Convert to 420 if needed
-        if (sourceFormat != 420) {
-            planes.push_back(convertUVto420(U, sourceFormat));
-            planes.push_back(convertUVto420(V, sourceFormat));
-        } else {
-            planes.push_back(U);
-            planes.push_back(V);
+        // Y plane, then U and V at the source format's size
+        file.read(reinterpret_cast<char*>(planes[0].data), getYSize());
+        file.read(reinterpret_cast<char*>(planes[1].data), getUVSize());
+        file.read(reinterpret_cast<char*>(planes[2].data), getUVSize());
+
+        if (!file) {
+            throw runtime_error("Truncated Y4M frame");
         }
         
-        return planes;
+        return true;
     }
 
-    void writeY4MFrame(const vector<Mat>& planes, ofstream& file) {
+    void writeY4MFrame(const vector<Mat>& planes, ostream& file) {
         if (planes.size() != 3) {
             throw runtime_error("Invalid number of planes");
         }
@@ -179,51 +201,6 @@ protected:
         }
     }
 
-    // Spatial prediction for a single channel
-    Mat predictChannel(const Mat& channel) const {
-        Mat predictions(channel.size(), CV_8UC1);
-        
-        for (int y = 0; y < channel.rows; ++y) {
-            predictions.at<uchar>(y, 0) = 128;
-            for (int x = 1; x < channel.cols; ++x) {
-                predictions.at<uchar>(y, x) = channel.at<uchar>(y, x-1);
-            }
-        }
-        return predictions;
-    }
-
-    // Calculate residuals with prediction
-    Mat calculateResidualsWithPrediction(const Mat& channel) const {
-        Mat predictions = predictChannel(channel);
-        Mat residuals(channel.size(), CV_32SC1);
-        
-        for (int y = 0; y < channel.rows; ++y) {
-            for (int x = 0; x < channel.cols; ++x) {
-                residuals.at<int>(y, x) = static_cast<int>(channel.at<uchar>(y, x)) - 
-                                        static_cast<int>(predictions.at<uchar>(y, x));
-            }
-        }
-        return residuals;
-    }
-
-    // Reconstruct channel from residuals using prediction
-    Mat reconstructChannelWithPrediction(const Mat& residuals) const {
-        Mat result(residuals.size(), CV_8UC1);
-        
-        for (int y = 0; y < residuals.rows; y++) {
-            int predicted = 128;
-            int pixel = predicted + residuals.at<int>(y, 0);
-            result.at<uchar>(y, 0) = saturate_cast<uchar>(pixel);
-            
-            for (int x = 1; x < residuals.cols; x++) {
-                predicted = result.at<uchar>(y, x-1);
-                pixel = predicted + residuals.at<int>(y, x);
-                result.at<uchar>(y, x) = saturate_cast<uchar>(pixel);
-            }
-        }
-        return result;
-    }
-
     // Helper function to validate motion vector bounds
     bool isValidMotionVector(const Point2i& mv, const Point& blockPos, const Mat& reference, int currentBlockSize) const {
         Point2i newPos(blockPos.x + mv.x, blockPos.y + mv.y);
@@ -234,7 +211,7 @@ protected:
     }
 
     // Helper function to calculate Sum of Absolute Differences
-    int calculateSAD(const Mat& currentBlock, const Mat& referenceFrame, 
+    template<typename T> int calculateSAD(const Mat& currentBlock, const Mat& referenceFrame, 
                     const Point& blockPos, const Point2i& mv, int currentBlockSize) const {
         if (!isValidMotionVector(mv, blockPos, referenceFrame, currentBlockSize)) {
             return INT_MAX;
@@ -247,13 +224,13 @@ protected:
         int SAD = 0;
         for(int y = 0; y < currentBlock.rows; y++) {
             for(int x = 0; x < currentBlock.cols; x++) {
-                SAD += abs(currentBlock.at<uchar>(y, x) - candidateBlock.at<uchar>(y, x));
+                SAD += abs(currentBlock.at<T>(y, x) - candidateBlock.at<T>(y, x));
             }
         }
         return SAD;
     }
 
-    Point2i estimateMotion(const Mat& currentBlock, const Mat& referenceFrame, 
+    template<typename T> Point2i estimateMotion(const Mat& currentBlock, const Mat& referenceFrame, 
                           const Point& blockPos, int currentBlockSize) const {
         // Simple zero motion vector if block or boundaries are invalid
         if (blockPos.x < 0 || blockPos.y < 0 || 
@@ -280,7 +257,7 @@ protected:
                 int sad = 0;
                 for(int y = 0; y < currentBlockSize; y++) {
                     for(int x = 0; x < currentBlockSize; x++) {
-                        sad += abs(currentBlock.at<uchar>(y,x) - candidateBlock.at<uchar>(y,x));
+                        sad += abs(currentBlock.at<T>(y,x) - candidateBlock.at<T>(y,x));
                     }
                 }
                 
@@ -293,47 +270,93 @@ protected:
         return bestMV;
     }
 
-    int estimateBlockBits(const Mat& residuals, const Point2i& mv = Point2i(0,0)) const {
-        // Simple estimation: sum of absolute values + motion vector overhead
+    // m is given for 8-bit samples; residuals scale with the sample range
+    int golombParameter() const { return imageCodec.getM() << (bitDepth - 8); }
+
+    /*
+     * Mode decisions price candidates by their exact length in the stream at
+     * the Golomb parameter (zigzag values). Lossless, so there is no
+     * distortion and the rate is the whole cost.
+     */
+    int bitCost(int value) const {
+        return Golomb::codeLength(value, golombParameter(), 1);
+    }
+
+    template<typename R> int residualBits(const Mat& residuals) const {
         int bits = 0;
-        for(int y = 0; y < residuals.rows; y++) {
-            for(int x = 0; x < residuals.cols; x++) {
-                bits += abs(residuals.at<int>(y, x));
+        for (int y = 0; y < residuals.rows; y++) {
+            const R* row = residuals.ptr<R>(y);
+            for (int x = 0; x < residuals.cols; x++) {
+                bits += bitCost(row[x]);
             }
         }
-        
-        // Add overhead for motion vector (if present)
-        if(mv.x != 0 || mv.y != 0) {
-            bits += (abs(mv.x) + abs(mv.y)) * 8; // Assume 8 bits per component
-        }
-        
         return bits;
     }
 
-    // Perform intra prediction for a block
-    Mat predictBlock(const Mat& frame, const Rect& blockRect) const {
-        Mat block = frame(blockRect);
-        Mat predictions(block.size(), CV_8UC1);
-        
-        // Use left neighbor for prediction when available
-        if(blockRect.x > 0) {
-            for(int y = 0; y < block.rows; y++) {
-                uchar leftPixel = frame.at<uchar>(blockRect.y + y, blockRect.x - 1);
-                for(int x = 0; x < block.cols; x++) {
-                    predictions.at<uchar>(y, x) = leftPixel;
-                }
+    int residualBits(const Mat& residuals) const {
+        return residuals.depth() == CV_16S ? residualBits<short>(residuals) : residualBits<int>(residuals);
+    }
+
+    // block - prediction, as residualType()
+    template<typename T> void subtractBlock(const Mat& block, const Mat& prediction, Mat& residuals) const {
+        AllocationCounter::create(residuals, block.size(), residualType());
+        for (int y = 0; y < block.rows; y++) {
+            ResidualKernels::subtractRow(block.ptr<T>(y), prediction.ptr<T>(y),
+                                         residuals.ptr<Residual<T>>(y), block.cols);
+        }
+    }
+
+    // Per-thread buffers of the block loops, reused across blocks and frames
+    struct BlockScratch {
+        IntraPredictor predictor;
+        Mat prediction;
+        Mat candidate;
+        Mat interResiduals;
+        Mat intraResiduals;
+    };
+
+    static BlockScratch& blockScratch() {
+        static thread_local BlockScratch scratch;
+        return scratch;
+    }
+
+    // Intra mode whose residuals and mode code are shortest; leaves the residuals in `residuals`, a block-sized Mat
+    template<typename T>
+    int chooseIntraMode(const Mat& frame, const Rect& blockRect, Mat& residuals, BlockScratch& scratch, int& bestBits) const {
+        IntraPredictor& predictor = scratch.predictor;
+        predictor.load(frame, blockRect, bitDepth);
+        Mat currentBlock = frame(blockRect);
+        Mat prediction = AllocationCounter::view(scratch.prediction, blockRect.height, blockRect.width, planeType());
+        Mat candidate = AllocationCounter::view(scratch.candidate, blockRect.height, blockRect.width, residualType());
+        int bestMode = IntraPredictor::DC;
+        bestBits = INT_MAX;
+        for (int mode = 0; mode < IntraPredictor::MODE_COUNT; ++mode) {
+            // Lossless: the frame holds the decoded pixels, MED included
+            predictor.predict(IntraPredictor::Mode(mode), frame, blockRect, prediction);
+            subtractBlock<T>(currentBlock, prediction, candidate);
+            int bits = bitCost(mode) + residualBits<Residual<T>>(candidate);
+            if (bits < bestBits) {
+                bestBits = bits;
+                bestMode = mode;
+                candidate.copyTo(residuals);
             }
-        } else {
-            predictions = Scalar(128); // Default prediction
         }
-        
-        return predictions;
+        return bestMode;
     }
 
-    // Remove skip mode and early termination which were causing quality issues
+    /*
+     * Inter or intra decision of a block (no skip mode or early termination,
+     * which were causing quality issues), whichever codes shorter: mode flag,
+     * motion vector difference to `previousMV` (intra blocks send (0, 0)),
+     * intra mode and residuals. The chosen residuals are written straight
+     * into `residuals`, the block's region of the residual plane.
+     */
+    template<typename T>
     BlockData determineBlockMode(const Mat& currentFrame, const Mat& referenceFrame,
-                               const Point& blockPos, int currentBlockSize) const {
+                               const Point& blockPos, int currentBlockSize, const Point2i& previousMV,
+                               Mat& residuals, BlockScratch& scratch) const {
         BlockData result;
+        result.predictionMode = IntraPredictor::DC;
         Rect blockRect(blockPos.x, blockPos.y, 
                       min(currentBlockSize, currentFrame.cols - blockPos.x),
                       min(currentBlockSize, currentFrame.rows - blockPos.y));
@@ -348,27 +371,37 @@ protected:
         Mat currentBlock = currentFrame(blockRect);
         
         // Try inter-frame coding
-        Point2i mv = estimateMotion(currentBlock, referenceFrame, blockPos, currentBlockSize);
+        Point2i mv = estimateMotion<T>(currentBlock, referenceFrame, blockPos, currentBlockSize);
+        Mat interResiduals = AllocationCounter::view(scratch.interResiduals, blockRect.height, blockRect.width, residualType());
+        bool hasInter = false;
+        int interBits = 0;
         
         // Check if motion vector is valid
         if (isValidMotionVector(mv, blockPos, referenceFrame, currentBlockSize)) {
             Rect predRect(blockPos.x + mv.x, blockPos.y + mv.y, 
                          blockRect.width, blockRect.height);
             Mat interPrediction = referenceFrame(predRect);
-            Mat interResiduals;
-            subtract(currentBlock, interPrediction, interResiduals, noArray(), CV_32SC1);
+            subtractBlock<T>(currentBlock, interPrediction, interResiduals);
+            interBits = bitCost(0) + bitCost(mv.x - previousMV.x) + bitCost(mv.y - previousMV.y) +
+                        residualBits<Residual<T>>(interResiduals);
             
+            hasInter = true;
             result.useIntraMode = false;
             result.motionVector = mv;
-            result.residuals = interResiduals;
-        } else {
-            // Fallback to intra mode if motion vector is invalid
+        }
+
+        // Intra coding when it beats the motion-compensated residuals (or there are none)
+        Mat intraResiduals = AllocationCounter::view(scratch.intraResiduals, blockRect.height, blockRect.width, residualType());
+        int intraBits;
+        int intraMode = chooseIntraMode<T>(currentFrame, blockRect, intraResiduals, scratch, intraBits);
+        intraBits += bitCost(1) + bitCost(-previousMV.x) + bitCost(-previousMV.y);
+        if (!hasInter || intraBits < interBits) {
             result.useIntraMode = true;
             result.motionVector = Point2i(0, 0);
-            Mat intraPrediction = predictBlock(currentFrame, blockRect);
-            Mat intraResiduals;
-            subtract(currentBlock, intraPrediction, intraResiduals, noArray(), CV_32SC1);
-            result.residuals = intraResiduals;
+            result.predictionMode = intraMode;
+            intraResiduals.copyTo(residuals);
+        } else {
+            interResiduals.copyTo(residuals);
         }
         
         result.skipMode = false;
@@ -376,27 +409,113 @@ protected:
     }
 
     // Modified encodePFrame method to use mode decision
+    template<typename T>
     void encodePFrame(const Mat& currentFrame, const Mat& referenceFrame, 
                      vector<Point2i>& motionVectors, Mat& residuals,
-                     vector<bool>& blockModes, int currentBlockSize) const {
-        motionVectors.clear();
-        blockModes.clear();
-        residuals = Mat::zeros(currentFrame.size(), CV_32SC1);
-        
-        for(int y = 0; y < currentFrame.rows; y += currentBlockSize) {
-            for(int x = 0; x < currentFrame.cols; x += currentBlockSize) {
-                BlockData blockData = determineBlockMode(currentFrame, referenceFrame,
-                                                       Point(x, y), currentBlockSize);
-                
-                // Store mode decision and block data
-                blockModes.push_back(blockData.useIntraMode);
-                motionVectors.push_back(blockData.motionVector);
-                
-                // Copy residuals to output
+                     vector<bool>& blockModes, vector<int>& intraModes, int currentBlockSize) const {
+        int blocksX = (currentFrame.cols + currentBlockSize - 1) / currentBlockSize;
+        int blocksY = (currentFrame.rows + currentBlockSize - 1) / currentBlockSize;
+        AllocationCounter::create(residuals, currentFrame.size(), residualType());
+        AllocationCounter::assign(motionVectors, blocksX * blocksY, Point2i(0, 0));
+        AllocationCounter::assign(intraModes, blocksX * blocksY, 0);
+        
+        // Each block only reads the reference frame, so block rows run in parallel
+        ThreadPool::shared().parallelFor(0, blocksY, [&](int by) {
+            BlockScratch& scratch = blockScratch();
+            // Vectors are sent as differences along the plane; a row's first block can't see the row above's last
+            Point2i previousMV(0, 0);
+            for(int bx = 0; bx < blocksX; bx++) {
+                int x = bx * currentBlockSize;
+                int y = by * currentBlockSize;
                 Rect blockRect(x, y, 
                              min(currentBlockSize, currentFrame.cols - x),
                              min(currentBlockSize, currentFrame.rows - y));
-                blockData.residuals.copyTo(residuals(blockRect));
+                Mat blockResiduals = residuals(blockRect);
+                BlockData blockData = determineBlockMode<T>(currentFrame, referenceFrame, Point(x, y),
+                                                       currentBlockSize, previousMV, blockResiduals, scratch);
+                previousMV = blockData.motionVector;
+                
+                // Store mode decision; vector<bool> can't be written concurrently,
+                // so inter blocks are marked with mode -1 until the loop is done
+                intraModes[by * blocksX + bx] = blockData.useIntraMode ? blockData.predictionMode : -1;
+                motionVectors[by * blocksX + bx] = blockData.motionVector;
+            }
+        });
+        AllocationCounter::resize(blockModes, intraModes.size());
+        for (size_t i = 0; i < intraModes.size(); ++i) {
+            blockModes[i] = intraModes[i] >= 0;
+            if (!blockModes[i]) intraModes[i] = 0;
+        }
+    }
+
+    void encodePFrame(const Mat& currentFrame, const Mat& referenceFrame,
+                     vector<Point2i>& motionVectors, Mat& residuals,
+                     vector<bool>& blockModes, vector<int>& intraModes, int currentBlockSize) const {
+        if (currentFrame.depth() == CV_8U) {
+            encodePFrame<uchar>(currentFrame, referenceFrame, motionVectors, residuals, blockModes, intraModes, currentBlockSize);
+        } else {
+            encodePFrame<ushort>(currentFrame, referenceFrame, motionVectors, residuals, blockModes, intraModes, currentBlockSize);
+        }
+    }
+
+    // I-frame plane: every block takes its best intra mode; lossless, so blocks only read the source
+    template<typename T>
+    void encodeIntraPlane(const Mat& plane, Mat& residuals, vector<int>& intraModes, int currentBlockSize) const {
+        int blocksX = (plane.cols + currentBlockSize - 1) / currentBlockSize;
+        int blocksY = (plane.rows + currentBlockSize - 1) / currentBlockSize;
+        AllocationCounter::create(residuals, plane.size(), residualType());
+        AllocationCounter::assign(intraModes, blocksX * blocksY, 0);
+
+        ThreadPool::shared().parallelFor(0, blocksY, [&](int by) {
+            BlockScratch& scratch = blockScratch();
+            for (int bx = 0; bx < blocksX; bx++) {
+                Rect blockRect(bx * currentBlockSize, by * currentBlockSize,
+                               min(currentBlockSize, plane.cols - bx * currentBlockSize),
+                               min(currentBlockSize, plane.rows - by * currentBlockSize));
+                Mat blockResiduals = residuals(blockRect);
+                int bits;
+                intraModes[by * blocksX + bx] = chooseIntraMode<T>(plane, blockRect, blockResiduals, scratch, bits);
+            }
+        });
+    }
+
+    void encodeIntraPlane(const Mat& plane, Mat& residuals, vector<int>& intraModes, int currentBlockSize) const {
+        if (plane.depth() == CV_8U) encodeIntraPlane<uchar>(plane, residuals, intraModes, currentBlockSize);
+        else encodeIntraPlane<ushort>(plane, residuals, intraModes, currentBlockSize);
+    }
+
+    /*
+     * Every frame type starts a new segment of the entropy coder and I-frames
+     * reset its adaptive state, so an adaptive decoder can start at any
+     * I-frame; both are no-ops for Rice.
+     */
+    void writeFrameType(int frameType, EntropyCoder& coder) const {
+        coder.sync();
+        coder.encode(frameType, SyntaxElement::Header);
+        if (frameType == I_FRAME) coder.resetContexts();
+    }
+
+    int readFrameType(EntropyCoder& coder) const {
+        coder.sync();
+        int frameType = coder.decode_val(SyntaxElement::Header);
+        if (frameType == I_FRAME) coder.resetContexts();
+        return frameType;
+    }
+
+    // Intra modes of the intra blocks, in block order
+    void writeIntraModes(const vector<bool>& blockModes, const vector<int>& intraModes, EntropyCoder& coder) const {
+        for (size_t i = 0; i < blockModes.size(); ++i) {
+            if (blockModes[i]) coder.encode(intraModes[i], SyntaxElement::IntraMode);
+        }
+    }
+
+    void readIntraModes(const vector<bool>& blockModes, vector<int>& intraModes, EntropyCoder& coder) const {
+        AllocationCounter::assign(intraModes, blockModes.size(), 0);
+        for (size_t i = 0; i < blockModes.size(); ++i) {
+            if (!blockModes[i]) continue;
+            intraModes[i] = coder.decode_val(SyntaxElement::IntraMode);
+            if (intraModes[i] < 0 || intraModes[i] >= IntraPredictor::MODE_COUNT) {
+                throw runtime_error("Invalid intra prediction mode in stream");
             }
         }
     }
@@ -430,72 +549,100 @@ protected:
     }
 
     // Fixed residual writing - remove run length encoding which was causing issues
-    virtual void writeResidualsGolomb(const Mat& residuals, Golomb& golomb) const {
+    virtual void writeResidualsGolomb(const Mat& residuals, EntropyCoder& coder) const {
         // Write dimensions
-        golomb.encode(residuals.rows);
-        golomb.encode(residuals.cols);
+        coder.encode(residuals.rows, SyntaxElement::Header);
+        coder.encode(residuals.cols, SyntaxElement::Header);
         
         // Write all residual values directly
+        if (residuals.depth() == CV_16S) writeResidualRows<short>(residuals, coder);
+        else writeResidualRows<int>(residuals, coder);
+    }
+
+    template<typename R> static void writeResidualRows(const Mat& residuals, EntropyCoder& coder) {
         for(int y = 0; y < residuals.rows; y++) {
+            const R* row = residuals.ptr<R>(y);
             for(int x = 0; x < residuals.cols; x++) {
-                golomb.encode(residuals.at<int>(y, x));
+                coder.encode(row[x]);
             }
         }
     }
 
     // Fixed residual reading to match the writing
-    virtual void readResidualsGolomb(Mat& residuals, Golomb& golomb) const {
-        int rows = golomb.decode_val();
-        int cols = golomb.decode_val();
-        residuals = Mat::zeros(rows, cols, CV_32SC1);
+    virtual void readResidualsGolomb(Mat& residuals, EntropyCoder& coder) const {
+        int rows = coder.decode_val(SyntaxElement::Header);
+        int cols = coder.decode_val(SyntaxElement::Header);
+        AllocationCounter::create(residuals, rows, cols, residualType());
         
         // Read all values directly
-        for(int y = 0; y < rows; y++) {
-            for(int x = 0; x < cols; x++) {
-                residuals.at<int>(y, x) = golomb.decode_val();
+        if (residuals.depth() == CV_16S) readResidualRows<short>(residuals, coder);
+        else readResidualRows<int>(residuals, coder);
+    }
+
+    template<typename R> static void readResidualRows(Mat& residuals, EntropyCoder& coder) {
+        for(int y = 0; y < residuals.rows; y++) {
+            R* row = residuals.ptr<R>(y);
+            for(int x = 0; x < residuals.cols; x++) {
+                row[x] = saturate_cast<R>(coder.decode_val());
             }
         }
     }
 
     // Add differential encoding for motion vectors
-    virtual void writeMotionVectorsGolomb(const vector<Point2i>& motionVectors, Golomb& golomb) const {
+    virtual void writeMotionVectorsGolomb(const vector<Point2i>& motionVectors, EntropyCoder& coder) const {
         if (motionVectors.empty()) return;
         
         // Write first vector directly
-        golomb.encode(motionVectors[0].x);
-        golomb.encode(motionVectors[0].y);
+        coder.encode(motionVectors[0].x, SyntaxElement::MotionVector);
+        coder.encode(motionVectors[0].y, SyntaxElement::MotionVector);
         
         // Write differences for subsequent vectors
         for(size_t i = 1; i < motionVectors.size(); i++) {
-            golomb.encode(motionVectors[i].x - motionVectors[i-1].x);
-            golomb.encode(motionVectors[i].y - motionVectors[i-1].y);
+            coder.encode(motionVectors[i].x - motionVectors[i-1].x, SyntaxElement::MotionVector);
+            coder.encode(motionVectors[i].y - motionVectors[i-1].y, SyntaxElement::MotionVector);
         }
     }
 
-    virtual vector<Point2i> readMotionVectorsGolomb(size_t count, Golomb& golomb) const {
-        vector<Point2i> motionVectors;
-        if (count == 0) return motionVectors;
+    virtual void readMotionVectorsGolomb(size_t count, vector<Point2i>& motionVectors, EntropyCoder& coder) const {
+        AllocationCounter::resize(motionVectors, count);
+        if (count == 0) return;
         
         // Read first vector
         Point2i prev;
-        prev.x = golomb.decode_val();
-        prev.y = golomb.decode_val();
-        motionVectors.push_back(prev);
+        prev.x = coder.decode_val(SyntaxElement::MotionVector);
+        prev.y = coder.decode_val(SyntaxElement::MotionVector);
+        motionVectors[0] = prev;
         
         // Read and reconstruct subsequent vectors
         for(size_t i = 1; i < count; i++) {
             Point2i current;
-            current.x = prev.x + golomb.decode_val();
-            current.y = prev.y + golomb.decode_val();
-            motionVectors.push_back(current);
+            current.x = prev.x + coder.decode_val(SyntaxElement::MotionVector);
+            current.y = prev.y + coder.decode_val(SyntaxElement::MotionVector);
+            motionVectors[i] = current;
             prev = current;
         }
-        return motionVectors;
     }
 
-    Mat decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
-                const vector<bool>& blockModes, const Mat& residuals, int currentBlockSize) const {
-        Mat reconstructed = Mat::zeros(referenceFrame.size(), referenceFrame.type());
+    // Rebuild a plane block by block; I-frames pass an empty reference and only intra blocks
+    void decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
+                const vector<bool>& blockModes, const vector<int>& intraModes,
+                const Mat& residuals, int currentBlockSize, Mat& reconstructed) const {
+        AllocationCounter::create(reconstructed, residuals.size(), planeType());
+        if (reconstructed.depth() == CV_8U) {
+            decodePFrame<uchar>(referenceFrame, motionVectors, blockModes, intraModes, residuals,
+                                currentBlockSize, reconstructed);
+        } else {
+            decodePFrame<ushort>(referenceFrame, motionVectors, blockModes, intraModes, residuals,
+                                 currentBlockSize, reconstructed);
+        }
+    }
+
+    template<typename T>
+    void decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
+                const vector<bool>& blockModes, const vector<int>& intraModes,
+                const Mat& residuals, int currentBlockSize, Mat& reconstructed) const {
+        IntraPredictor& predictor = blockScratch().predictor;
+        const int maxValue = (1 << bitDepth) - 1;
         int blockIdx = 0;
         
         for (int y = 0; y < reconstructed.rows; y += currentBlockSize) {
@@ -507,18 +654,9 @@ protected:
                 
                 if (blockModes[blockIdx]) {
                     // Intra mode
-                    Mat prediction = predictBlock(reconstructed, blockRect);
-                    Mat reconstructedBlock(blockRect.size(), reconstructed.type());
-                    
-                    for(int i = 0; i < blockResiduals.rows; i++) {
-                        for(int j = 0; j < blockResiduals.cols; j++) {
-                            reconstructedBlock.at<uchar>(i,j) = saturate_cast<uchar>(
-                                prediction.at<uchar>(i,j) + 
-                                blockResiduals.at<int>(i,j)
-                            );
-                        }
-                    }
-                    reconstructedBlock.copyTo(reconstructed(blockRect));
+                    predictor.load(reconstructed, blockRect, bitDepth);
+                    predictor.reconstruct(IntraPredictor::Mode(intraModes[blockIdx]), reconstructed,
+                                          blockRect, blockResiduals);
                 } else {
                     // Inter mode
                     Point2i mv = motionVectors[blockIdx];
@@ -526,30 +664,23 @@ protected:
                     predRect = predRect & Rect(0, 0, referenceFrame.cols, referenceFrame.rows);
                     Mat predBlock = referenceFrame(predRect);
                     
-                    Mat reconstructedBlock(blockRect.size(), reconstructed.type());
                     for(int i = 0; i < blockResiduals.rows; i++) {
-                        for(int j = 0; j < blockResiduals.cols; j++) {
-                            reconstructedBlock.at<uchar>(i,j) = saturate_cast<uchar>(
-                                predBlock.at<uchar>(i,j) + 
-                                blockResiduals.at<int>(i,j)
-                            );
-                        }
+                        ResidualKernels::addRow(predBlock.ptr<T>(i), blockResiduals.ptr<Residual<T>>(i),
+                                                reconstructed.ptr<T>(y + i) + x, predBlock.cols, maxValue);
                     }
-                    reconstructedBlock.copyTo(reconstructed(blockRect));
                 }
                 blockIdx++;
             }
         }
-        return reconstructed;
     }
 
     // New helper methods for compression
-    bool isSkippableBlock(const Mat& block, const Mat& reference, const Point& pos) const {
+    template<typename T> bool isSkippableBlock(const Mat& block, const Mat& reference, const Point& pos) const {
         int sum = 0;
         for(int y = 0; y < block.rows; y++) {
             for(int x = 0; x < block.cols; x++) {
-                sum += abs(block.at<uchar>(y,x) - reference.at<uchar>(pos.y+y, pos.x+x));
-                if(sum > SKIP_THRESHOLD) return false;
+                sum += abs(block.at<T>(y,x) - reference.at<T>(pos.y+y, pos.x+x));
+                if(sum > SKIP_THRESHOLD << (bitDepth - 8)) return false;
             }
         }
         return true;
@@ -560,111 +691,200 @@ public:
         : imageCodec(m), width(width), height(height), frameCount(0),
         iFrameInterval(iFrameInterval), blockSize(blockSize), 
         searchRange(searchRange) {
-        validateDimensions();
+        // Dimensions may be left 0 when they come from the Y4M header or the metadata
+        if (width != 0 || height != 0) {
+            validateDimensions();
+        }
     }
 
-    void encode(const string& inputPath, const string& outputPath) {
-        ifstream input(inputPath, ios::binary);
-        if (!input) {
-            throw runtime_error("Could not open input file: " + inputPath);
-        }
+    // Entropy coder of the streams encode writes; decoding takes it from the metadata
+    void setEntropyBackend(EntropyBackend backend) {
+        entropyBackend = backend;
+    }
 
-        // Get input file size
-        input.seekg(0, ios::end);
-        size_t inputSize = input.tellg();
-        input.seekg(0, ios::beg);
+    // Paths may be "-" for stdin; the input is read once, front to back
+    void encode(const string& inputPath, const string& outputPath) {
+        ifstream inputFile;
+        istream& input = openInput(inputPath, inputFile);
 
         // Parse Y4M header
         if (!parseY4MHeader(input)) {
             throw runtime_error("Invalid Y4M header");
         }
+        validateDimensions();
 
-        // Count frames if not provided
-        if (frameCount == 0) {
-            streampos current = input.tellg();
-            input.seekg(0, ios::end);
-            size_t fileSize = static_cast<size_t>(input.tellg()) - static_cast<size_t>(current);
-            input.seekg(current, ios::beg);
+        // Create the entropy encoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, golombParameter(), false, outputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
 
-            size_t frameDataSize = getYSize() + 2 * getSourceUVSize();  // Actual YUV data size
-            size_t frameOverhead = 6;  // "FRAME\n" marker
-            size_t totalFrameSize = frameDataSize + frameOverhead;
+        vector<Mat> previousPlanes;
+        FrameSyntax frame;  // per-plane buffers, reused from frame to frame
+        SeekIndex index;
+        
+        // Input frames are read on their own thread, ahead of the encoder, until the input ends
+        FrameSource<vector<Mat>> reader(PIPELINE_DEPTH,
+                                        [&](vector<Mat>& planes) { return readY4MFrame(input, planes); });
+        
+        frameCount = 0;
+        vector<Mat> planes;
+        for (int f = 0; reader.next(planes); ++f, ++frameCount) {
+            bool isIFrame = (f % iFrameInterval == 0);
+            if (isIFrame) {
+                coder.sync();  // so the offset is where an adaptive decoder can start
+                index.addIFrame(f, coder.bitsWritten());
+            }
+            encodeFrame(planes, previousPlanes, isIFrame, frame, coder);
+            // The source becomes the reference; the old reference goes back to the reader with next()
+            swap(previousPlanes, planes);
             
-            frameCount = fileSize / totalFrameSize;
-            cout << "Detected " << frameCount << " frames" << endl;
+            if (f % 10 == 0) {
+                cerr << "Encoded frame " << f << endl;
+            }
         }
+        writeFrameType(END_OF_STREAM, coder);
+        
+        coder.end();
+        index.setFrameCount(frameCount);
+        index.write(outputPath + ".idx");
 
-        // Write metadata
+        // Metadata goes last, once the frame count is known
         ofstream meta(outputPath + ".meta");
         if (!meta) {
             throw runtime_error("Could not create metadata file");
         }
         meta << y4mHeader;
         meta << frameCount << " " << iFrameInterval << " " << blockSize << " " 
-             << searchRange << endl;
+             << searchRange << " " << entropyBackendName(entropyBackend) << endl;
         meta.close();
-
-        // Create Golomb encoder
-        Golomb golomb(imageCodec.getM(), false, outputPath + ".bin", 1);
-
-        Mat previousFrame;
-        vector<Mat> previousPlanes;
         
-        for (int f = 0; f < frameCount; ++f) {
-            vector<Mat> planes = readY4MFrame(input);
-            bool isIFrame = (f % iFrameInterval == 0);
-            golomb.encode(isIFrame ? 1 : 0);
-            
+        // Get compressed size
+        ifstream binFile(outputPath + ".bin", ios::binary | ios::ate);
+        size_t compressedSize = binFile.tellg();
+        size_t inputSize = y4mHeader.size() + frameCount * (6 + getYSize() + 2 * getUVSize());
+        
+        cerr << "Frames: " << frameCount << endl;
+        cerr << "Original size: " << inputSize << " bytes" << endl;
+        cerr << "Compressed size: " << compressedSize << " bytes" << endl;
+        cerr << "Compression ratio: " << (float)inputSize/compressedSize << ":1" << endl;
+        cerr << "Encoding complete" << endl;
+    }
+
+    // Everything the bitstream holds for one frame, parsed ahead of reconstruction
+    struct PlaneSyntax {
+        vector<Point2i> motionVectors;
+        vector<bool> blockModes;
+        vector<int> intraModes;
+        Mat residuals;
+    };
+    struct FrameSyntax {
+        bool isIFrame = false;
+        PlaneSyntax planes[3];
+    };
+
+    /*
+     * Code one frame, its type code first. Lossless, so the reference of a
+     * P-frame is the previous source frame itself; `frame` is scratch whose
+     * buffers are reused when it is passed again.
+     */
+    void encodeFrame(const vector<Mat>& planes, const vector<Mat>& previousPlanes, bool isIFrame,
+                     FrameSyntax& frame, EntropyCoder& coder) const {
+        frame.isIFrame = isIFrame;
+        writeFrameType(isIFrame ? I_FRAME : P_FRAME, coder);
+
+        for (int i = 0; i < 3; ++i) {
+            PlaneSyntax& plane = frame.planes[i];
+            int channelBlockSize = planeBlockSize(i);
             if (isIFrame) {
-                for (int i = 0; i < 3; ++i) {
-                    Mat residuals = calculateResidualsWithPrediction(planes[i]);
-                    writeResidualsGolomb(residuals, golomb);
+                encodeIntraPlane(planes[i], plane.residuals, plane.intraModes, channelBlockSize);
+                for (int mode : plane.intraModes) {
+                    coder.encode(mode, SyntaxElement::IntraMode);
                 }
-                previousPlanes = planes;
             } else {
-                for (int i = 0; i < 3; ++i) {
-                    vector<Point2i> motionVectors;
-                    vector<bool> blockModes;
-                    Mat residuals;
-                    
-                    int channelBlockSize = (i == 0) ? blockSize : blockSize/2;
-                    
-                    encodePFrame(planes[i], previousPlanes[i], motionVectors, 
-                               residuals, blockModes, channelBlockSize);
-                    
-                    // Write size and data using Golomb coding
-                    golomb.encode(motionVectors.size());
-                    writeMotionVectorsGolomb(motionVectors, golomb);
-                    
-                    // Write block modes
-                    for(bool mode : blockModes) {
-                        golomb.encode(mode ? 1 : 0);
-                    }
-                    
-                    writeResidualsGolomb(residuals, golomb);
+                encodePFrame(planes[i], previousPlanes[i], plane.motionVectors,
+                             plane.residuals, plane.blockModes, plane.intraModes, channelBlockSize);
+
+                // Write size and data using Golomb coding
+                coder.encode(plane.motionVectors.size(), SyntaxElement::Header);
+                writeMotionVectorsGolomb(plane.motionVectors, coder);
+
+                // Write block modes
+                for(bool mode : plane.blockModes) {
+                    coder.encode(mode ? 1 : 0, SyntaxElement::Flag);
                 }
-                previousPlanes = planes;
+                writeIntraModes(plane.blockModes, plane.intraModes, coder);
             }
-            
-            if (f % 10 == 0) {
-                cout << "Encoded frame " << f << "/" << frameCount << endl;
+            writeResidualsGolomb(plane.residuals, coder);
+        }
+    }
+
+    /*
+     * Entropy-decode one frame; needs no decoded pixels, so it can run ahead
+     * of reconstruction. False at the end-of-stream marker.
+     */
+    bool parseFrame(EntropyCoder& coder, FrameSyntax& frame) const {
+        int frameType = readFrameType(coder);
+        if (frameType == END_OF_STREAM) {
+            return false;
+        }
+        frame.isIFrame = frameType == I_FRAME;
+
+        for (int i = 0; i < 3; ++i) {
+            PlaneSyntax& plane = frame.planes[i];
+            if (frame.isIFrame) {
+                int channelBlockSize = planeBlockSize(i);
+                int numBlocks = ((planeSize(i).width + channelBlockSize - 1) / channelBlockSize) *
+                                ((planeSize(i).height + channelBlockSize - 1) / channelBlockSize);
+                AllocationCounter::assign(plane.motionVectors, numBlocks, Point2i(0, 0));
+                AllocationCounter::assign(plane.blockModes, numBlocks, true);
+            } else {
+                size_t numVectors = coder.decode_val(SyntaxElement::Header);
+                readMotionVectorsGolomb(numVectors, plane.motionVectors, coder);
+                AllocationCounter::resize(plane.blockModes, numVectors);
+                for(size_t j = 0; j < numVectors; j++) {
+                    plane.blockModes[j] = coder.decode_val(SyntaxElement::Flag) == 1;
+                }
             }
+            readIntraModes(plane.blockModes, plane.intraModes, coder);
+            readResidualsGolomb(plane.residuals, coder);  // allocates the proper size
         }
-        
-        golomb.end();
-        
-        // Get compressed size
-        ifstream binFile(outputPath + ".bin", ios::binary | ios::ate);
-        size_t compressedSize = binFile.tellg();
-        
-        cout << "Original size: " << inputSize << " bytes" << endl;
-        cout << "Compressed size: " << compressedSize << " bytes" << endl;
-        cout << "Compression ratio: " << (float)inputSize/compressedSize << ":1" << endl;
-        cout << "Encoding complete" << endl;
+        return true;
     }
 
-    void decode(const string& inputPath, const string& outputPath) {
-        // Read metadata
+    /*
+     * Rebuild a parsed frame into reconstructedPlanes, reusing their buffers
+     * when they have the right size; previousPlanes is the reference of
+     * P-frames and unused by I-frames, and must not share buffers with the output.
+     */
+    void reconstructFrame(const FrameSyntax& frame, const vector<Mat>& previousPlanes,
+                          vector<Mat>& reconstructedPlanes) const {
+        if (!frame.isIFrame && previousPlanes.size() != 3) {
+            throw runtime_error("P-frame without a reference frame");
+        }
+        reconstructedPlanes.resize(3);
+        for (int i = 0; i < 3; ++i) {
+            const PlaneSyntax& plane = frame.planes[i];
+            decodePFrame(frame.isIFrame ? Mat() : previousPlanes[i], plane.motionVectors, plane.blockModes,
+                         plane.intraModes, plane.residuals, planeBlockSize(i), reconstructedPlanes[i]);
+        }
+    }
+
+    vector<Mat> reconstructFrame(const FrameSyntax& frame, const vector<Mat>& previousPlanes) const {
+        vector<Mat> reconstructedPlanes;
+        reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+        return reconstructedPlanes;
+    }
+
+    vector<Mat> decodeFrame(EntropyCoder& coder, const vector<Mat>& previousPlanes) const {
+        FrameSyntax frame;
+        if (!parseFrame(coder, frame)) {
+            throw runtime_error("Unexpected end of stream");
+        }
+        return reconstructFrame(frame, previousPlanes);
+    }
+
+    // Restore the stream parameters from the .meta file written by encode
+    void readMetadata(const string& inputPath) {
         ifstream meta(inputPath + ".meta");
         if (!meta) {
             throw runtime_error("Could not open metadata file");
@@ -673,6 +893,11 @@ public:
         // Read Y4M header from metadata
         getline(meta, y4mHeader);
         meta >> frameCount >> iFrameInterval >> blockSize >> searchRange;
+        string backendName;
+        if (!(meta >> backendName)) {
+            throw runtime_error("Invalid metadata file");
+        }
+        entropyBackend = parseEntropyBackend(backendName);
         
         // Parse dimensions from Y4M header
         stringstream headerStream(y4mHeader);
@@ -682,74 +907,98 @@ public:
         
         meta.close();
         validateDimensions();
+    }
 
-        // Create Golomb decoder
-        Golomb golomb(imageCodec.getM(), true, inputPath + ".bin", 1);
+    void decode(const string& inputPath, const string& outputPath) {
+        readMetadata(inputPath);
 
-        // Open output file and write Y4M header
-        ofstream output(outputPath, ios::binary);
-        if (!output) {
-            throw runtime_error("Could not open output file");
-        }
+        // Create the entropy decoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, golombParameter(), true, inputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
+
+        // Open output file (or stdout) and write Y4M header
+        ofstream outputFile;
+        ostream& output = openOutput(outputPath, outputFile);
         output << y4mHeader;
 
         vector<Mat> previousPlanes;
-        // Initialize with empty planes
-        previousPlanes.push_back(Mat::zeros(height, width, CV_8UC1));
-        previousPlanes.push_back(Mat::zeros(height/2, width/2, CV_8UC1));
-        previousPlanes.push_back(Mat::zeros(height/2, width/2, CV_8UC1));
+        vector<Mat> reconstructedPlanes;
 
         try {
-            for (int f = 0; f < frameCount; ++f) {
-                bool isIFrame = golomb.decode_val() == 1;
-                vector<Mat> reconstructedPlanes;
-
-                if (isIFrame) {
-                    for (int i = 0; i < 3; ++i) {
-                        Mat residuals;  // Let readResidualsGolomb allocate the proper size
-                        readResidualsGolomb(residuals, golomb);
-                        reconstructedPlanes.push_back(
-                            reconstructChannelWithPrediction(residuals));
-                    }
-                } else {
-                    for (int i = 0; i < 3; ++i) {
-                        size_t numVectors = golomb.decode_val();
-                        vector<Point2i> motionVectors = 
-                            readMotionVectorsGolomb(numVectors, golomb);
-                        
-                        vector<bool> blockModes;
-                        for(size_t j = 0; j < numVectors; j++) {
-                            blockModes.push_back(golomb.decode_val() == 1);
-                        }
-                        
-                        int channelWidth = (i == 0) ? width : width/2;
-                        int channelHeight = (i == 0) ? height : height/2;
-                        int channelBlockSize = (i == 0) ? blockSize : blockSize/2;
-                        
-                        Mat residuals;  // Let readResidualsGolomb allocate the proper size
-                        readResidualsGolomb(residuals, golomb);
-                        
-                        Mat reconstructedChannel = decodePFrame(previousPlanes[i], 
-                                                              motionVectors,
-                                                              blockModes, 
-                                                              residuals,
-                                                              channelBlockSize);
-                        reconstructedPlanes.push_back(reconstructedChannel);
-                    }
+            // Entropy decoding, reconstruction (this thread) and writing run as a pipeline,
+            // up to the end-of-stream marker
+            FrameSource<FrameSyntax> parser(PIPELINE_DEPTH,
+                                            [&](FrameSyntax& frame) { return parseFrame(coder, frame); });
+            FrameSink<vector<Mat>> writer(PIPELINE_DEPTH,
+                                          [&](vector<Mat>& planes) { writeY4MFrame(planes, output); });
+            FrameSyntax frame;
+            for (int f = 0; parser.next(frame); ++f) {
+                // Frames are rebuilt in the writer's recycled buffers. Each one is
+                // queued once the next frame no longer needs it as the reference,
+                // so the writer never hands back a buffer still being read
+                writer.acquire(reconstructedPlanes);
+                reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+                if (!previousPlanes.empty()) {
+                    writer.push(move(previousPlanes));
                 }
-                
-                writeY4MFrame(reconstructedPlanes, output);
-                previousPlanes = reconstructedPlanes;
+                previousPlanes = move(reconstructedPlanes);
                 
                 if (f % 10 == 0) {
-                    cout << "Decoded frame " << f << "/" << frameCount << endl;
+                    cerr << "Decoded frame " << f << "/" << frameCount << endl;
                 }
             }
+            if (!previousPlanes.empty()) {
+                writer.push(move(previousPlanes));
+            }
+            writer.finish();
+            output.flush();
         } catch (const exception& e) {
-            cout << "Error during decoding: " << e.what() << endl;
+            cerr << "Error during decoding: " << e.what() << endl;
             throw;
         }
         
-        cout << "Decoding complete" << endl;
+        cerr << "Decoding complete" << endl;
+    }
+
+    /*
+     * Decode frames first..last (inclusive) into a Y4M file. Decoding starts
+     * at the last I-frame at or before `first`, found in the seek index that
+     * encode writes next to the bitstream; frames before `first` are
+     * decoded as references only.
+     */
+    void decodeRange(const string& inputPath, const string& outputPath, int first, int last) {
+        readMetadata(inputPath);
+        if (first < 0 || last < first || last >= frameCount) {
+            throw invalid_argument("Invalid frame range");
+        }
+        SeekIndex index = SeekIndex::read(inputPath + ".idx");
+        const SeekIndex::Entry& start = index.seekPoint(first);
+
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, golombParameter(), true, inputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
+        coder.seekToBit(start.bitOffset);
+
+        ofstream outputFile;
+        ostream& output = openOutput(outputPath, outputFile);
+        output << y4mHeader;
+
+        FrameSyntax frame;
+        vector<Mat> previousPlanes;
+        vector<Mat> reconstructedPlanes;
+        for (int f = start.frame; f <= last; ++f) {
+            if (!parseFrame(coder, frame)) {
+                throw runtime_error("Unexpected end of stream");
+            }
+            reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+            if (f >= first) {
+                writeY4MFrame(reconstructedPlanes, output);
+            }
+            // The new frame is the reference, the old reference its buffer
+            swap(previousPlanes, reconstructedPlanes);
+        }
+        output.flush();
+        cerr << "Decoded frames " << first << "-" << last << " from I-frame " << start.frame << endl;
     }
 };
\ No newline at end of file
@@ -2,8 +2,14 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cctype>
 #include "Image_codec.h"
 #include "Golomb.h"
+#include "residual_kernels.h"
+#include "frame_pipeline.h"
+#include "allocation_counter.h"
+#include "stream_io.h"
+#include "entropy_backend.h"
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <sstream>
@@ -19,24 +25,35 @@ private:
     int height;
     int frameCount;
     int m;  // Golomb parameter~
+    const int PIPELINE_DEPTH = 4;  // Frames in flight between pipeline stages
+    const int FRAME_MARKER = 0;    // Precedes every coded frame
+    const int END_OF_STREAM = 1;   // Follows the last one, the count isn't known up front
     string y4mHeader;
-    int sourceFormat;
-
-    // Calculate frame sizes for YUV420p
-    size_t getYSize() const { return width * height; }
-    size_t getUVSize() const { return (width/2) * (height/2); }
-    size_t getSourceUVSize() const {
+    int sourceFormat = 420;
+    int bitDepth = 8;      // 9 to 16-bit samples are stored in CV_16UC1 planes
+    EntropyBackend entropyBackend = EntropyBackend::Rice;
+
+    // Calculate frame sizes for the source chroma format
+    int sampleBytes() const { return bitDepth > 8 ? 2 : 1; }
+    int planeType() const { return bitDepth > 8 ? CV_16UC1 : CV_8UC1; }
+    size_t getYSize() const { return width * height * sampleBytes(); }
+    // Chroma planes are coded at the source's own subsampling
+    Size chromaSize() const {
         switch(sourceFormat) {
-            case 420: return (width/2) * (height/2);
-            case 422: return (width/2) * height;
-            case 444: return width * height;
+            case 420: return Size(width/2, height/2);
+            case 422: return Size(width/2, height);
+            case 444: return Size(width, height);
             default: throw runtime_error("Unsupported format");
         }
     }
+    Size planeSize(int plane) const { return plane == 0 ? Size(width, height) : chromaSize(); }
+    size_t getUVSize() const { return chromaSize().area() * sampleBytes(); }
     
     void validateDimensions() const {
-        if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0) {
-            throw runtime_error("Invalid dimensions for YUV420p");
+        // Subsampled chroma needs even luma dimensions in the subsampled directions
+        if (width <= 0 || height <= 0 ||
+            (sourceFormat != 444 && width % 2 != 0) || (sourceFormat == 420 && height % 2 != 0)) {
+            throw runtime_error("Invalid dimensions for YUV" + to_string(sourceFormat) + "p");
         }
     }
 
@@ -54,6 +71,26 @@ private:
         throw runtime_error("Unsupported YUV format in Y4M header");
     }
 
+    // Sample bit depth from the colour space tag, e.g. C420p10; 8 when absent
+    int parseBitDepth(const string& header) {
+        size_t c_pos = header.find("C");
+        if (c_pos == string::npos) {
+            return 8;
+        }
+
+        string formatStr = header.substr(c_pos, header.find(' ', c_pos) - c_pos);
+        for (size_t p_pos = formatStr.find('p'); p_pos != string::npos; p_pos = formatStr.find('p', p_pos + 1)) {
+            if (p_pos + 1 < formatStr.size() && isdigit(static_cast<unsigned char>(formatStr[p_pos + 1]))) {
+                int depth = stoi(formatStr.substr(p_pos + 1));
+                if (depth < 8 || depth > 16) {
+                    throw runtime_error("Unsupported bit depth in Y4M header");
+                }
+                return depth;
+            }
+        }
+        return 8;
+    }
+
     // Modified to accept generic istream instead of specific ifstream
     bool parseY4MHeader(istream& file) {
         string header;
@@ -64,14 +101,7 @@ private:
         }
 
         sourceFormat = parseFormat(header);
-
-        // Modify header to always indicate 420 format
-        size_t c_pos = header.find("C");
-        if (c_pos != string::npos) {
-            size_t space_pos = header.find(' ', c_pos);
-            header = header.substr(0, c_pos) + "C420" + 
-                    (space_pos != string::npos ? header.substr(space_pos) : "");
-        }
+        bitDepth = parseBitDepth(header);
 
         y4mHeader = header + "\n";
 
@@ -91,128 +121,87 @@ private:
         return true;
     }
 
-    Mat convertUVto420(const Mat& uv, int srcFormat) {
-        Mat result;
-        switch(srcFormat) {
-            case 420:
-                return uv.clone();
-            case 422:
-                resize(uv, result, Size(uv.cols, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            case 444:
-                resize(uv, result, Size(uv.cols/2, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            default:
-                throw runtime_error("Unsupported format conversion");
-        }
-    }
+    // m is given for 8-bit samples; residuals scale with the sample range
+    int golombParameter() const { return m << (bitDepth - 8); }
 
-    // Add progress tracking
+    // Progress goes to stderr, stdout may be carrying the video; total is 0 when unknown
     void updateProgress(int current, int total) const {
-        int percentage = (current * 100) / total;
-        cout << "\rProgress: " << percentage << "% (" << current << "/" << total << " frames)" << flush;
-    }
-
-    // Optimized spatial prediction using OpenCV operations
-    Mat predictChannel(const Mat& channel) const {
-        Mat predictions(channel.size(), CV_8UC1);
-        
-        // Set first column to 128
-        predictions.col(0).setTo(128);
-        
-        // For each remaining column, copy the previous column
-        for (int x = 1; x < channel.cols; ++x) {
-            channel.col(x-1).copyTo(predictions.col(x));
+        if (total > 0) {
+            int percentage = (current * 100) / total;
+            cerr << "\rProgress: " << percentage << "% (" << current << "/" << total << " frames)" << flush;
+        } else {
+            cerr << "\rProgress: " << current << " frames" << flush;
         }
-        
-        return predictions;
     }
 
-    // Optimized residual calculation
-    Mat calculateResidualsWithPrediction(const Mat& channel) const {
-        Mat predictions = predictChannel(channel);
-        Mat residuals;
-        subtract(channel, predictions, residuals, noArray(), CV_32SC1);
-        return residuals;
-    }
-
-    // Write residuals using Golomb coding
-    void writeResiduals(const Mat& residuals, Golomb& golomb) {
-        for (int y = 0; y < residuals.rows; ++y) {
-            for (int x = 0; x < residuals.cols; ++x) {
-                golomb.encode(residuals.at<int>(y, x));
+    /*
+     * Predict, map and entropy-code a plane one row at a time: the West
+     * residuals of a row go straight to the coder, the plane of residuals is
+     * never stored. 8-bit planes take the SIMD kernels.
+     */
+    void encodePlane(const Mat& channel, EntropyCoder& coder) {
+        vector<int> row(channel.cols);
+        for (int y = 0; y < channel.rows; ++y) {
+            if (channel.depth() == CV_8U) {
+                ResidualKernels::westResidualRow(channel.ptr<uchar>(y), row.data(), channel.cols);
+            } else {
+                ResidualKernels::westResidualRow(channel.ptr<ushort>(y), row.data(), channel.cols,
+                                                 1 << (bitDepth - 1));
+            }
+            for (int x = 0; x < channel.cols; ++x) {
+                coder.encode(row[x]);
             }
         }
     }
 
-    // Read residuals using Golomb coding
-    Mat readResiduals(Golomb& golomb, int rows, int cols) {
-        Mat residuals(rows, cols, CV_32SC1);
+    // Decode a row of residuals into `row`, then rebuild it with a running sum, in channel's own buffer
+    void decodePlane(EntropyCoder& coder, int rows, int cols, Mat& channel, vector<int>& row) {
+        AllocationCounter::create(channel, rows, cols, planeType());
+        AllocationCounter::resize(row, cols);
         for (int y = 0; y < rows; ++y) {
             for (int x = 0; x < cols; ++x) {
-                residuals.at<int>(y, x) = golomb.decode_val();
+                row[x] = coder.decode_val();
+            }
+            if (bitDepth == 8) {
+                ResidualKernels::westReconstructRow(row.data(), channel.ptr<uchar>(y), cols);
+            } else {
+                ResidualKernels::westReconstructRow(row.data(), channel.ptr<ushort>(y), cols,
+                                                    1 << (bitDepth - 1), (1 << bitDepth) - 1);
             }
         }
-        return residuals;
-    }
-
-    // Optimized channel reconstruction
-    Mat reconstructChannelWithPrediction(const Mat& residuals) const {
-        Mat result(residuals.size(), CV_8UC1);
-        
-        // First column special case
-        Mat firstCol = residuals.col(0) + 128;
-        firstCol.convertTo(result.col(0), CV_8UC1);
-        
-        for (int x = 1; x < residuals.cols; ++x) {
-            Mat predictedCol = result.col(x-1);
-            Mat residualCol = residuals.col(x);
-            Mat resultCol;
-            add(predictedCol, residualCol, resultCol, noArray(), CV_8UC1);
-            resultCol.copyTo(result.col(x));
-        }
-        
-        return result;
     }
 
-    vector<Mat> readY4MFrame(ifstream& file) {
+    // Read the next frame; false at the end of the stream, which is never sought
+    bool readY4MFrame(istream& file, vector<Mat>& planes) {
         string frameHeader;
-        getline(file, frameHeader);
+        if (!getline(file, frameHeader)) {
+            return false;
+        }
         
-        if (frameHeader != "FRAME") {
+        // Frame headers may carry parameters after the tag
+        if (frameHeader.compare(0, 5, "FRAME") != 0) {
              throw runtime_error("Invalid frame marker");
         }
 
-        vector<Mat> planes;
-        
-        // Read Y plane (same for all formats)
-        Mat Y(height, width, CV_8UC1);
-        file.read(reinterpret_cast<char*>(Y.data), width * height);
-        planes.push_back(Y);
-
-        // Read U and V planes based on source format
-        size_t uvWidth = (sourceFormat == 444) ? width : width/2;
-        size_t uvHeight = (sourceFormat == 420) ? height/2 : height;
-        
-        Mat U(uvHeight, uvWidth, CV_8UC1);
-        Mat V(uvHeight, uvWidth, CV_8UC1);
-        
-        file.read(reinterpret_cast<char*>(U.data), uvWidth * uvHeight);
-        file.read(reinterpret_cast<char*>(V.data), uvWidth * uvHeight);
-        
-        // Convert to 420 if needed
-        if (sourceFormat != 420) {
-            planes.push_back(convertUVto420(U, sourceFormat));
-            planes.push_back(convertUVto420(V, sourceFormat));
-        } else {
-            planes.push_back(U);
-            planes.push_back(V);
+        // Into the planes' own buffers, which the reader recycles from frame to frame
+        planes.resize(3);
+        AllocationCounter::create(planes[0], height, width, planeType());
+        AllocationCounter::create(planes[1], chromaSize(), planeType());
+        AllocationCounter::create(planes[2], chromaSize(), planeType());
+
+        // Y plane, then U and V at the source format's size
+        file.read(reinterpret_cast<char*>(planes[0].data), getYSize());
+        file.read(reinterpret_cast<char*>(planes[1].data), getUVSize());
+        file.read(reinterpret_cast<char*>(planes[2].data), getUVSize());
+
+        if (!file) {
+            throw runtime_error("Truncated Y4M frame");
         }
         
-        return planes;
+        return true;
     }
 
-    void writeY4MFrame(const vector<Mat>& planes, ofstream& file) {
+    void writeY4MFrame(const vector<Mat>& planes, ostream& file) {
         if (planes.size() != 3) {
             throw runtime_error("Invalid number of planes");
         }
@@ -240,65 +229,65 @@ public:
         }
     }
 
+    // Entropy coder of the streams encode writes; decoding takes it from the metadata
+    void setEntropyBackend(EntropyBackend backend) {
+        entropyBackend = backend;
+    }
+
+    // Paths may be "-" for stdin / stdout
     void encode(const string& inputPath, const string& outputPath) {
-        ifstream input(inputPath, ios::binary);
-        if (!input) {
-            throw runtime_error("Could not open input file: " + inputPath);
-        }
+        ifstream inputFile;
+        istream& input = openInput(inputPath, inputFile);
 
         // Parse Y4M header (now also sets sourceFormat)
         if (!parseY4MHeader(input)) {
             throw runtime_error("Invalid Y4M header");
         }
+        validateDimensions();
 
-        // Count frames if not provided
-        if (frameCount == 0) {
-            size_t frameSize = getYSize() + 2 * getSourceUVSize() + 6; // +6 for "FRAME\n"
-            streampos current = input.tellg();
-            input.seekg(0, ios::end);
-            size_t fileSize = static_cast<size_t>(input.tellg()) - static_cast<size_t>(current);
-            frameCount = fileSize / frameSize;
-            input.seekg(current, ios::beg);
-        }
+        // Create the entropy encoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, golombParameter(), false, outputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
 
-        // Write metadata
-        ofstream meta(outputPath + ".meta");
-        if (!meta) {
-            throw runtime_error("Could not create metadata file");
-        }
-        meta << y4mHeader;  // Store original Y4M header
-        meta << frameCount << endl;
-        meta.close();
+        cerr << "Encoding frames..." << endl;
 
-        // Create Golomb encoder
-        Golomb golomb(m, false, outputPath + ".bin", 1);
+        // Input frames are read on their own thread, ahead of the encoder, until the input ends
+        FrameSource<vector<Mat>> reader(PIPELINE_DEPTH,
+                                        [&](vector<Mat>& planes) { return readY4MFrame(input, planes); });
 
-        cout << "Encoding " << frameCount << " frames..." << endl;
-        
-        for (int f = 0; f < frameCount; ++f) {
+        frameCount = 0;
+        vector<Mat> planes;
+        while (reader.next(planes)) {
             try {
-                vector<Mat> planes = readY4MFrame(input);
-                
+                coder.encode(FRAME_MARKER, SyntaxElement::Header);
+
                 // Process and encode each plane
-                Mat yResiduals = calculateResidualsWithPrediction(planes[0]);
-                writeResiduals(yResiduals, golomb);
+                for (const Mat& plane : planes) {
+                    encodePlane(plane, coder);
+                }
                 
-                Mat uResiduals = calculateResidualsWithPrediction(planes[1]);
-                writeResiduals(uResiduals, golomb);
-                
-                Mat vResiduals = calculateResidualsWithPrediction(planes[2]);
-                writeResiduals(vResiduals, golomb);
-                
-                updateProgress(f + 1, frameCount);
+                updateProgress(++frameCount, 0);
             } catch (const exception& e) {
-                cerr << "\nError processing frame " << f << ": " << e.what() << endl;
+                cerr << "\nError processing frame " << frameCount << ": " << e.what() << endl;
                 throw;
             }
         }
-        cout << endl;
+        coder.encode(END_OF_STREAM, SyntaxElement::Header);
+        cerr << endl;
         
-        golomb.end();
-        cout << "Encoding complete" << endl;
+        coder.end();
+
+        // Metadata goes last, once the frame count is known
+        ofstream meta(outputPath + ".meta");
+        if (!meta) {
+            throw runtime_error("Could not create metadata file");
+        }
+        meta << y4mHeader;  // Store original Y4M header
+        meta << frameCount << " " << entropyBackendName(entropyBackend) << endl;
+        meta.close();
+
+        cerr << "Encoding complete" << endl;
     }
 
     void decode(const string& inputPath, const string& outputPath) {
@@ -311,6 +300,11 @@ public:
         // Read Y4M header from metadata
         getline(meta, y4mHeader);
         meta >> frameCount;
+        string backendName;
+        if (!(meta >> backendName)) {
+            throw runtime_error("Invalid metadata file");
+        }
+        entropyBackend = parseEntropyBackend(backendName);
         
         // Parse dimensions from Y4M header
         stringstream headerStream(y4mHeader);
@@ -321,36 +315,37 @@ public:
         meta.close();
         validateDimensions();
 
-        // Create Golomb decoder
-        Golomb golomb(m, true, inputPath + ".bin", 1);
+        // Create the entropy decoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, golombParameter(), true, inputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
 
-        // Open output file and write Y4M header
-        ofstream output(outputPath, ios::binary);
-        if (!output) {
-            throw runtime_error("Could not open output file");
-        }
+        // Open output file (or stdout) and write Y4M header
+        ofstream outputFile;
+        ostream& output = openOutput(outputPath, outputFile);
         output << y4mHeader;
 
-        cout << "Decoding " << frameCount << " frames..." << endl;
+        cerr << "Decoding " << frameCount << " frames..." << endl;
+
+        // Frames are written on their own thread while the next ones decode
+        FrameSink<vector<Mat>> writer(PIPELINE_DEPTH,
+                                      [&](vector<Mat>& planes) { writeY4MFrame(planes, output); });
 
-        for (int f = 0; f < frameCount; ++f) {
+        vector<Mat> reconstructedPlanes;
+        vector<int> row;  // one row of residuals, reused across planes and frames
+
+        // The stream ends at its own marker; the count in the metadata is for progress only
+        for (int f = 0; coder.decode_val(SyntaxElement::Header) != END_OF_STREAM; ++f) {
             try {
-                vector<Mat> reconstructedPlanes;
-                
-                // Read and reconstruct Y plane
-                Mat yResiduals = readResiduals(golomb, height, width);
-                reconstructedPlanes.push_back(reconstructChannelWithPrediction(yResiduals));
-                
-                // Read and reconstruct U plane
-                Mat uResiduals = readResiduals(golomb, height/2, width/2);
-                reconstructedPlanes.push_back(reconstructChannelWithPrediction(uResiduals));
-                
-                // Read and reconstruct V plane
-                Mat vResiduals = readResiduals(golomb, height/2, width/2);
-                reconstructedPlanes.push_back(reconstructChannelWithPrediction(vResiduals));
+                // Decode and reconstruct the Y, U and V planes in the writer's recycled buffers
+                writer.acquire(reconstructedPlanes);
+                reconstructedPlanes.resize(3);
+                for (int i = 0; i < 3; ++i) {
+                    decodePlane(coder, planeSize(i).height, planeSize(i).width, reconstructedPlanes[i], row);
+                }
                 
-                // Write reconstructed Y4M frame
-                writeY4MFrame(reconstructedPlanes, output);
+                // Queue the reconstructed Y4M frame for writing
+                writer.push(move(reconstructedPlanes));
                 
                 updateProgress(f + 1, frameCount);
             } catch (const exception& e) {
@@ -358,8 +353,10 @@ public:
                 throw;
             }
         }
-        cout << endl;
+        writer.finish();
+        output.flush();
+        cerr << endl;
         
-        cout << "Decoding complete" << endl;
+        cerr << "Decoding complete" << endl;
     }
-};
\ No newline at end of file
+};
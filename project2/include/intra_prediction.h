@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "residual_kernels.h"
+#include "allocation_counter.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Directional intra prediction of a block from the decoded pixels around it:
+ * the left column, the top row and up to one block width of top-right pixels.
+ * Neighbours outside the frame are substituted from the available ones, or
+ * mid-grey when there are none, so every mode works on every block. Frames
+ * are CV_8UC1, or CV_16UC1 with 9 to 16-bit samples (see load).
+ *
+ * MED is the JPEG-LS median predictor run per pixel, so it also reads the
+ * block's own decoded pixels; its prediction only exists while the block is
+ * rebuilt in raster order (see medAt and reconstruct).
+ */
+class IntraPredictor {
+public:
+    // Ordered by how often they win, since lower modes are cheaper to code
+    enum Mode {
+        DC,
+        HORIZONTAL,
+        VERTICAL,
+        PLANAR,
+        MED,
+        DIAGONAL_DOWN_LEFT,   // 45 degrees, from the top-right
+        DIAGONAL_DOWN_RIGHT,  // 45 degrees, from the top-left corner
+        VERTICAL_LEFT,
+        VERTICAL_RIGHT,
+        HORIZONTAL_DOWN,
+        MODE_COUNT
+    };
+
+private:
+    int width = 0, height = 0;
+    vector<int> top;   // width + height + 1 samples above the block, top-right included
+    vector<int> left;  // height + width + 1 samples left of the block
+    vector<int> ref;   // angular reference line
+    int corner = 128;
+    int mid = 128, maxValue = 255;  // of the loaded frame's bit depth
+    Mat predictionBuffer;  // reconstruct's prediction, reused from block to block
+
+    static int median(int a, int b, int c) {
+        if (c >= max(a, b)) return min(a, b);
+        if (c <= min(a, b)) return max(a, b);
+        return a + b - c;
+    }
+
+    /*
+     * HEVC-style angular prediction along the top row (vertical) or the left
+     * column (horizontal), `angle` in 1/32 pixel per line. Negative angles
+     * extend the main reference with side samples projected onto it.
+     */
+    template<typename T> void angular(int angle, bool vertical, Mat& prediction) {
+        int length = vertical ? width : height;  // samples per line
+        int lines = vertical ? height : width;
+        const vector<int>& mainEdge = vertical ? top : left;
+        const vector<int>& sideEdge = vertical ? left : top;
+
+        // ref[lines + k] is reference sample k, k = 0 being the corner
+        AllocationCounter::assign(ref, lines + length + lines + 2, corner);
+        for (int k = 1; k <= length + lines; ++k) {
+            ref[lines + k] = mainEdge[k - 1];
+        }
+        if (angle < 0) {
+            int inverseAngle = -8192 / -angle;
+            for (int k = -1; k >= (lines * angle) >> 5; --k) {
+                int side = ((k * inverseAngle + 128) >> 8) - 1;
+                ref[lines + k] = sideEdge[min(side, static_cast<int>(sideEdge.size()) - 1)];
+            }
+        }
+
+        for (int line = 0; line < lines; ++line) {
+            int position = (line + 1) * angle;
+            int offset = position >> 5;
+            int fraction = position & 31;
+            for (int i = 0; i < length; ++i) {
+                int k = lines + i + offset + 1;
+                T value = static_cast<T>(((32 - fraction) * ref[k] + fraction * ref[k + 1] + 16) >> 5);
+                if (vertical) prediction.at<T>(line, i) = value;
+                else prediction.at<T>(i, line) = value;
+            }
+        }
+    }
+
+    template<typename T> void load(const Mat& frame, const Rect& blockRect) {
+        width = blockRect.width;
+        height = blockRect.height;
+        bool hasTop = blockRect.y > 0;
+        bool hasLeft = blockRect.x > 0;
+        int fallbackTop = hasLeft ? frame.at<T>(blockRect.y, blockRect.x - 1) : mid;
+
+        AllocationCounter::assign(top, width + height + 1, fallbackTop);
+        if (hasTop) {
+            const T* row = frame.ptr<T>(blockRect.y - 1) + blockRect.x;
+            int available = min(2 * width, frame.cols - blockRect.x);
+            for (int i = 0; i < static_cast<int>(top.size()); ++i) {
+                top[i] = row[min(i, available - 1)];
+            }
+        }
+
+        AllocationCounter::assign(left, height + width + 1, hasTop ? top[0] : mid);
+        if (hasLeft) {
+            for (int j = 0; j < static_cast<int>(left.size()); ++j) {
+                left[j] = frame.at<T>(blockRect.y + min(j, height - 1), blockRect.x - 1);
+            }
+        }
+
+        if (hasTop && hasLeft) corner = frame.at<T>(blockRect.y - 1, blockRect.x - 1);
+        else if (hasTop) corner = top[0];
+        else corner = left[0];
+    }
+
+    template<typename T> void predict(Mode mode, const Mat& frame, const Rect& blockRect, Mat& prediction) {
+        switch (mode) {
+            case DC: {
+                int sum = 0;
+                for (int i = 0; i < width; ++i) sum += top[i];
+                for (int j = 0; j < height; ++j) sum += left[j];
+                prediction = Scalar((sum + (width + height) / 2) / (width + height));
+                break;
+            }
+            case HORIZONTAL:
+                for (int y = 0; y < height; ++y) {
+                    for (int x = 0; x < width; ++x) prediction.at<T>(y, x) = static_cast<T>(left[y]);
+                }
+                break;
+            case VERTICAL:
+                for (int y = 0; y < height; ++y) {
+                    for (int x = 0; x < width; ++x) prediction.at<T>(y, x) = static_cast<T>(top[x]);
+                }
+                break;
+            case PLANAR: {
+                // Blend of a horizontal and a vertical linear ramp
+                int topRight = top[width], bottomLeft = left[height];
+                int area = width * height;
+                for (int y = 0; y < height; ++y) {
+                    for (int x = 0; x < width; ++x) {
+                        int horizontal = (width - 1 - x) * left[y] + (x + 1) * topRight;
+                        int vertical = (height - 1 - y) * top[x] + (y + 1) * bottomLeft;
+                        prediction.at<T>(y, x) = static_cast<T>((horizontal * height + vertical * width + area) / (2 * area));
+                    }
+                }
+                break;
+            }
+            case MED:
+                for (int y = 0; y < height; ++y) {
+                    for (int x = 0; x < width; ++x) prediction.at<T>(y, x) = static_cast<T>(medAt<T>(frame, blockRect, x, y));
+                }
+                break;
+            case DIAGONAL_DOWN_LEFT:  angular<T>(32, true, prediction); break;
+            case DIAGONAL_DOWN_RIGHT: angular<T>(-32, true, prediction); break;
+            case VERTICAL_LEFT:       angular<T>(13, true, prediction); break;
+            case VERTICAL_RIGHT:      angular<T>(-13, true, prediction); break;
+            case HORIZONTAL_DOWN:     angular<T>(-13, false, prediction); break;
+            default:
+                throw runtime_error("Invalid intra prediction mode");
+        }
+    }
+
+    template<typename T, typename R> void reconstruct(Mode mode, Mat& frame, const Rect& blockRect, const Mat& residuals) {
+        if (mode == MED) {
+            for (int y = 0; y < height; ++y) {
+                const R* res = residuals.ptr<R>(y);
+                T* out = frame.ptr<T>(blockRect.y + y) + blockRect.x;
+                for (int x = 0; x < width; ++x) {
+                    out[x] = static_cast<T>(min(max(medAt<T>(frame, blockRect, x, y) + res[x], 0), maxValue));
+                }
+            }
+            return;
+        }
+        Mat prediction = AllocationCounter::view(predictionBuffer, height, width, frame.type());
+        predict<T>(mode, frame, blockRect, prediction);
+        for (int y = 0; y < height; ++y) {
+            ResidualKernels::addRow(prediction.ptr<T>(y), residuals.ptr<R>(y),
+                                    frame.ptr<T>(blockRect.y + y) + blockRect.x, width, maxValue);
+        }
+    }
+
+public:
+    // Gather the neighbours of blockRect from the decoded pixels of frame, whose samples have bitDepth bits
+    void load(const Mat& frame, const Rect& blockRect, int bitDepth = 8) {
+        mid = 1 << (bitDepth - 1);
+        maxValue = (1 << bitDepth) - 1;
+        if (frame.depth() == CV_8U) load<uchar>(frame, blockRect);
+        else load<ushort>(frame, blockRect);
+    }
+
+    // JPEG-LS prediction of pixel (x, y) of the block, reading the decoded block pixels in frame
+    template<typename T> int medAt(const Mat& frame, const Rect& blockRect, int x, int y) const {
+        int a = x > 0 ? frame.at<T>(blockRect.y + y, blockRect.x + x - 1) : left[y];
+        int b = y > 0 ? frame.at<T>(blockRect.y + y - 1, blockRect.x + x) : top[x];
+        int c;
+        if (x > 0 && y > 0) c = frame.at<T>(blockRect.y + y - 1, blockRect.x + x - 1);
+        else if (x > 0) c = top[x - 1];
+        else if (y > 0) c = left[y - 1];
+        else c = corner;
+        return median(a, b, c);
+    }
+
+    /*
+     * Prediction of the loaded block. MED reads the block's pixels from frame,
+     * which is only valid when they are final (lossless coding). A prediction
+     * of the block's size is written in place (see AllocationCounter::view).
+     */
+    void predict(Mode mode, const Mat& frame, const Rect& blockRect, Mat& prediction) {
+        AllocationCounter::create(prediction, height, width, frame.type());
+        if (frame.depth() == CV_8U) predict<uchar>(mode, frame, blockRect, prediction);
+        else predict<ushort>(mode, frame, blockRect, prediction);
+    }
+
+    // Rebuild the loaded block in frame from its decoded residuals (CV_32SC1, or CV_16SC1 for 8-bit frames)
+    void reconstruct(Mode mode, Mat& frame, const Rect& blockRect, const Mat& residuals) {
+        if (frame.depth() != CV_8U) reconstruct<ushort, int>(mode, frame, blockRect, residuals);
+        else if (residuals.depth() == CV_16S) reconstruct<uchar, short>(mode, frame, blockRect, residuals);
+        else reconstruct<uchar, int>(mode, frame, blockRect, residuals);
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/*
+ * Linear prediction for the audio codec: windowed autocorrelation,
+ * Levinson-Durbin recursion and quantized coefficients. The prediction of
+ * sample i is
+ *   (sum_j coefficients[j] * x[i - 1 - j]) >> shift
+ * in integers, so encoder and decoder get exactly the same value. It is
+ * computed in int32, four samples (or coefficients) per SSE2 step, when
+ * the coefficients can't overflow it for the sample width, and in int64
+ * otherwise.
+ */
+class LinearPrediction {
+public:
+    static const int MAX_ORDER = 32;
+    static const int MAX_PRECISION = 15;  // coefficient bits, sign included, so they fit in int16
+
+    struct Coefficients {
+        int order = 0;
+        int shift = 0;
+        int values[MAX_ORDER] = {};
+    };
+
+private:
+#ifdef __SSE2__
+    // Low 32 bits of four 32-bit products (SSE2 has no pmulld)
+    static __m128i multiplyLow(__m128i a, __m128i b) {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    static int horizontalSum(__m128i v) {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+    }
+#endif
+
+public:
+    /*
+     * Autocorrelation r[0..maxLag] of x under a Tukey (0.5) window, the
+     * window FLAC uses: it tapers the block edges without flattening the
+     * spectrum much. `windowed` is scratch.
+     */
+    static void autocorrelation(const int* x, int n, int maxLag, vector<double>& windowed, double* r) {
+        windowed.resize(n);
+        int taper = n / 4;
+        for (int i = 0; i < n; ++i) {
+            double w = 1.0;
+            if (i < taper) w = 0.5 - 0.5 * cos(M_PI * i / taper);
+            else if (i >= n - taper) w = 0.5 - 0.5 * cos(M_PI * (n - 1 - i) / taper);
+            windowed[i] = x[i] * w;
+        }
+        const double* d = windowed.data();
+        for (int lag = 0; lag <= maxLag; ++lag) {
+            int count = n - lag;
+            int i = 0;
+            double sum = 0;
+#ifdef __SSE2__
+            __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+            for (; i + 4 <= count; i += 4) {
+                acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(d + i), _mm_loadu_pd(d + i + lag)));
+                acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(d + i + 2), _mm_loadu_pd(d + i + lag + 2)));
+            }
+            double lanes[2];
+            _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+            sum = lanes[0] + lanes[1];
+#endif
+            for (; i < count; ++i) sum += d[i] * d[i + lag];
+            r[lag] = sum;
+        }
+    }
+
+    /*
+     * Levinson-Durbin recursion: predictors of every order up to maxOrder
+     * from the autocorrelation, lp[m - 1][j] being coefficient j of order m,
+     * and the prediction error energy of each order in errors[m - 1].
+     * Returns the highest order it could reach (0 for a silent block).
+     */
+    static int levinsonDurbin(const double* r, int maxOrder, double lp[][MAX_ORDER], double* errors) {
+        double error = r[0] * (1 + 1e-10);  // a touch of white noise keeps it stable
+        if (error <= 0) return 0;
+        double a[MAX_ORDER] = {};
+        for (int m = 0; m < maxOrder; ++m) {
+            double acc = r[m + 1];
+            for (int j = 0; j < m; ++j) acc -= a[j] * r[m - j];
+            double k = acc / error;
+            double previous[MAX_ORDER];
+            copy(a, a + m, previous);
+            for (int j = 0; j < m; ++j) a[j] = previous[j] - k * previous[m - 1 - j];
+            a[m] = k;
+            error *= 1 - k * k;
+            if (error <= 0) return m;
+            copy(a, a + m + 1, lp[m]);
+            errors[m] = error;
+        }
+        return maxOrder;
+    }
+
+    // Coefficients scaled to `precision` bits, rounding with error feedback so the sum stays right
+    static Coefficients quantize(const double* lp, int order, int precision) {
+        Coefficients q;
+        q.order = order;
+        double largest = 0;
+        for (int j = 0; j < order; ++j) largest = max(largest, fabs(lp[j]));
+        if (largest <= 0) return q;
+        int exponent;
+        frexp(largest, &exponent);  // largest < 2^exponent
+        q.shift = min(max(precision - 1 - exponent, 0), 31);
+        int limit = (1 << (precision - 1)) - 1;
+        double error = 0;
+        for (int j = 0; j < order; ++j) {
+            error += lp[j] * (1u << q.shift);
+            int value = static_cast<int>(lround(error));
+            value = max(-limit - 1, min(limit, value));
+            q.values[j] = value;
+            error -= value;
+        }
+        return q;
+    }
+
+    // Whether every partial sum of a prediction fits in int32 for samples of sampleBits bits
+    static bool fitsInt32(const Coefficients& q, int sampleBits) {
+        int64_t sum = 0;
+        for (int j = 0; j < q.order; ++j) sum += abs(q.values[j]);
+        return (sum << (sampleBits - 1)) < (int64_t(1) << 31);
+    }
+
+    // residuals[i] = x[i] - prediction, for i in [order, n)
+    static void residuals(const int* x, int n, const Coefficients& q, int sampleBits, int* out) {
+        int i = q.order;
+        if (!fitsInt32(q, sampleBits)) {
+            for (; i < n; ++i) {
+                int64_t sum = 0;
+                for (int j = 0; j < q.order; ++j) sum += int64_t(q.values[j]) * x[i - 1 - j];
+                out[i] = x[i] - static_cast<int>(sum >> q.shift);
+            }
+            return;
+        }
+#ifdef __SSE2__
+        // Four samples at a time, one coefficient per step
+        __m128i shift = _mm_cvtsi32_si128(q.shift);
+        for (; i + 4 <= n; i += 4) {
+            __m128i sum = _mm_setzero_si128();
+            for (int j = 0; j < q.order; ++j) {
+                __m128i history = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i - 1 - j));
+                sum = _mm_add_epi32(sum, multiplyLow(_mm_set1_epi32(q.values[j]), history));
+            }
+            __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi32(current, _mm_sra_epi32(sum, shift)));
+        }
+#endif
+        for (; i < n; ++i) {
+            int sum = 0;
+            for (int j = 0; j < q.order; ++j) sum += q.values[j] * x[i - 1 - j];
+            out[i] = x[i] - (sum >> q.shift);
+        }
+    }
+
+    /*
+     * The decoder's side: x holds the warm-up samples in [0, order) and the
+     * residuals from there on, which are turned into samples in place. Each
+     * sample needs the previous one, so the vector steps run over the
+     * coefficients instead.
+     */
+    static void restore(int* x, int n, const Coefficients& q, int sampleBits) {
+        if (!fitsInt32(q, sampleBits)) {
+            for (int i = q.order; i < n; ++i) {
+                int64_t sum = 0;
+                for (int j = 0; j < q.order; ++j) sum += int64_t(q.values[j]) * x[i - 1 - j];
+                x[i] += static_cast<int>(sum >> q.shift);
+            }
+            return;
+        }
+        // Reversed, coefficient k goes with x[i - order + k] and both run forwards
+        int reversed[MAX_ORDER];
+        for (int k = 0; k < q.order; ++k) reversed[k] = q.values[q.order - 1 - k];
+        for (int i = q.order; i < n; ++i) {
+            const int* history = x + i - q.order;
+            int k = 0, sum = 0;
+#ifdef __SSE2__
+            __m128i acc = _mm_setzero_si128();
+            for (; k + 4 <= q.order; k += 4) {
+                acc = _mm_add_epi32(acc, multiplyLow(_mm_loadu_si128(reinterpret_cast<const __m128i*>(reversed + k)),
+                                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(history + k))));
+            }
+            sum = horizontalSum(acc);
+#endif
+            for (; k < q.order; ++k) sum += reversed[k] * history[k];
+            x[i] += sum >> q.shift;
+        }
+    }
+};
@@ -3,9 +3,22 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cctype>
+#include <cstdio>
+#include <climits>
 #include "Image_codec.h"
 #include <opencv2/opencv.hpp>
 #include "inter_frame_video_codec.h"
+#include "thread_pool.h"
+#include "integer_transform.h"
+#include "rate_control.h"
+#include "seek_index.h"
+#include "frame_pipeline.h"
+#include "allocation_counter.h"
+#include "stream_io.h"
+#include "entropy_backend.h"
+#include "intra_prediction.h"
+#include "residual_kernels.h"
 
 using namespace cv;
 using namespace std;
@@ -21,34 +34,66 @@ protected:
     int blockSize;         
     int searchRange;       
     string y4mHeader;
-    int sourceFormat;
+    int sourceFormat = 420;
+    int bitDepth = 8;      // 9 to 16-bit samples are stored in CV_16UC1 planes
     int quantizationStep;  // QP parameter for lossy compression
+    int transformSize;     // 4 or 8 for integer DCT coding, 0 to quantize spatial residuals
+    RateController::Mode rateMode = RateController::CONSTANT_QP;
+    double targetBitrate = 0;  // bits per second, for RateController::TARGET_BITRATE
+    double frameRate = 30;
+    EntropyBackend entropyBackend = EntropyBackend::Rice;
+
+    // Rice parameters of runs and levels as shifts (m = 1 << shift)
+    static const int RICE_SHIFTS = 10;
+    struct RunLevelRice {
+        int run = 1;
+        int level = 0;
+    };
+    // Per [isChroma]: a plane is coded, and its blocks priced, with what the previous plane of its kind measured
+    RunLevelRice runLevelRice[2];
     const double UV_QP_FACTOR = 2.0;  // Higher quantization for chrominance
 
     // Add new member variables for improved motion estimation
     const int EARLY_EXIT_THRESHOLD = 256;
+    const int PIPELINE_DEPTH = 4;      // Frames in flight between pipeline stages
+
+    // Frame type codes; the stream ends with its own marker, the count isn't known up front
+    const int P_FRAME = 0;
+    const int I_FRAME = 1;
+    const int END_OF_STREAM = 2;
 
     // New constants for improved compression
     const int SKIP_THRESHOLD = 3;      // Maximum absolute sum for skip mode
     const int SEARCH_STEP = 2;         // Step size for fast motion search
-    const int MAX_ZERO_RUN = 1024;     // Maximum zero run length
-    const float LAMBDA = 0.9;          // Rate-distortion trade-off factor
+    const double LAMBDA = 0.135;       // lambda = LAMBDA * qStep^2, as H.264's 0.85 * 2^((QP-12)/3)
 
     // Helper functions from previous implementation
-    size_t getYSize() const { return width * height; }
-    size_t getUVSize() const { return (width/2) * (height/2); }
-    size_t getSourceUVSize() const {
+    int sampleBytes() const { return bitDepth > 8 ? 2 : 1; }
+    int planeType() const { return bitDepth > 8 ? CV_16UC1 : CV_8UC1; }
+    int maxSample() const { return (1 << bitDepth) - 1; }
+    size_t getYSize() const { return width * height * sampleBytes(); }
+    // Chroma planes are coded at the source's own subsampling
+    Size chromaSize() const {
         switch(sourceFormat) {
-            case 420: return (width/2) * (height/2);
-            case 422: return (width/2) * height;
-            case 444: return width * height;
+            case 420: return Size(width/2, height/2);
+            case 422: return Size(width/2, height);
+            case 444: return Size(width, height);
             default: throw runtime_error("Unsupported format");
         }
     }
+    Size planeSize(int plane) const { return plane == 0 ? Size(width, height) : chromaSize(); }
+    size_t getUVSize() const { return chromaSize().area() * sampleBytes(); }
+
+    // Chroma blocks cover the same picture area as luma blocks horizontally
+    int planeBlockSize(int plane) const {
+        return (plane == 0 || sourceFormat == 444) ? blockSize : blockSize/2;
+    }
     
     void validateDimensions() const {
-        if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0) {
-            throw runtime_error("Invalid dimensions for YUV420p");
+        // Subsampled chroma needs even luma dimensions in the subsampled directions
+        if (width <= 0 || height <= 0 ||
+            (sourceFormat != 444 && width % 2 != 0) || (sourceFormat == 420 && height % 2 != 0)) {
+            throw runtime_error("Invalid dimensions for YUV" + to_string(sourceFormat) + "p");
         }
     }
 
@@ -66,6 +111,37 @@ protected:
         throw runtime_error("Unsupported YUV format in Y4M header");
     }
 
+    // Sample bit depth from the colour space tag, e.g. C420p10; 8 when absent
+    int parseBitDepth(const string& header) {
+        size_t c_pos = header.find("C");
+        if (c_pos == string::npos) {
+            return 8;
+        }
+
+        string formatStr = header.substr(c_pos, header.find(' ', c_pos) - c_pos);
+        for (size_t p_pos = formatStr.find('p'); p_pos != string::npos; p_pos = formatStr.find('p', p_pos + 1)) {
+            if (p_pos + 1 < formatStr.size() && isdigit(static_cast<unsigned char>(formatStr[p_pos + 1]))) {
+                int depth = stoi(formatStr.substr(p_pos + 1));
+                if (depth < 8 || depth > 16) {
+                    throw runtime_error("Unsupported bit depth in Y4M header");
+                }
+                return depth;
+            }
+        }
+        return 8;
+    }
+
+    // Frame rate from the "F<num>:<den>" header field (30 fps if absent)
+    double parseFrameRate(const string& header) const {
+        size_t f_pos = header.find(" F");
+        if (f_pos == string::npos) return 30;
+        int num = 0, den = 1;
+        if (sscanf(header.c_str() + f_pos + 2, "%d:%d", &num, &den) != 2 || num <= 0 || den <= 0) {
+            return 30;
+        }
+        return static_cast<double>(num) / den;
+    }
+
     bool parseY4MHeader(istream& file) {
         string header;
         getline(file, header);
@@ -75,16 +151,10 @@ protected:
         }
 
         sourceFormat = parseFormat(header);
+        bitDepth = parseBitDepth(header);
         
-        // Modify header to always indicate 420 format
-        size_t c_pos = header.find("C");
-        if (c_pos != string::npos) {
-            size_t space_pos = header.find(' ', c_pos);
-            header = header.substr(0, c_pos) + "C420" + 
-                    (space_pos != string::npos ? header.substr(space_pos) : "");
-        }
-
         y4mHeader = header + "\n";
+        frameRate = parseFrameRate(header);
         
         size_t w_pos = header.find("W");
         size_t h_pos = header.find("H");
@@ -102,60 +172,37 @@ protected:
         return true;
     }
 
-    Mat convertUVto420(const Mat& uv, int srcFormat) {
-        Mat result;
-        switch(srcFormat) {
-            case 420:
-                return uv.clone();
-            case 422:
-                resize(uv, result, Size(uv.cols, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            case 444:
-                resize(uv, result, Size(uv.cols/2, uv.rows/2), 0, 0, INTER_AREA);
-                return result;
-            default:
-                throw runtime_error("Unsupported format conversion");
-        }
-    }
-
-    vector<Mat> readY4MFrame(ifstream& file) {
+    // Read the next frame; false at the end of the stream, which is never sought
+    bool readY4MFrame(istream& file, vector<Mat>& planes) {
         string frameHeader;
-        getline(file, frameHeader);
+        if (!getline(file, frameHeader)) {
+            return false;
+        }
         
-        if (frameHeader != "FRAME") {
+        // Frame headers may carry parameters after the tag
+        if (frameHeader.compare(0, 5, "FRAME") != 0) {
             throw runtime_error("Invalid frame marker");
         }
 
-        vector<Mat> planes;
-        
-        // Read Y plane (same for all formats)
-        Mat Y(height, width, CV_8UC1);
-        file.read(reinterpret_cast<char*>(Y.data), width * height);
-        planes.push_back(Y);
-
-        // Read U and V planes based on source format
-        size_t uvWidth = (sourceFormat == 444) ? width : width/2;
-        size_t uvHeight = (sourceFormat == 420) ? height/2 : height;
-        
-        Mat U(uvHeight, uvWidth, CV_8UC1);
-        Mat V(uvHeight, uvWidth, CV_8UC1);
-        
-        file.read(reinterpret_cast<char*>(U.data), uvWidth * uvHeight);
-        file.read(reinterpret_cast<char*>(V.data), uvWidth * uvHeight);
-        
-        // Convert to 420 if needed
-        if (sourceFormat != 420) {
-            planes.push_back(convertUVto420(U, sourceFormat));
-            planes.push_back(convertUVto420(V, sourceFormat));
-        } else {
-            planes.push_back(U);
-            planes.push_back(V);
+        // Into the planes' own buffers, which pipelines recycle from frame to frame
+        planes.resize(3);
+        AllocationCounter::create(planes[0], height, width, planeType());
+        AllocationCounter::create(planes[1], chromaSize(), planeType());
+        AllocationCounter::create(planes[2], chromaSize(), planeType());
+
+        // Y plane, then U and V at the source format's size
+        file.read(reinterpret_cast<char*>(planes[0].data), getYSize());
+        file.read(reinterpret_cast<char*>(planes[1].data), getUVSize());
+        file.read(reinterpret_cast<char*>(planes[2].data), getUVSize());
+
+        if (!file) {
+            throw runtime_error("Truncated Y4M frame");
         }
         
-        return planes;
+        return true;
     }
 
-    void writeY4MFrame(const vector<Mat>& planes, ofstream& file) {
+    void writeY4MFrame(const vector<Mat>& planes, ostream& file) {
         if (planes.size() != 3) {
             throw runtime_error("Invalid number of planes");
         }
@@ -175,97 +222,77 @@ protected:
         }
     }
 
-    // Spatial prediction for a single channel
-    Mat predictChannel(const Mat& channel) const {
-        Mat predictions(channel.size(), CV_8UC1);
-        
-        for (int y = 0; y < channel.rows; ++y) {
-            predictions.at<uchar>(y, 0) = 128;
-            for (int x = 1; x < channel.cols; ++x) {
-                predictions.at<uchar>(y, x) = channel.at<uchar>(y, x-1);
-            }
-        }
-        return predictions;
-    }
-
-    // Calculate residuals with prediction
-    Mat calculateResidualsWithPrediction(const Mat& channel) const {
-        Mat predictions = predictChannel(channel);
-        Mat residuals(channel.size(), CV_32SC1);
-        
-        for (int y = 0; y < channel.rows; ++y) {
-            for (int x = 0; x < channel.cols; ++x) {
-                residuals.at<int>(y, x) = static_cast<int>(channel.at<uchar>(y, x)) - 
-                                        static_cast<int>(predictions.at<uchar>(y, x));
-            }
-        }
-        return residuals;
-    }
-
-    // Reconstruct channel from residuals using prediction
-    Mat reconstructChannelWithPrediction(const Mat& residuals) const {
-        Mat result(residuals.size(), CV_8UC1);
-        
-        for (int y = 0; y < residuals.rows; y++) {
-            int predicted = 128;
-            int pixel = predicted + residuals.at<int>(y, 0);
-            result.at<uchar>(y, 0) = saturate_cast<uchar>(pixel);
-            
-            for (int x = 1; x < residuals.cols; x++) {
-                predicted = result.at<uchar>(y, x-1);
-                pixel = predicted + residuals.at<int>(y, x);
-                result.at<uchar>(y, x) = saturate_cast<uchar>(pixel);
-            }
-        }
-        return result;
-    }
-
     // Helper function to validate motion vector bounds
-    bool isValidMotionVector(const Point2i& mv, const Point& blockPos, const Mat& reference) const {
+    bool isValidMotionVector(const Point2i& mv, const Point& blockPos, const Mat& reference,
+                             const Size& currentBlockSize) const {
         Point2i newPos(blockPos.x + mv.x, blockPos.y + mv.y);
         return newPos.x >= 0 && 
                newPos.y >= 0 && 
-               newPos.x + blockSize <= reference.cols &&
-               newPos.y + blockSize <= reference.rows;
+               newPos.x + currentBlockSize.width <= reference.cols &&
+               newPos.y + currentBlockSize.height <= reference.rows;
     }
 
     // Helper function to calculate Sum of Absolute Differences
-    int calculateSAD(const Mat& currentBlock, const Mat& referenceFrame, 
+    template<typename T> int calculateSAD(const Mat& currentBlock, const Mat& referenceFrame, 
                     const Point& blockPos, const Point2i& mv) const {
         Mat candidateBlock = referenceFrame(
-            Rect(blockPos.x + mv.x, blockPos.y + mv.y, blockSize, blockSize));
+            Rect(blockPos.x + mv.x, blockPos.y + mv.y, currentBlock.cols, currentBlock.rows));
         
         int SAD = 0;
-        for(int y = 0; y < blockSize; y++) {
-            for(int x = 0; x < blockSize; x++) {
-                SAD += abs(currentBlock.at<uchar>(y, x) - candidateBlock.at<uchar>(y, x));
+        for(int y = 0; y < currentBlock.rows; y++) {
+            for(int x = 0; x < currentBlock.cols; x++) {
+                SAD += abs(currentBlock.at<T>(y, x) - candidateBlock.at<T>(y, x));
             }
         }
         return SAD;
     }
 
-    // Improved motion estimation with early exit and spiral search
+    // Median of the left, top and top-right motion vectors (H.264 style)
+    Point2i predictMotionVector(const vector<Point2i>& motionVectors, int bx, int by, int blocksX) const {
+        if (bx == 0 && by == 0) return Point2i(0, 0);
+        if (by == 0) return motionVectors[bx - 1];
+
+        Point2i left = bx > 0 ? motionVectors[by * blocksX + bx - 1] : Point2i(0, 0);
+        Point2i top = motionVectors[(by - 1) * blocksX + bx];
+        Point2i topRight = bx + 1 < blocksX ? motionVectors[(by - 1) * blocksX + bx + 1]
+                                            : (bx > 0 ? motionVectors[(by - 1) * blocksX + bx - 1] : top);
+        auto median = [](int a, int b, int c) { return max(min(a, b), min(max(a, b), c)); };
+        return Point2i(median(left.x, top.x, topRight.x), median(left.y, top.y, topRight.y));
+    }
+
+    // Improved motion estimation with early exit, seeded with the predicted vector
+    template<typename T>
     Point2i estimateMotion(const Mat& currentBlock, const Mat& referenceFrame, 
-                          const Point& blockPos) const {
-        // ...existing code...
+                          const Point& blockPos, const Point2i& predictedMV) const {
+        // The threshold is in 8-bit units, SADs grow with the sample range
+        const int earlyExit = EARLY_EXIT_THRESHOLD << (bitDepth - 8);
+        Point2i bestMV(0, 0);
+        int minSAD = calculateSAD<T>(currentBlock, referenceFrame, blockPos, bestMV);
+        if (predictedMV != bestMV && isValidMotionVector(predictedMV, blockPos, referenceFrame, currentBlock.size())) {
+            int sad = calculateSAD<T>(currentBlock, referenceFrame, blockPos, predictedMV);
+            if (sad < minSAD) {
+                minSAD = sad;
+                bestMV = predictedMV;
+            }
+        }
+        if(minSAD < earlyExit) return bestMV;
         
-        // Use hierarchical search with multiple scales
+        // Use hierarchical search with multiple scales around the best candidate
         vector<int> searchSteps = {8, 4, 2, 1};
-        Point2i bestMV(0, 0);
-        int minSAD = INT_MAX;
 
         for(int step : searchSteps) {
             int rangeStart = -searchRange/step;
             int rangeEnd = searchRange/step;
+            Point2i center = bestMV;
             
             for(int dy = rangeStart; dy <= rangeEnd; dy += 1) {
                 for(int dx = rangeStart; dx <= rangeEnd; dx += 1) {
-                    Point2i mv(bestMV.x + dx*step, bestMV.y + dy*step);
+                    Point2i mv(center.x + dx*step, center.y + dy*step);
                     
                     // Check boundaries
-                    if(!isValidMotionVector(mv, blockPos, referenceFrame)) continue;
+                    if(!isValidMotionVector(mv, blockPos, referenceFrame, currentBlock.size())) continue;
                     
-                    int sad = calculateSAD(currentBlock, referenceFrame, blockPos, mv);
+                    int sad = calculateSAD<T>(currentBlock, referenceFrame, blockPos, mv);
                     
                     if(sad < minSAD) {
                         minSAD = sad;
@@ -273,7 +300,7 @@ protected:
                     }
                     
                     // Early termination
-                    if(minSAD < EARLY_EXIT_THRESHOLD) return bestMV;
+                    if(minSAD < earlyExit) return bestMV;
                 }
             }
         }
@@ -281,125 +308,387 @@ protected:
         return bestMV;
     }
 
-    int estimateBlockBits(const Mat& residuals, const Point2i& mv = Point2i(0,0)) const {
-        // Simple estimation: sum of absolute values + motion vector overhead
+    // How the residuals of one plane are quantized
+    struct PlaneQuantizer {
+        int tile;                    // transform size, 0 = spatial quantization
+        int tilesPerRow;
+        bool isChroma;
+        IntegerTransform transform;
+        IntegerTransform::QuantTable table;
+    };
+
+    /*
+     * Complexity of a frame for constant quality: mean |difference| per luma
+     * pixel to the reference, or for the first frame, which has none, its
+     * mean horizontal gradient. Every other row is enough. In 8-bit units,
+     * as the rate model's reference complexity.
+     */
+    double frameComplexity(const Mat& luma, const Mat& reference) const {
+        double complexity = luma.depth() == CV_8U ? frameComplexity<uchar>(luma, reference)
+                                                  : frameComplexity<ushort>(luma, reference);
+        return complexity / (1 << (bitDepth - 8));
+    }
+
+    template<typename T> static double frameComplexity(const Mat& luma, const Mat& reference) {
+        uint64_t sum = 0, count = 0;
+        for (int y = 0; y < luma.rows; y += 2) {
+            const T* row = luma.ptr<T>(y);
+            const T* other = reference.empty() ? row + 1 : reference.ptr<T>(y);
+            int n = reference.empty() ? luma.cols - 1 : luma.cols;
+            for (int x = 0; x < n; ++x) sum += abs(row[x] - other[x]);
+            count += max(n, 0);
+        }
+        return count ? static_cast<double>(sum) / count : 0;
+    }
+
+    // Exact length of a value in the stream, for the current Golomb parameter
+    int bitCost(int value) const {
+        return Golomb::codeLength(value, imageCodec.getM(), 1);
+    }
+
+    /*
+     * Run/level symbols (see writeLevelsGolomb) are unsigned. They are sent
+     * as the signed value whose zigzag code they are, so Rice spends no bit
+     * on a sign, and the level symbol skips zero, which is never sent.
+     */
+    static const unsigned END_OF_BLOCK = 0;
+
+    static unsigned zigzag(int value) {
+        return value >= 0 ? 2u * value : 2u * static_cast<unsigned>(-(value + 1)) + 1;
+    }
+
+    static int unzigzag(unsigned symbol) {
+        return (symbol & 1) ? -static_cast<int>(symbol >> 1) - 1 : static_cast<int>(symbol >> 1);
+    }
+
+    static int levelValue(int level) { return level > 0 ? level - 1 : level; }
+
+    static int levelFromValue(int value) { return value >= 0 ? value + 1 : value; }
+
+    static int riceBits(unsigned symbol, int shift) {
+        return static_cast<int>(symbol >> shift) + 1 + shift;
+    }
+
+    // Bits of a block's levels in run/level coding, one end of block per transform block
+    int levelBits(const int* levels, int count, const PlaneQuantizer& quantizer) const {
+        const RunLevelRice& rice = runLevelRice[quantizer.isChroma];
+        int blockLength = quantizer.tile ? quantizer.tile * quantizer.tile : count;
         int bits = 0;
-        for(int y = 0; y < residuals.rows; y++) {
-            for(int x = 0; x < residuals.cols; x++) {
-                bits += abs(residuals.at<int>(y, x));
+        for (int start = 0; start < count; start += blockLength) {
+            int run = 0;
+            for (int i = start; i < start + blockLength; ++i) {
+                if (levels[i] == 0) {
+                    run++;
+                    continue;
+                }
+                bits += riceBits(run + 1, rice.run) + riceBits(zigzag(levelValue(levels[i])), rice.level);
+                run = 0;
             }
+            if (run > 0) bits += riceBits(END_OF_BLOCK, rice.run);
         }
-        
-        // Add overhead for motion vector (if present)
-        if(mv.x != 0 || mv.y != 0) {
-            bits += (abs(mv.x) + abs(mv.y)) * 8; // Assume 8 bits per component
-        }
-        
         return bits;
     }
 
-    // Perform intra prediction for a block
-    Mat predictBlock(const Mat& frame, const Rect& blockRect) const {
-        Mat block = frame(blockRect);
-        Mat predictions(block.size(), CV_8UC1);
-        
-        // Use left neighbor for prediction when available
-        if(blockRect.x > 0) {
-            for(int y = 0; y < block.rows; y++) {
-                uchar leftPixel = frame.at<uchar>(blockRect.y + y, blockRect.x - 1);
-                for(int x = 0; x < block.cols; x++) {
-                    predictions.at<uchar>(y, x) = leftPixel;
+    // Mode flag and motion vector difference of a block
+    int sideBits(bool intra, const Point2i& mv, const Point2i& predictedMV) const {
+        return bitCost(intra ? 1 : 0) + bitCost(mv.x - predictedMV.x) + bitCost(mv.y - predictedMV.y);
+    }
+
+    /*
+     * Rate-distortion cost D + lambda * R of coding a block against a
+     * prediction: the residuals are quantized as they would be coded, so D is
+     * the real squared error of the reconstruction and R the real bit count.
+     * Leaves the levels and the decoded residuals in the candidate.
+     */
+    struct Candidate {
+        vector<int> residuals;
+        vector<int> levels;
+        double cost;
+    };
+
+    // Per-thread buffers of the block coding loop, reused across blocks and frames
+    struct BlockScratch {
+        Candidate candidates[4];
+        IntraPredictor predictor;
+        Mat prediction;
+        vector<int> levels;
+        Mat planeLevels[2];  // a plane of levels being decoded, luma and chroma as their sizes differ
+    };
+
+    static BlockScratch& blockScratch() {
+        static thread_local BlockScratch scratch;
+        return scratch;
+    }
+
+    template<typename T>
+    void evaluateCandidate(const Mat& currentBlock, const Mat& prediction, bool forceZero,
+                           const PlaneQuantizer& quantizer, int side, double lambda,
+                           Candidate& candidate) const {
+        int w = currentBlock.cols, h = currentBlock.rows;
+        AllocationCounter::resize(candidate.residuals, w * h);
+        AllocationCounter::resize(candidate.levels, blockLevelCount(currentBlock.size(), quantizer));
+        if (forceZero) {
+            fill(candidate.residuals.begin(), candidate.residuals.end(), 0);
+            fill(candidate.levels.begin(), candidate.levels.end(), 0);
+        } else {
+            for (int y = 0; y < h; ++y) {
+                ResidualKernels::subtractRow(currentBlock.ptr<T>(y), prediction.ptr<T>(y),
+                                             candidate.residuals.data() + y * w, w);
+            }
+            quantizeBlock(candidate.residuals.data(), currentBlock.size(), quantizer, candidate.levels.data());
+        }
+
+        const int maxValue = maxSample();
+        double distortion = 0;
+        for (int y = 0; y < h; ++y) {
+            const T* cur = currentBlock.ptr<T>(y);
+            const T* pred = prediction.ptr<T>(y);
+            for (int x = 0; x < w; ++x) {
+                int d = cur[x] - min(max(pred[x] + candidate.residuals[y * w + x], 0), maxValue);
+                distortion += d * d;
+            }
+        }
+        int bits = side + levelBits(candidate.levels.data(), static_cast<int>(candidate.levels.size()), quantizer);
+        candidate.cost = distortion + lambda * bits;
+    }
+
+    /*
+     * MED candidate: every pixel is predicted from pixels already rebuilt, so
+     * the block is quantized and rebuilt in place pixel by pixel. This needs
+     * spatial quantization; a transform block can't be rebuilt in raster order.
+     */
+    template<typename T>
+    void evaluateMEDCandidate(const Mat& currentBlock, const Rect& blockRect, Mat& reconstruction,
+                              const IntraPredictor& predictor, const PlaneQuantizer& quantizer,
+                              int side, double lambda, Candidate& candidate) const {
+        int w = blockRect.width, h = blockRect.height;
+        AllocationCounter::resize(candidate.residuals, w * h);
+        AllocationCounter::resize(candidate.levels, w * h);
+        const int maxValue = maxSample();
+        double distortion = 0;
+        for (int y = 0; y < h; ++y) {
+            const T* cur = currentBlock.ptr<T>(y);
+            T* out = reconstruction.ptr<T>(blockRect.y + y) + blockRect.x;
+            for (int x = 0; x < w; ++x) {
+                int i = y * w + x;
+                int predicted = predictor.medAt<T>(reconstruction, blockRect, x, y);
+                candidate.levels[i] = quantizeResidual(cur[x] - predicted, quantizer.isChroma);
+                candidate.residuals[i] = dequantizeResidual(candidate.levels[i], quantizer.isChroma);
+                out[x] = static_cast<T>(min(max(predicted + candidate.residuals[i], 0), maxValue));
+                int d = cur[x] - out[x];
+                distortion += d * d;
+            }
+        }
+        candidate.cost = distortion + lambda * (side + levelBits(candidate.levels.data(), w * h, quantizer));
+    }
+
+    /*
+     * Best intra mode of a block, left in `best`. I-frames try every mode at
+     * full rate-distortion cost; P-frames, where intra is the exception, pick
+     * the block-based mode by SAD and only code that one and MED.
+     */
+    template<typename T>
+    int chooseIntraMode(const Mat& currentBlock, const Rect& blockRect, Mat& reconstruction,
+                        const PlaneQuantizer& quantizer, int side, double lambda, bool exhaustive,
+                        BlockScratch& scratch, Candidate& best, Candidate& trial) const {
+        IntraPredictor& predictor = scratch.predictor;
+        predictor.load(reconstruction, blockRect, bitDepth);
+        Mat prediction = AllocationCounter::view(scratch.prediction, blockRect.height, blockRect.width, planeType());
+
+        int preselected = IntraPredictor::DC;
+        if (!exhaustive) {
+            int bestSAD = INT_MAX;
+            for (int mode = 0; mode < IntraPredictor::MODE_COUNT; ++mode) {
+                if (mode == IntraPredictor::MED) continue;
+                predictor.predict(IntraPredictor::Mode(mode), reconstruction, blockRect, prediction);
+                int sad = 0;
+                for (int y = 0; y < blockRect.height; ++y) {
+                    const T* cur = currentBlock.ptr<T>(y);
+                    const T* pred = prediction.ptr<T>(y);
+                    for (int x = 0; x < blockRect.width; ++x) sad += abs(cur[x] - pred[x]);
+                }
+                if (sad < bestSAD) {
+                    bestSAD = sad;
+                    preselected = mode;
                 }
             }
-        } else {
-            predictions = Scalar(128); // Default prediction
         }
-        
-        return predictions;
+
+        int bestMode = -1;
+        for (int mode = 0; mode < IntraPredictor::MODE_COUNT; ++mode) {
+            if (!exhaustive && mode != preselected && mode != IntraPredictor::MED) continue;
+            int modeSide = side + bitCost(mode);
+            if (mode == IntraPredictor::MED) {
+                if (quantizer.tile != 0) continue;
+                evaluateMEDCandidate<T>(currentBlock, blockRect, reconstruction, predictor, quantizer,
+                                        modeSide, lambda, trial);
+            } else {
+                predictor.predict(IntraPredictor::Mode(mode), reconstruction, blockRect, prediction);
+                evaluateCandidate<T>(currentBlock, prediction, false, quantizer, modeSide, lambda, trial);
+            }
+            if (bestMode < 0 || trial.cost < best.cost) {
+                swap(best, trial);
+                bestMode = mode;
+            }
+        }
+        return bestMode;
     }
 
-    // Improved block mode decision
-    BlockData determineBlockMode(const Mat& currentFrame, const Mat& referenceFrame,
-                               const Point& blockPos, int currentBlockSize) const {
+    /*
+     * Rate-distortion mode decision among skip (predicted vector, no
+     * residuals), inter and intra. Intra prediction reads the reconstruction,
+     * the same pixels the decoder has. scratch.levels receives the chosen
+     * block's levels and result.residuals the residuals the decoder will
+     * rebuild. I-frames only consider intra modes.
+     */
+    template<typename T>
+    BlockData determineBlockMode(const Mat& currentFrame, const Mat& referenceFrame, bool intraFrame,
+                               Mat& reconstruction, const Point& blockPos,
+                               int currentBlockSize, const Point2i& predictedMV,
+                               const PlaneQuantizer& quantizer, BlockScratch& scratch) const {
         BlockData result;
+        result.skipMode = false;
+        result.useIntraMode = true;
+        result.motionVector = Point2i(0, 0);
+        result.predictionMode = IntraPredictor::DC;
         Rect blockRect(blockPos.x, blockPos.y, 
                       min(currentBlockSize, currentFrame.cols - blockPos.x),
                       min(currentBlockSize, currentFrame.rows - blockPos.y));
         Mat currentBlock = currentFrame(blockRect);
-        
-        // Check for skip mode first
-        if(isSkippableBlock(currentBlock, referenceFrame, blockPos)) {
-            result.skipMode = true;
-            result.useIntraMode = false;
-            result.motionVector = Point2i(0, 0);
-            result.residuals = Mat::zeros(blockRect.size(), CV_32SC1);
+        double lambda = LAMBDA * channelStep(quantizer.isChroma) * channelStep(quantizer.isChroma);
+        Candidate* candidates = scratch.candidates;  // skip, inter, intra, intra trial
+
+        if (intraFrame) {
+            result.predictionMode = chooseIntraMode<T>(currentBlock, blockRect, reconstruction, quantizer, 0,
+                                                    lambda, true, scratch, candidates[2], candidates[3]);
+            result.residuals = Mat(blockRect.size(), CV_32SC1, candidates[2].residuals.data());
+            keepLevels(candidates[2], scratch);
             return result;
         }
 
-        // Quick variance-based decision
-        Scalar mean, stddev;
-        meanStdDev(currentBlock, mean, stddev);
-        
-        // Use intra mode for low variance blocks
-        if(stddev[0] < 8.0) {
-            result.useIntraMode = true;
-            result.motionVector = Point2i(0, 0);
-            Mat intraPrediction = predictBlock(currentFrame, blockRect);
-            subtract(currentBlock, intraPrediction, result.residuals, noArray(), CV_32SC1);
-            return result;
+        auto predictionAt = [&](const Point2i& mv) {
+            return referenceFrame(Rect(blockPos.x + mv.x, blockPos.y + mv.y, blockRect.width, blockRect.height));
+        };
+
+        // A block matching the co-located one is coded as skip without a search
+        bool quickSkip = isSkippableBlock<T>(currentBlock, referenceFrame, blockPos);
+        Point2i skipMV = quickSkip || !isValidMotionVector(predictedMV, blockPos, referenceFrame, blockRect.size())
+                       ? Point2i(0, 0) : predictedMV;
+        evaluateCandidate<T>(currentBlock, predictionAt(skipMV), true, quantizer,
+                          sideBits(false, skipMV, predictedMV), lambda, candidates[0]);
+        int best = 0;
+        Point2i bestMV = skipMV;
+
+        if (!quickSkip) {
+            Point2i mv = estimateMotion<T>(currentBlock, referenceFrame, blockPos, predictedMV);
+            evaluateCandidate<T>(currentBlock, predictionAt(mv), false, quantizer,
+                              sideBits(false, mv, predictedMV), lambda, candidates[1]);
+            if (candidates[1].cost < candidates[best].cost) {
+                best = 1;
+                bestMV = mv;
+            }
+
+            int intraMode = chooseIntraMode<T>(currentBlock, blockRect, reconstruction, quantizer,
+                                            sideBits(true, Point2i(0, 0), predictedMV), lambda, false,
+                                            scratch, candidates[2], candidates[3]);
+            if (candidates[2].cost < candidates[best].cost) {
+                best = 2;
+                bestMV = Point2i(0, 0);
+                result.predictionMode = intraMode;
+            }
         }
-        
-        // Try inter-frame coding
-        Point2i mv = estimateMotion(currentBlock, referenceFrame, blockPos);
-        Mat interPrediction = referenceFrame(
-            Rect(blockPos.x + mv.x, blockPos.y + mv.y, blockRect.width, blockRect.height));
-        
-        // Compare inter and intra modes using bit estimation
-        Mat interResiduals;
-        subtract(currentBlock, interPrediction, interResiduals, noArray(), CV_32SC1);
-        int interBits = estimateBlockBits(interResiduals, mv);
-        
-        Mat intraPrediction = predictBlock(currentFrame, blockRect);
-        Mat intraResiduals;
-        subtract(currentBlock, intraPrediction, intraResiduals, noArray(), CV_32SC1);
-        int intraBits = estimateBlockBits(intraResiduals);
-        
-        if(intraBits < interBits) {
-            result.useIntraMode = true;
-            result.motionVector = Point2i(0, 0);
-            result.residuals = intraResiduals;
+
+        result.skipMode = (best == 0);
+        result.useIntraMode = (best == 2);
+        result.motionVector = bestMV;
+        result.residuals = Mat(blockRect.size(), CV_32SC1, candidates[best].residuals.data());
+        keepLevels(candidates[best], scratch);
+        return result;
+    }
+
+    void keepLevels(const Candidate& candidate, BlockScratch& scratch) const {
+        AllocationCounter::resize(scratch.levels, candidate.levels.size());
+        copy(candidate.levels.begin(), candidate.levels.end(), scratch.levels.begin());
+    }
+
+    /*
+     * Code the blocks of a plane in closed loop: every block is quantized
+     * right away and rebuilt in place in `reconstruction`, so later blocks and
+     * the next frame predict from what the decoder will see. I-frames pass
+     * an empty reference.
+     */
+    void encodePlane(const Mat& currentFrame, const Mat& referenceFrame, bool intraFrame,
+                     vector<Point2i>& motionVectors, Mat& levels, vector<bool>& blockModes,
+                     vector<int>& intraModes, int currentBlockSize,
+                     Mat& reconstruction, bool isChroma) const {
+        if (currentFrame.depth() == CV_8U) {
+            encodePlane<uchar>(currentFrame, referenceFrame, intraFrame, motionVectors, levels, blockModes,
+                               intraModes, currentBlockSize, reconstruction, isChroma);
         } else {
-            result.useIntraMode = false;
-            result.motionVector = mv;
-            result.residuals = interResiduals;
+            encodePlane<ushort>(currentFrame, referenceFrame, intraFrame, motionVectors, levels, blockModes,
+                                intraModes, currentBlockSize, reconstruction, isChroma);
         }
-        
-        return result;
     }
 
-    // Modified encodePFrame method to use mode decision
-    void encodePFrame(const Mat& currentFrame, const Mat& referenceFrame, 
-                     vector<Point2i>& motionVectors, Mat& residuals,
-                     vector<bool>& blockModes, int currentBlockSize) const {
-        motionVectors.clear();
-        blockModes.clear();
-        residuals = Mat::zeros(currentFrame.size(), CV_32SC1);
+    template<typename T>
+    void encodePlane(const Mat& currentFrame, const Mat& referenceFrame, bool intraFrame,
+                     vector<Point2i>& motionVectors, Mat& levels, vector<bool>& blockModes,
+                     vector<int>& intraModes, int currentBlockSize,
+                     Mat& reconstruction, bool isChroma) const {
+        int blocksX = (currentFrame.cols + currentBlockSize - 1) / currentBlockSize;
+        int blocksY = (currentFrame.rows + currentBlockSize - 1) / currentBlockSize;
+        const PlaneQuantizer& quantizer = planeQuantizer(currentFrame.size(), currentBlockSize, isChroma, intraFrame);
+        allocateLevels(quantizer, currentFrame.size(), levels);
+        AllocationCounter::create(reconstruction, currentFrame.size(), planeType());
+        AllocationCounter::assign(motionVectors, blocksX * blocksY, Point2i(0, 0));
+        AllocationCounter::assign(intraModes, blocksX * blocksY, 0);
         
-        for(int y = 0; y < currentFrame.rows; y += currentBlockSize) {
-            for(int x = 0; x < currentFrame.cols; x += currentBlockSize) {
-                BlockData blockData = determineBlockMode(currentFrame, referenceFrame,
-                                                       Point(x, y), currentBlockSize);
-                
-                // Store mode decision and block data
-                blockModes.push_back(blockData.useIntraMode);
-                motionVectors.push_back(blockData.motionVector);
-                
-                // Copy residuals to output
-                Rect blockRect(x, y, 
-                             min(currentBlockSize, currentFrame.cols - x),
-                             min(currentBlockSize, currentFrame.rows - y));
-                blockData.residuals.copyTo(residuals(blockRect));
-            }
+        // The motion search starts from the neighbours' vectors and intra blocks
+        // predict from the rebuilt blocks around them, so blocks run as a wavefront
+        ThreadPool::shared().wavefront(blocksY, blocksX, [&](int by, int bx) {
+            BlockScratch& scratch = blockScratch();
+            int x = bx * currentBlockSize;
+            int y = by * currentBlockSize;
+            Point2i predictedMV = predictMotionVector(motionVectors, bx, by, blocksX);
+            BlockData blockData = determineBlockMode<T>(currentFrame, referenceFrame, intraFrame, reconstruction,
+                                                   Point(x, y), currentBlockSize, predictedMV,
+                                                   quantizer, scratch);
+            
+            // Store mode decision; vector<bool> can't be written concurrently,
+            // so inter blocks are marked with mode -1 until the loop is done
+            intraModes[by * blocksX + bx] = blockData.useIntraMode ? blockData.predictionMode : -1;
+            motionVectors[by * blocksX + bx] = blockData.motionVector;
+            
+            Rect blockRect(x, y, 
+                         min(currentBlockSize, currentFrame.cols - x),
+                         min(currentBlockSize, currentFrame.rows - y));
+            storeBlockLevels(scratch.levels.data(), blockRect, quantizer, levels);
+            reconstructBlock<T>(blockData, blockRect, referenceFrame, reconstruction, scratch);
+        });
+        AllocationCounter::resize(blockModes, intraModes.size());
+        for (size_t i = 0; i < intraModes.size(); ++i) {
+            blockModes[i] = intraModes[i] >= 0;
+            if (!blockModes[i]) intraModes[i] = 0;
+        }
+    }
+
+    // Prediction + decoded residuals, written straight into the plane
+    template<typename T>
+    void reconstructBlock(const BlockData& blockData, const Rect& blockRect, const Mat& referenceFrame,
+                          Mat& reconstruction, BlockScratch& scratch) const {
+        if (blockData.useIntraMode) {
+            scratch.predictor.load(reconstruction, blockRect, bitDepth);
+            scratch.predictor.reconstruct(IntraPredictor::Mode(blockData.predictionMode), reconstruction,
+                                          blockRect, blockData.residuals);
+            return;
+        }
+        const int* residual = blockData.residuals.ptr<int>();
+        for (int y = 0; y < blockRect.height; ++y) {
+            T* out = reconstruction.ptr<T>(blockRect.y + y) + blockRect.x;
+            const int* res = residual + y * blockRect.width;
+            const T* pred = referenceFrame.ptr<T>(blockRect.y + y + blockData.motionVector.y)
+                          + blockRect.x + blockData.motionVector.x;
+            ResidualKernels::addRow(pred, res, out, blockRect.width, maxSample());
         }
     }
 
@@ -431,116 +720,185 @@ protected:
         }
     }
 
-    virtual void writeResidualsGolomb(const Mat& residuals, Golomb& golomb, bool isChroma = false) const {
-        // Write dimensions first
-        golomb.encode(residuals.rows);
-        golomb.encode(residuals.cols);
-        
-        vector<int> values;
-        int zeroCount = 0;
-        
-        // Collect all non-zero values and their runs
-        for(int y = 0; y < residuals.rows; y++) {
-            for(int x = 0; x < residuals.cols; x++) {
-                int val = quantizeResidual(residuals.at<int>(y, x), isChroma);
-                if(val == 0) {
-                    zeroCount++;
-                } else {
-                    if(zeroCount > 0) {
-                        values.push_back(0);  // Zero marker
-                        values.push_back(zeroCount);
-                        zeroCount = 0;
-                    }
-                    values.push_back(val);
-                }
+    // Bits each Rice parameter would have spent on a sequence of symbols
+    struct RiceStatistics {
+        uint64_t bits[RICE_SHIFTS] = {};
+        bool empty = true;
+
+        void add(unsigned symbol) {
+            for (int shift = 0; shift < RICE_SHIFTS; ++shift) {
+                bits[shift] += riceBits(symbol, shift);
             }
+            empty = false;
         }
-        
-        // Handle trailing zeros
-        if(zeroCount > 0) {
-            values.push_back(0);
-            values.push_back(zeroCount);
+
+        int bestShift(int current) const {
+            return empty ? current : static_cast<int>(min_element(bits, bits + RICE_SHIFTS) - bits);
         }
-        
-        // Write the values
-        golomb.encode(values.size());
-        for(int val : values) {
-            golomb.encode(val);
+    };
+
+    /*
+     * Coding blocks of a level plane, as rectangles of `levels`: the row of
+     * each transform block, or with spatial quantization the residual blocks.
+     * Levels are scanned row by row within a block.
+     */
+    template <typename Visit>
+    void forEachLevelBlock(const Mat& levels, const PlaneQuantizer& quantizer, int channelBlockSize,
+                           Visit visit) const {
+        if (quantizer.tile != 0) {
+            for (int t = 0; t < levels.rows; ++t) {
+                visit(Rect(0, t, levels.cols, 1));
+            }
+            return;
+        }
+        for (int y = 0; y < levels.rows; y += channelBlockSize) {
+            for (int x = 0; x < levels.cols; x += channelBlockSize) {
+                visit(Rect(x, y, min(channelBlockSize, levels.cols - x), min(channelBlockSize, levels.rows - y)));
+            }
         }
     }
 
-    virtual void readResidualsGolomb(Mat& residuals, Golomb& golomb, bool isChroma = false) const {
-        // Read dimensions
-        int rows = golomb.decode_val();
-        int cols = golomb.decode_val();
-        residuals = Mat::zeros(rows, cols, CV_32SC1);
-        
-        size_t numValues = golomb.decode_val();
-        int pos = 0;
-        
-        for(size_t i = 0; i < numValues && pos < rows * cols;) {
-            int val = golomb.decode_val();
-            if(val == 0) {
-                // Read zero run length
-                int zeroCount = golomb.decode_val();
-                for(int j = 0; j < zeroCount && pos < rows * cols; j++) {
-                    residuals.at<int>(pos / cols, pos % cols) = 0;
-                    pos++;
+    /*
+     * Run/level coding of quantized levels, as in JPEG and H.26x: every
+     * nonzero level is sent as (run of zeros before it + 1, level), and a
+     * run of END_OF_BLOCK ends a block early (not needed when its last level
+     * is nonzero). Runs and levels have their own Rice parameter, sent ahead
+     * of the plane; the encoder measures the best ones while writing and
+     * uses them for the next plane of the same kind. One pass, straight to
+     * the coder.
+     */
+    void writeLevelsGolomb(const Mat& levels, const PlaneQuantizer& quantizer, int channelBlockSize,
+                           EntropyCoder& coder) {
+        RunLevelRice& rice = runLevelRice[quantizer.isChroma];
+        coder.encode(rice.run, SyntaxElement::Header);
+        coder.encode(rice.level, SyntaxElement::Header);
+        coder.setRiceParameter(SyntaxElement::Run, 1 << rice.run);
+        coder.setRiceParameter(SyntaxElement::Level, 1 << rice.level);
+
+        RiceStatistics runStatistics, levelStatistics;
+        forEachLevelBlock(levels, quantizer, channelBlockSize, [&](const Rect& block) {
+            unsigned run = 0;
+            for (int y = block.y; y < block.y + block.height; ++y) {
+                const int* row = levels.ptr<int>(y) + block.x;
+                for (int x = 0; x < block.width; ++x) {
+                    if (row[x] == 0) {
+                        run++;
+                        continue;
+                    }
+                    int value = levelValue(row[x]);
+                    coder.encode(unzigzag(run + 1), SyntaxElement::Run);
+                    coder.encode(value, SyntaxElement::Level);
+                    runStatistics.add(run + 1);
+                    levelStatistics.add(zigzag(value));
+                    run = 0;
+                }
+            }
+            if (run > 0) {
+                coder.encode(unzigzag(END_OF_BLOCK), SyntaxElement::Run);
+                runStatistics.add(END_OF_BLOCK);
+            }
+        });
+        rice.run = runStatistics.bestShift(rice.run);
+        rice.level = levelStatistics.bestShift(rice.level);
+    }
+
+    void readLevelsGolomb(Mat& levels, const PlaneQuantizer& quantizer, const Size& planeSize,
+                          int channelBlockSize, EntropyCoder& coder) const {
+        int runShift = coder.decode_val(SyntaxElement::Header);
+        int levelShift = coder.decode_val(SyntaxElement::Header);
+        if (runShift < 0 || runShift >= RICE_SHIFTS || levelShift < 0 || levelShift >= RICE_SHIFTS) {
+            throw runtime_error("Invalid run/level Rice parameters");
+        }
+        coder.setRiceParameter(SyntaxElement::Run, 1 << runShift);
+        coder.setRiceParameter(SyntaxElement::Level, 1 << levelShift);
+
+        allocateLevels(quantizer, planeSize, levels);
+        levels.setTo(Scalar(0));
+        forEachLevelBlock(levels, quantizer, channelBlockSize, [&](const Rect& block) {
+            unsigned count = block.area();
+            for (unsigned pos = 0; pos < count; ++pos) {
+                unsigned run = zigzag(coder.decode_val(SyntaxElement::Run));
+                if (run == END_OF_BLOCK) break;
+                if (run > count - pos) {
+                    throw runtime_error("Run past the end of a block");
+                }
+                pos += run - 1;
+                levels.at<int>(block.y + pos / block.width, block.x + pos % block.width) =
+                    levelFromValue(coder.decode_val(SyntaxElement::Level));
+            }
+        });
+    }
+
+    // Read a plane of levels and turn it back into residuals
+    virtual void readResidualsGolomb(Mat& residuals, EntropyCoder& coder, bool isChroma, bool isIntra,
+                                     const Size& planeSize, int channelBlockSize) const {
+        Mat& levels = blockScratch().planeLevels[isChroma];
+        const PlaneQuantizer& quantizer = planeQuantizer(planeSize, channelBlockSize, isChroma, isIntra);
+        readLevelsGolomb(levels, quantizer, planeSize, channelBlockSize, coder);
+        AllocationCounter::create(residuals, planeSize, CV_32SC1);
+
+        if (quantizer.tile == 0) {
+            for(int y = 0; y < residuals.rows; y++) {
+                for(int x = 0; x < residuals.cols; x++) {
+                    residuals.at<int>(y, x) = dequantizeResidual(levels.at<int>(y, x), isChroma);
                 }
-                i += 2; // Skip the zero marker and count
-            } else {
-                residuals.at<int>(pos / cols, pos % cols) = dequantizeResidual(val, isChroma);
-                pos++;
-                i++;
             }
+            return;
         }
-        
-        // Fill remaining positions with zeros if any
-        while(pos < rows * cols) {
-            residuals.at<int>(pos / cols, pos % cols) = 0;
-            pos++;
+
+        int n = quantizer.tile;
+        int coeffs[64], block[64];
+        for (int ty = 0; ty * n < planeSize.height; ++ty) {
+            for (int tx = 0; tx < quantizer.tilesPerRow; ++tx) {
+                quantizer.transform.dequantize(levels.ptr<int>(ty * quantizer.tilesPerRow + tx), quantizer.table, coeffs);
+                quantizer.transform.inverse(coeffs, block);
+                for (int y = 0; y < n && ty * n + y < planeSize.height; ++y) {
+                    for (int x = 0; x < n && tx * n + x < planeSize.width; ++x) {
+                        residuals.at<int>(ty * n + y, tx * n + x) = block[y * n + x];
+                    }
+                }
+            }
         }
     }
 
-    // Add differential encoding for motion vectors
-    virtual void writeMotionVectorsGolomb(const vector<Point2i>& motionVectors, Golomb& golomb) const {
-        if (motionVectors.empty()) return;
-        
-        // Write first vector directly
-        golomb.encode(motionVectors[0].x);
-        golomb.encode(motionVectors[0].y);
-        
-        // Write differences for subsequent vectors
-        for(size_t i = 1; i < motionVectors.size(); i++) {
-            golomb.encode(motionVectors[i].x - motionVectors[i-1].x);
-            golomb.encode(motionVectors[i].y - motionVectors[i-1].y);
+    // Motion vectors are sent as the difference to the median of their neighbours
+    virtual void writeMotionVectorsGolomb(const vector<Point2i>& motionVectors, int blocksX, EntropyCoder& coder) const {
+        for(size_t i = 0; i < motionVectors.size(); i++) {
+            Point2i predicted = predictMotionVector(motionVectors, i % blocksX, i / blocksX, blocksX);
+            coder.encode(motionVectors[i].x - predicted.x, SyntaxElement::MotionVector);
+            coder.encode(motionVectors[i].y - predicted.y, SyntaxElement::MotionVector);
         }
     }
 
-    virtual vector<Point2i> readMotionVectorsGolomb(size_t count, Golomb& golomb) const {
-        vector<Point2i> motionVectors;
-        if (count == 0) return motionVectors;
-        
-        // Read first vector
-        Point2i prev;
-        prev.x = golomb.decode_val();
-        prev.y = golomb.decode_val();
-        motionVectors.push_back(prev);
-        
-        // Read and reconstruct subsequent vectors
-        for(size_t i = 1; i < count; i++) {
-            Point2i current;
-            current.x = prev.x + golomb.decode_val();
-            current.y = prev.y + golomb.decode_val();
-            motionVectors.push_back(current);
-            prev = current;
+    virtual void readMotionVectorsGolomb(size_t count, int blocksX, vector<Point2i>& motionVectors,
+                                         EntropyCoder& coder) const {
+        AllocationCounter::resize(motionVectors, count);
+        for(size_t i = 0; i < count; i++) {
+            Point2i predicted = predictMotionVector(motionVectors, i % blocksX, i / blocksX, blocksX);
+            motionVectors[i].x = predicted.x + coder.decode_val(SyntaxElement::MotionVector);
+            motionVectors[i].y = predicted.y + coder.decode_val(SyntaxElement::MotionVector);
         }
-        return motionVectors;
     }
 
-    Mat decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
-                const vector<bool>& blockModes, const Mat& residuals, int currentBlockSize) const {
-        Mat reconstructed = Mat::zeros(referenceFrame.size(), referenceFrame.type());
+    // Rebuild a plane block by block; I-frames pass an empty reference and only intra blocks
+    void decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
+                const vector<bool>& blockModes, const vector<int>& intraModes,
+                const Mat& residuals, int currentBlockSize, Mat& reconstructed) const {
+        AllocationCounter::create(reconstructed, residuals.size(), planeType());
+        if (reconstructed.depth() == CV_8U) {
+            decodePFrame<uchar>(referenceFrame, motionVectors, blockModes, intraModes, residuals,
+                                currentBlockSize, reconstructed);
+        } else {
+            decodePFrame<ushort>(referenceFrame, motionVectors, blockModes, intraModes, residuals,
+                                 currentBlockSize, reconstructed);
+        }
+    }
+
+    template<typename T>
+    void decodePFrame(const Mat& referenceFrame, const vector<Point2i>& motionVectors,
+                const vector<bool>& blockModes, const vector<int>& intraModes,
+                const Mat& residuals, int currentBlockSize, Mat& reconstructed) const {
+        IntraPredictor& predictor = blockScratch().predictor;
         int blockIdx = 0;
         
         for (int y = 0; y < reconstructed.rows; y += currentBlockSize) {
@@ -552,18 +910,9 @@ protected:
                 
                 if (blockModes[blockIdx]) {
                     // Intra mode
-                    Mat prediction = predictBlock(reconstructed, blockRect);
-                    Mat reconstructedBlock(blockRect.size(), reconstructed.type());
-                    
-                    for(int i = 0; i < blockResiduals.rows; i++) {
-                        for(int j = 0; j < blockResiduals.cols; j++) {
-                            reconstructedBlock.at<uchar>(i,j) = saturate_cast<uchar>(
-                                prediction.at<uchar>(i,j) + 
-                                blockResiduals.at<int>(i,j)
-                            );
-                        }
-                    }
-                    reconstructedBlock.copyTo(reconstructed(blockRect));
+                    predictor.load(reconstructed, blockRect, bitDepth);
+                    predictor.reconstruct(IntraPredictor::Mode(intraModes[blockIdx]), reconstructed,
+                                          blockRect, blockResiduals);
                 } else {
                     // Inter mode
                     Point2i mv = motionVectors[blockIdx];
@@ -571,158 +920,463 @@ protected:
                     predRect = predRect & Rect(0, 0, referenceFrame.cols, referenceFrame.rows);
                     Mat predBlock = referenceFrame(predRect);
                     
-                    Mat reconstructedBlock(blockRect.size(), reconstructed.type());
                     for(int i = 0; i < blockResiduals.rows; i++) {
-                        for(int j = 0; j < blockResiduals.cols; j++) {
-                            reconstructedBlock.at<uchar>(i,j) = saturate_cast<uchar>(
-                                predBlock.at<uchar>(i,j) + 
-                                blockResiduals.at<int>(i,j)
-                            );
-                        }
+                        ResidualKernels::addRow(predBlock.ptr<T>(i), blockResiduals.ptr<int>(i),
+                                                reconstructed.ptr<T>(y + i) + x, predBlock.cols, maxSample());
                     }
-                    reconstructedBlock.copyTo(reconstructed(blockRect));
                 }
                 blockIdx++;
             }
         }
-        return reconstructed;
+    }
+
+    /*
+     * Every frame type starts a new segment of the entropy coder and I-frames
+     * reset its adaptive state, so an adaptive decoder can start at any
+     * I-frame; both are no-ops for Rice.
+     */
+    void writeFrameType(int frameType, EntropyCoder& coder) const {
+        coder.sync();
+        coder.encode(frameType, SyntaxElement::Header);
+        if (frameType == I_FRAME) coder.resetContexts();
+    }
+
+    int readFrameType(EntropyCoder& coder) const {
+        coder.sync();
+        int frameType = coder.decode_val(SyntaxElement::Header);
+        if (frameType == I_FRAME) coder.resetContexts();
+        return frameType;
+    }
+
+    // Intra modes of the intra blocks, in block order
+    void writeIntraModes(const vector<bool>& blockModes, const vector<int>& intraModes, EntropyCoder& coder) const {
+        for (size_t i = 0; i < blockModes.size(); ++i) {
+            if (blockModes[i]) coder.encode(intraModes[i], SyntaxElement::IntraMode);
+        }
+    }
+
+    void readIntraModes(const vector<bool>& blockModes, vector<int>& intraModes, EntropyCoder& coder) const {
+        AllocationCounter::assign(intraModes, blockModes.size(), 0);
+        for (size_t i = 0; i < blockModes.size(); ++i) {
+            if (!blockModes[i]) continue;
+            intraModes[i] = coder.decode_val(SyntaxElement::IntraMode);
+            if (intraModes[i] < 0 || intraModes[i] >= IntraPredictor::MODE_COUNT) {
+                throw runtime_error("Invalid intra prediction mode in stream");
+            }
+        }
     }
 
     // New helper methods for compression
-    bool isSkippableBlock(const Mat& block, const Mat& reference, const Point& pos) const {
+    template<typename T> bool isSkippableBlock(const Mat& block, const Mat& reference, const Point& pos) const {
         int sum = 0;
         for(int y = 0; y < block.rows; y++) {
             for(int x = 0; x < block.cols; x++) {
-                sum += abs(block.at<uchar>(y,x) - reference.at<uchar>(pos.y+y, pos.x+x));
-                if(sum > SKIP_THRESHOLD) return false;
+                sum += abs(block.at<T>(y,x) - reference.at<T>(pos.y+y, pos.x+x));
+                if(sum > SKIP_THRESHOLD << (bitDepth - 8)) return false;
             }
         }
         return true;
     }
 
+    // Steps are in 8-bit units, as in the stream, and scale with the sample range; step 1 stays lossless
+    int channelStep(bool isChroma) const {
+        int step = isChroma ? (int)(quantizationStep * UV_QP_FACTOR) : quantizationStep;
+        return step > 1 ? step << (bitDepth - 8) : step;
+    }
+
+    // Quantizing with step 1 is lossless, which the transform can't be
+    bool useTransform() const {
+        return transformSize > 0 && quantizationStep > 1;
+    }
+
     int quantizeResidual(int value, bool isChroma) const {
-        int qp = isChroma ? (int)(quantizationStep * UV_QP_FACTOR) : quantizationStep;
+        int qp = channelStep(isChroma);
         if (qp <= 1) return value;  // No quantization in lossless mode
         return (value + (value >= 0 ? qp/2 : -qp/2)) / qp;
     }
 
     int dequantizeResidual(int value, bool isChroma) const {
-        int qp = isChroma ? (int)(quantizationStep * UV_QP_FACTOR) : quantizationStep;
+        int qp = channelStep(isChroma);
         if (qp <= 1) return value;  // No quantization in lossless mode
         return value * qp;
     }
 
+    // Transform blocks must not straddle prediction blocks, or a block would
+    // depend on residuals of a neighbour that isn't rebuilt yet
+    int planeTransformSize(int channelBlockSize) const {
+        if (!useTransform()) return 0;
+        if (channelBlockSize % transformSize == 0) return transformSize;
+        if (channelBlockSize % 4 == 0) return 4;
+        return 0;
+    }
+
+    /*
+     * Quantizer of a plane, cached per thread: the tables are only rebuilt
+     * when the step or the plane layout changes, e.g. under rate control.
+     */
+    const PlaneQuantizer& planeQuantizer(const Size& planeSize, int channelBlockSize,
+                                         bool isChroma, bool isIntra) const {
+        struct CachedQuantizer {
+            bool valid = false;
+            int tile = 0, step = 0, tilesPerRow = 0, bitDepth = 0;
+            PlaneQuantizer quantizer{0, 0, false, IntegerTransform(4), {}};
+        };
+        static thread_local CachedQuantizer cache[2][2];  // [isChroma][isIntra]
+
+        CachedQuantizer& entry = cache[isChroma][isIntra];
+        int tile = planeTransformSize(channelBlockSize);
+        int tilesPerRow = tile ? (planeSize.width + tile - 1) / tile : 0;
+        if (!entry.valid || entry.tile != tile || entry.step != channelStep(isChroma) ||
+            entry.tilesPerRow != tilesPerRow || entry.bitDepth != bitDepth) {
+            AllocationCounter::add();
+            entry.quantizer = makePlaneQuantizer(planeSize, channelBlockSize, isChroma, isIntra);
+            entry.tile = tile;
+            entry.step = channelStep(isChroma);
+            entry.tilesPerRow = tilesPerRow;
+            entry.bitDepth = bitDepth;
+            entry.valid = true;
+        }
+        return entry.quantizer;
+    }
+
+    PlaneQuantizer makePlaneQuantizer(const Size& planeSize, int channelBlockSize,
+                                      bool isChroma, bool isIntra) const {
+        int tile = planeTransformSize(channelBlockSize);
+        PlaneQuantizer quantizer{tile, 0, isChroma, IntegerTransform(tile ? tile : 4, bitDepth), {}};
+        if (tile) {
+            quantizer.tilesPerRow = (planeSize.width + tile - 1) / tile;
+            quantizer.table = quantizer.transform.makeQuantTable(channelStep(isChroma), isIntra);
+        }
+        return quantizer;
+    }
+
+    /*
+     * Spatial quantization stores one level per pixel. The transform stores
+     * one row per transform block (raster order) with its zig-zag scanned
+     * levels, so the run/level coder sees the high-frequency zeros back to back.
+     */
+    void allocateLevels(const PlaneQuantizer& quantizer, const Size& planeSize, Mat& levels) const {
+        if (quantizer.tile == 0) {
+            AllocationCounter::create(levels, planeSize, CV_32SC1);
+        } else {
+            int tilesY = (planeSize.height + quantizer.tile - 1) / quantizer.tile;
+            AllocationCounter::create(levels, quantizer.tilesPerRow * tilesY, quantizer.tile * quantizer.tile, CV_32SC1);
+        }
+    }
+
+    // Levels of a block: one per pixel, or a zig-zag scan per transform block
+    int blockLevelCount(const Size& blockSize, const PlaneQuantizer& quantizer) const {
+        if (quantizer.tile == 0) return blockSize.area();
+        int n = quantizer.tile;
+        return ((blockSize.width + n - 1) / n) * ((blockSize.height + n - 1) / n) * n * n;
+    }
+
+    /*
+     * Quantize the residuals of one block (row-major, blockSize.width wide)
+     * into blockLevels, transform blocks in raster order, and overwrite the
+     * residuals with the ones the decoder will get back. Transform blocks over
+     * the plane edge are zero padded.
+     */
+    void quantizeBlock(int* residuals, const Size& blockSize, const PlaneQuantizer& quantizer, int* blockLevels) const {
+        if (quantizer.tile == 0) {
+            for (int i = 0; i < blockSize.area(); ++i) {
+                blockLevels[i] = quantizeResidual(residuals[i], quantizer.isChroma);
+                residuals[i] = dequantizeResidual(blockLevels[i], quantizer.isChroma);
+            }
+            return;
+        }
+
+        int n = quantizer.tile;
+        int block[64], coeffs[64];
+        for (int ty = 0; ty < blockSize.height; ty += n) {
+            for (int tx = 0; tx < blockSize.width; tx += n, blockLevels += n * n) {
+                int h = min(n, blockSize.height - ty);
+                int w = min(n, blockSize.width - tx);
+                for (int y = 0; y < n; ++y) {
+                    for (int x = 0; x < n; ++x) {
+                        block[y * n + x] = (y < h && x < w) ? residuals[(ty + y) * blockSize.width + tx + x] : 0;
+                    }
+                }
+                quantizer.transform.forward(block, coeffs);
+                quantizer.transform.quantize(coeffs, quantizer.table, blockLevels);
+                quantizer.transform.dequantize(blockLevels, quantizer.table, coeffs);
+                quantizer.transform.inverse(coeffs, block);
+                for (int y = 0; y < h; ++y) {
+                    for (int x = 0; x < w; ++x) {
+                        residuals[(ty + y) * blockSize.width + tx + x] = block[y * n + x];
+                    }
+                }
+            }
+        }
+    }
+
+    // Put the levels of a block (see quantizeBlock) in their place in the level plane
+    void storeBlockLevels(const int* blockLevels, const Rect& blockRect, const PlaneQuantizer& quantizer, Mat& levels) const {
+        if (quantizer.tile == 0) {
+            for (int y = 0; y < blockRect.height; ++y) {
+                copy(blockLevels + y * blockRect.width, blockLevels + (y + 1) * blockRect.width,
+                     levels.ptr<int>(blockRect.y + y) + blockRect.x);
+            }
+            return;
+        }
+
+        int n = quantizer.tile;
+        for (int ty = 0; ty < blockRect.height; ty += n) {
+            for (int tx = 0; tx < blockRect.width; tx += n, blockLevels += n * n) {
+                int tileIndex = ((blockRect.y + ty) / n) * quantizer.tilesPerRow + (blockRect.x + tx) / n;
+                copy(blockLevels, blockLevels + n * n, levels.ptr<int>(tileIndex));
+            }
+        }
+    }
+
 public:
     InterFrameVideoLossyCodec(int m, int width, int height, int iFrameInterval, int blockSize, 
-                        int searchRange, int qStep = 1)
+                        int searchRange, int qStep = 1, int transformSize = 8)
         : imageCodec(m), width(width), height(height), frameCount(0),
         iFrameInterval(iFrameInterval), blockSize(blockSize), 
-        searchRange(searchRange), quantizationStep(qStep) {
-        validateDimensions();
+        searchRange(searchRange), quantizationStep(qStep), transformSize(transformSize) {
+        if (transformSize != 0 && transformSize != 4 && transformSize != 8) {
+            throw invalid_argument("Transform size must be 0, 4 or 8");
+        }
+        // Dimensions may be left 0 when they come from the Y4M header or the metadata
+        if (width != 0 || height != 0) {
+            validateDimensions();
+        }
     }
 
-    void encode(const string& inputPath, const string& outputPath) {
-        ifstream input(inputPath, ios::binary);
-        if (!input) {
-            throw runtime_error("Could not open input file: " + inputPath);
-        }
+    // Pick the quantizer per frame to hit bitsPerSecond (the constructor step is the starting point)
+    void setTargetBitrate(double bitsPerSecond) {
+        rateMode = RateController::TARGET_BITRATE;
+        targetBitrate = bitsPerSecond;
+    }
+
+    // Constant quality: qStep at typical complexity, coarser on busy frames and finer on static ones
+    void setConstantQuality(int qStep) {
+        rateMode = RateController::CONSTANT_QUALITY;
+        quantizationStep = qStep;
+    }
+
+    // Entropy coder of the streams encode writes; decoding takes it from the metadata
+    void setEntropyBackend(EntropyBackend backend) {
+        entropyBackend = backend;
+    }
 
-        // Get input file size
-        input.seekg(0, ios::end);
-        size_t inputSize = input.tellg();
-        input.seekg(0, ios::beg);
+    // Paths may be "-" for stdin; the input is read once, front to back
+    void encode(const string& inputPath, const string& outputPath) {
+        ifstream inputFile;
+        istream& input = openInput(inputPath, inputFile);
 
         // Parse Y4M header
         if (!parseY4MHeader(input)) {
             throw runtime_error("Invalid Y4M header");
         }
+        validateDimensions();
 
-        // Count frames if not provided
-        if (frameCount == 0) {
-            streampos current = input.tellg();
-            input.seekg(0, ios::end);
-            size_t fileSize = static_cast<size_t>(input.tellg()) - static_cast<size_t>(current);
-            input.seekg(current, ios::beg);
-
-            size_t frameDataSize = getYSize() + 2 * getSourceUVSize();  // Actual YUV data size
-            size_t frameOverhead = 6;  // "FRAME\n" marker
-            size_t totalFrameSize = frameDataSize + frameOverhead;
-            
-            frameCount = fileSize / totalFrameSize;
-            cout << "Detected " << frameCount << " frames" << endl;
-        }
+        // Create the entropy encoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, imageCodec.getM(), false, outputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
 
-        // Write metadata
-        ofstream meta(outputPath + ".meta");
-        if (!meta) {
-            throw runtime_error("Could not create metadata file");
+        int baseQStep = quantizationStep;
+        runLevelRice[0] = runLevelRice[1] = RunLevelRice();
+        RateController rateController(baseQStep);
+        if (rateMode == RateController::TARGET_BITRATE) {
+            rateController = RateController::targetBitrate(targetBitrate, frameRate, iFrameInterval, baseQStep);
+        } else if (rateMode == RateController::CONSTANT_QUALITY) {
+            rateController = RateController::constantQuality(baseQStep);
         }
-        meta << y4mHeader;
-        meta << frameCount << " " << iFrameInterval << " " << blockSize << " " 
-             << searchRange << endl;
-        meta.close();
-
-        // Create Golomb encoder
-        Golomb golomb(imageCodec.getM(), false, outputPath + ".bin", 1);
 
-        Mat previousFrame;
-        vector<Mat> previousPlanes;
+        // Reference planes are the encoder's own reconstruction, as in the decoder
+        vector<Mat> previousPlanes(3);
+        vector<Mat> reconstructedPlanes(3);
+        FrameSyntax frame;  // per-plane modes and vectors, reused from frame to frame
+        Mat levels[3];      // one per plane, as the chroma planes are smaller
+        SeekIndex index;
+        
+        // Input frames are read on their own thread, ahead of the encoder, until the input ends
+        FrameSource<vector<Mat>> reader(PIPELINE_DEPTH,
+                                        [&](vector<Mat>& planes) { return readY4MFrame(input, planes); });
         
-        for (int f = 0; f < frameCount; ++f) {
-            vector<Mat> planes = readY4MFrame(input);
+        frameCount = 0;
+        vector<Mat> planes;
+        for (int f = 0; reader.next(planes); ++f, ++frameCount) {
             bool isIFrame = (f % iFrameInterval == 0);
-            golomb.encode(isIFrame ? 1 : 0);
+            coder.sync();  // so the offset is where an adaptive decoder can start
+            uint64_t frameStart = coder.bitsWritten();
+            if (isIFrame) {
+                index.addIFrame(f, frameStart);
+            }
+            writeFrameType(isIFrame ? I_FRAME : P_FRAME, coder);
+
+            // The step of every frame is in the stream, the decoder doesn't need the model
+            quantizationStep = rateController.nextQStep(isIFrame, rateMode == RateController::CONSTANT_QUALITY
+                                                                       ? frameComplexity(planes[0], previousPlanes[0]) : 0);
+            coder.encode(quantizationStep, SyntaxElement::Header);
             
             if (isIFrame) {
                 for (int i = 0; i < 3; ++i) {
-                    Mat residuals = calculateResidualsWithPrediction(planes[i]);
-                    writeResidualsGolomb(residuals, golomb, i > 0);  // i>0 indicates UV planes
+                    PlaneSyntax& plane = frame.planes[i];
+                    int channelBlockSize = planeBlockSize(i);
+                    encodePlane(planes[i], Mat(), true, plane.motionVectors, levels[i], plane.blockModes,
+                                plane.intraModes, channelBlockSize, reconstructedPlanes[i], i > 0);  // i>0 indicates UV planes
+                    writeIntraModes(plane.blockModes, plane.intraModes, coder);
+                    writeLevelsGolomb(levels[i], planeQuantizer(planes[i].size(), channelBlockSize, i > 0, true),
+                                      channelBlockSize, coder);
                 }
-                previousPlanes = planes;
             } else {
                 for (int i = 0; i < 3; ++i) {
-                    vector<Point2i> motionVectors;
-                    vector<bool> blockModes;
-                    Mat residuals;
-                    
-                    int channelBlockSize = (i == 0) ? blockSize : blockSize/2;
+                    PlaneSyntax& plane = frame.planes[i];
+                    int channelBlockSize = planeBlockSize(i);
                     
-                    encodePFrame(planes[i], previousPlanes[i], motionVectors, 
-                               residuals, blockModes, channelBlockSize);
+                    encodePlane(planes[i], previousPlanes[i], false, plane.motionVectors, levels[i],
+                                plane.blockModes, plane.intraModes, channelBlockSize, reconstructedPlanes[i], i > 0);
                     
                     // Write size and data using Golomb coding
-                    golomb.encode(motionVectors.size());
-                    writeMotionVectorsGolomb(motionVectors, golomb);
+                    coder.encode(plane.motionVectors.size(), SyntaxElement::Header);
+                    writeMotionVectorsGolomb(plane.motionVectors, (planes[i].cols + channelBlockSize - 1) / channelBlockSize, coder);
                     
                     // Write block modes
-                    for(bool mode : blockModes) {
-                        golomb.encode(mode ? 1 : 0);
+                    for(bool mode : plane.blockModes) {
+                        coder.encode(mode ? 1 : 0, SyntaxElement::Flag);
                     }
+                    writeIntraModes(plane.blockModes, plane.intraModes, coder);
                     
-                    writeResidualsGolomb(residuals, golomb, i > 0);  // i>0 indicates UV planes
+                    writeLevelsGolomb(levels[i], planeQuantizer(planes[i].size(), channelBlockSize, i > 0, false),
+                                      channelBlockSize, coder);
                 }
-                previousPlanes = planes;
             }
+            // The reconstruction becomes the reference, the old reference its buffer
+            swap(previousPlanes, reconstructedPlanes);
+            // Close the frame's segment first: rANS only counts written segments, arithmetic estimates inside one
+            coder.sync();
+            rateController.update(coder.bitsWritten() - frameStart, quantizationStep, isIFrame);
             
             if (f % 10 == 0) {
-                cout << "Encoded frame " << f << "/" << frameCount << endl;
+                cerr << "Encoded frame " << f << endl;
             }
         }
+        writeFrameType(END_OF_STREAM, coder);
         
-        golomb.end();
+        double achievedBitrate = coder.bitsWritten() * frameRate / max(frameCount, 1);
+        quantizationStep = baseQStep;
+        coder.end();
+        index.setFrameCount(frameCount);
+        index.write(outputPath + ".idx");
+
+        // Metadata goes last, once the frame count is known
+        ofstream meta(outputPath + ".meta");
+        if (!meta) {
+            throw runtime_error("Could not create metadata file");
+        }
+        meta << y4mHeader;
+        meta << frameCount << " " << iFrameInterval << " " << blockSize << " " 
+             << searchRange << " " << quantizationStep << " " << transformSize << " "
+             << entropyBackendName(entropyBackend) << endl;
+        meta.close();
         
         // Get compressed size
         ifstream binFile(outputPath + ".bin", ios::binary | ios::ate);
         size_t compressedSize = binFile.tellg();
+        size_t inputSize = y4mHeader.size() + frameCount * (6 + getYSize() + 2 * getUVSize());
         
-        cout << "Original size: " << inputSize << " bytes" << endl;
-        cout << "Compressed size: " << compressedSize << " bytes" << endl;
-        cout << "Compression ratio: " << (float)inputSize/compressedSize << ":1" << endl;
-        cout << "Encoding complete" << endl;
+        cerr << "Frames: " << frameCount << endl;
+        cerr << "Original size: " << inputSize << " bytes" << endl;
+        cerr << "Compressed size: " << compressedSize << " bytes" << endl;
+        cerr << "Compression ratio: " << (float)inputSize/compressedSize << ":1" << endl;
+        cerr << "Bitrate: " << achievedBitrate / 1000 << " kbps";
+        if (rateMode == RateController::TARGET_BITRATE) {
+            cerr << " (target " << targetBitrate / 1000 << " kbps)";
+        } else if (rateMode == RateController::CONSTANT_QUALITY) {
+            cerr << " (constant quality " << baseQStep << ")";
+        }
+        cerr << endl;
+        cerr << "Encoding complete" << endl;
     }
 
-    void decode(const string& inputPath, const string& outputPath) {
-        // Read metadata
+    // Everything the bitstream holds for one frame, parsed ahead of reconstruction
+    struct PlaneSyntax {
+        vector<Point2i> motionVectors;
+        vector<bool> blockModes;
+        vector<int> intraModes;
+        Mat residuals;  // dequantized
+    };
+    struct FrameSyntax {
+        bool isIFrame = false;
+        PlaneSyntax planes[3];
+    };
+
+    /*
+     * Entropy-decode and dequantize one frame. It needs no decoded pixels, so
+     * it can run ahead of reconstruction; it is the only decoding step that
+     * uses quantizationStep. False at the end-of-stream marker.
+     */
+    bool parseFrame(EntropyCoder& coder, FrameSyntax& frame) {
+        int frameType = readFrameType(coder);
+        if (frameType == END_OF_STREAM) {
+            return false;
+        }
+        frame.isIFrame = frameType == I_FRAME;
+        quantizationStep = coder.decode_val(SyntaxElement::Header);
+
+        for (int i = 0; i < 3; ++i) {
+            PlaneSyntax& plane = frame.planes[i];
+            Size channelSize = planeSize(i);
+            int channelBlockSize = planeBlockSize(i);
+            if (frame.isIFrame) {
+                int numBlocks = ((channelSize.width + channelBlockSize - 1) / channelBlockSize) *
+                                ((channelSize.height + channelBlockSize - 1) / channelBlockSize);
+                AllocationCounter::assign(plane.motionVectors, numBlocks, Point2i(0, 0));
+                AllocationCounter::assign(plane.blockModes, numBlocks, true);
+            } else {
+                size_t numVectors = coder.decode_val(SyntaxElement::Header);
+                readMotionVectorsGolomb(numVectors, (channelSize.width + channelBlockSize - 1) / channelBlockSize,
+                                        plane.motionVectors, coder);
+                AllocationCounter::resize(plane.blockModes, numVectors);
+                for(size_t j = 0; j < numVectors; j++) {
+                    plane.blockModes[j] = coder.decode_val(SyntaxElement::Flag) == 1;
+                }
+            }
+            readIntraModes(plane.blockModes, plane.intraModes, coder);
+            readResidualsGolomb(plane.residuals, coder, i > 0, frame.isIFrame,
+                                channelSize, channelBlockSize);  // i>0 indicates UV planes
+        }
+        return true;
+    }
+
+    /*
+     * Rebuild a parsed frame into reconstructedPlanes, reusing their buffers
+     * when they have the right size; previousPlanes is the reference of
+     * P-frames and unused by I-frames, and must not share buffers with the output.
+     */
+    void reconstructFrame(const FrameSyntax& frame, const vector<Mat>& previousPlanes,
+                          vector<Mat>& reconstructedPlanes) const {
+        if (!frame.isIFrame && previousPlanes.size() != 3) {
+            throw runtime_error("P-frame without a reference frame");
+        }
+        reconstructedPlanes.resize(3);
+        for (int i = 0; i < 3; ++i) {
+            const PlaneSyntax& plane = frame.planes[i];
+            decodePFrame(frame.isIFrame ? Mat() : previousPlanes[i], plane.motionVectors, plane.blockModes,
+                         plane.intraModes, plane.residuals, planeBlockSize(i), reconstructedPlanes[i]);
+        }
+    }
+
+    vector<Mat> reconstructFrame(const FrameSyntax& frame, const vector<Mat>& previousPlanes) const {
+        vector<Mat> reconstructedPlanes;
+        reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+        return reconstructedPlanes;
+    }
+
+    vector<Mat> decodeFrame(EntropyCoder& coder, const vector<Mat>& previousPlanes) {
+        FrameSyntax frame;
+        if (!parseFrame(coder, frame)) {
+            throw runtime_error("Unexpected end of stream");
+        }
+        return reconstructFrame(frame, previousPlanes);
+    }
+
+    // Restore the stream parameters from the .meta file written by encode
+    void readMetadata(const string& inputPath) {
         ifstream meta(inputPath + ".meta");
         if (!meta) {
             throw runtime_error("Could not open metadata file");
@@ -730,7 +1384,13 @@ public:
         
         // Read Y4M header from metadata
         getline(meta, y4mHeader);
-        meta >> frameCount >> iFrameInterval >> blockSize >> searchRange;
+        meta >> frameCount >> iFrameInterval >> blockSize >> searchRange
+             >> quantizationStep >> transformSize;
+        string backendName;
+        if (!(meta >> backendName)) {
+            throw runtime_error("Invalid metadata file");
+        }
+        entropyBackend = parseEntropyBackend(backendName);
         
         // Parse dimensions from Y4M header
         stringstream headerStream(y4mHeader);
@@ -740,74 +1400,98 @@ public:
         
         meta.close();
         validateDimensions();
+    }
 
-        // Create Golomb decoder
-        Golomb golomb(imageCodec.getM(), true, inputPath + ".bin", 1);
+    void decode(const string& inputPath, const string& outputPath) {
+        readMetadata(inputPath);
 
-        // Open output file and write Y4M header
-        ofstream output(outputPath, ios::binary);
-        if (!output) {
-            throw runtime_error("Could not open output file");
-        }
+        // Create the entropy decoder
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, imageCodec.getM(), true, inputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
+
+        // Open output file (or stdout) and write Y4M header
+        ofstream outputFile;
+        ostream& output = openOutput(outputPath, outputFile);
         output << y4mHeader;
 
         vector<Mat> previousPlanes;
-        // Initialize with empty planes
-        previousPlanes.push_back(Mat::zeros(height, width, CV_8UC1));
-        previousPlanes.push_back(Mat::zeros(height/2, width/2, CV_8UC1));
-        previousPlanes.push_back(Mat::zeros(height/2, width/2, CV_8UC1));
+        vector<Mat> reconstructedPlanes;
 
         try {
-            for (int f = 0; f < frameCount; ++f) {
-                bool isIFrame = golomb.decode_val() == 1;
-                vector<Mat> reconstructedPlanes;
-
-                if (isIFrame) {
-                    for (int i = 0; i < 3; ++i) {
-                        Mat residuals;  // Let readResidualsGolomb allocate the proper size
-                        readResidualsGolomb(residuals, golomb, i > 0);  // i>0 indicates UV planes
-                        reconstructedPlanes.push_back(
-                            reconstructChannelWithPrediction(residuals));
-                    }
-                } else {
-                    for (int i = 0; i < 3; ++i) {
-                        size_t numVectors = golomb.decode_val();
-                        vector<Point2i> motionVectors = 
-                            readMotionVectorsGolomb(numVectors, golomb);
-                        
-                        vector<bool> blockModes;
-                        for(size_t j = 0; j < numVectors; j++) {
-                            blockModes.push_back(golomb.decode_val() == 1);
-                        }
-                        
-                        int channelWidth = (i == 0) ? width : width/2;
-                        int channelHeight = (i == 0) ? height : height/2;
-                        int channelBlockSize = (i == 0) ? blockSize : blockSize/2;
-                        
-                        Mat residuals;  // Let readResidualsGolomb allocate the proper size
-                        readResidualsGolomb(residuals, golomb, i > 0);  // i>0 indicates UV planes
-                        
-                        Mat reconstructedChannel = decodePFrame(previousPlanes[i], 
-                                                              motionVectors,
-                                                              blockModes, 
-                                                              residuals,
-                                                              channelBlockSize);
-                        reconstructedPlanes.push_back(reconstructedChannel);
-                    }
+            // Entropy decoding, reconstruction (this thread) and writing run as a pipeline,
+            // up to the end-of-stream marker
+            FrameSource<FrameSyntax> parser(PIPELINE_DEPTH,
+                                            [&](FrameSyntax& frame) { return parseFrame(coder, frame); });
+            FrameSink<vector<Mat>> writer(PIPELINE_DEPTH,
+                                          [&](vector<Mat>& planes) { writeY4MFrame(planes, output); });
+            FrameSyntax frame;
+            for (int f = 0; parser.next(frame); ++f) {
+                // Frames are rebuilt in the writer's recycled buffers. Each one is
+                // queued once the next frame no longer needs it as the reference,
+                // so the writer never hands back a buffer still being read
+                writer.acquire(reconstructedPlanes);
+                reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+                if (!previousPlanes.empty()) {
+                    writer.push(move(previousPlanes));
                 }
-                
-                writeY4MFrame(reconstructedPlanes, output);
-                previousPlanes = reconstructedPlanes;
+                previousPlanes = move(reconstructedPlanes);
                 
                 if (f % 10 == 0) {
-                    cout << "Decoded frame " << f << "/" << frameCount << endl;
+                    cerr << "Decoded frame " << f << "/" << frameCount << endl;
                 }
             }
+            if (!previousPlanes.empty()) {
+                writer.push(move(previousPlanes));
+            }
+            writer.finish();
+            output.flush();
         } catch (const exception& e) {
-            cout << "Error during decoding: " << e.what() << endl;
+            cerr << "Error during decoding: " << e.what() << endl;
             throw;
         }
         
-        cout << "Decoding complete" << endl;
+        cerr << "Decoding complete" << endl;
+    }
+
+    /*
+     * Decode frames first..last (inclusive) into a Y4M file, starting at the
+     * last I-frame at or before `first` from the seek index written by
+     * encode. Every frame carries its own quantizer step, so no state from
+     * earlier GOPs is needed.
+     */
+    void decodeRange(const string& inputPath, const string& outputPath, int first, int last) {
+        readMetadata(inputPath);
+        if (first < 0 || last < first || last >= frameCount) {
+            throw invalid_argument("Invalid frame range");
+        }
+        SeekIndex index = SeekIndex::read(inputPath + ".idx");
+        const SeekIndex::Entry& start = index.seekPoint(first);
+
+        unique_ptr<EntropyCoder> entropyCoder =
+            makeEntropyCoder(entropyBackend, imageCodec.getM(), true, inputPath + ".bin");
+        EntropyCoder& coder = *entropyCoder;
+        coder.seekToBit(start.bitOffset);
+
+        ofstream outputFile;
+        ostream& output = openOutput(outputPath, outputFile);
+        output << y4mHeader;
+
+        FrameSyntax frame;
+        vector<Mat> previousPlanes;
+        vector<Mat> reconstructedPlanes;
+        for (int f = start.frame; f <= last; ++f) {
+            if (!parseFrame(coder, frame)) {
+                throw runtime_error("Unexpected end of stream");
+            }
+            reconstructFrame(frame, previousPlanes, reconstructedPlanes);
+            if (f >= first) {
+                writeY4MFrame(reconstructedPlanes, output);
+            }
+            // The new frame is the reference, the old reference its buffer
+            swap(previousPlanes, reconstructedPlanes);
+        }
+        output.flush();
+        cerr << "Decoded frames " << first << "-" << last << " from I-frame " << start.frame << endl;
     }
 };
\ No newline at end of file
@@ -0,0 +1,403 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "BitStream.h"
+#include "entropy_coder.h"
+
+using namespace std;
+
+/*
+ * Static rANS coder with interleaved states, for residual planes and audio
+ * residuals, where Rice wastes bits on the shape of the distribution and
+ * the arithmetic coder's bin-by-bin decoding is too slow for batch jobs.
+ *
+ * Values are buffered into segments of up to SEGMENT_SYMBOLS. Each segment
+ * is written with its own frequency table, normalized from the histogram
+ * of its tokens: zigzagged values below DIRECT_VALUES are their own token,
+ * larger ones are coded by magnitude class (position of the leading one and
+ * the two bits after it) with the remaining low bits stored raw, so audio
+ * residuals in the thousands cost little more than their entropy.
+ * A segment is laid out as
+ *   count, table, raw bits, final states, 16-bit payload words
+ * with the counts as LEB128 varints. The decoder decodes a whole segment in
+ * one pass over STATES independent states, then hands the values out in
+ * order. Header elements share the segment, there are no adaptive contexts.
+ */
+class RansCoder : public EntropyCoder {
+private:
+    static const int STATES = 4;
+    static const int PROBABILITY_BITS = 12;
+    static const uint32_t PROBABILITY_SCALE = 1u << PROBABILITY_BITS;
+    static const uint32_t DIRECT_BITS = 4;
+    static const uint32_t DIRECT_VALUES = 1u << DIRECT_BITS;
+    static const uint32_t ALPHABET = DIRECT_VALUES + 4 * (32 - DIRECT_BITS);  // two classes per octave and bit
+    static const uint32_t STATE_LOW = 1u << 16;  // states stay in [2^16, 2^32), renormalized 16 bits at a time
+    static const size_t SEGMENT_SYMBOLS = 1 << 16;
+
+    BitStream bs;
+    bool decoder;
+
+    // Encoder: zigzagged values of the open segment. Decoder: the decoded segment
+    vector<uint32_t> values;
+    size_t position = 0;
+
+    // Segment tables and payload, reused from segment to segment
+    vector<uint32_t> frequencies;
+    vector<uint32_t> cumulative;
+    vector<uint8_t> slotSymbols;  // symbol of each of the PROBABILITY_SCALE slots
+    vector<uint8_t> rawBits;    // low bits of the classed values, LSB first
+
+    // Per token: smallest value and number of raw bits
+    uint32_t tokenBase[ALPHABET];
+    uint8_t tokenBits[ALPHABET];
+    vector<uint16_t> words;     // encoder: renormalization output, last first
+    vector<uint8_t> payload;    // the words as stored, little-endian in decoding order
+
+    static uint32_t zigzag(int value) {
+        return value >= 0 ? 2u * value : 2u * static_cast<uint32_t>(-(value + 1)) + 1;
+    }
+
+    static int unzigzag(uint32_t value) {
+        return (value & 1) ? -static_cast<int>(value >> 1) - 1 : static_cast<int>(value >> 1);
+    }
+
+    static int highestBit(uint32_t value) {
+        int bit = 0;
+        while (value >>= 1) bit++;
+        return bit;
+    }
+
+    void buildTokenTables() {
+        for (uint32_t token = 0; token < ALPHABET; ++token) {
+            if (token < DIRECT_VALUES) {
+                tokenBase[token] = token;
+                tokenBits[token] = 0;
+            } else {
+                int bits = (token - DIRECT_VALUES) / 4 + DIRECT_BITS - 2;
+                tokenBase[token] = (4 | (token & 3)) << bits;
+                tokenBits[token] = static_cast<uint8_t>(bits);
+            }
+        }
+    }
+
+    // Token of a zigzagged value; classed tokens leave highestBit - 2 raw bits
+    static uint32_t tokenOf(uint32_t value) {
+        if (value < DIRECT_VALUES) return value;
+        int bit = highestBit(value);
+        return DIRECT_VALUES + 4 * (bit - DIRECT_BITS) + ((value >> (bit - 2)) & 3);
+    }
+
+    void writeVarint(uint64_t value) {
+        while (value >= 0x80) {
+            bs.writeByte(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        bs.writeByte(static_cast<uint8_t>(value));
+    }
+
+    uint64_t readVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = bs.readByte();
+            if (byte < 0) {
+                throw runtime_error("Unexpected end of rANS stream");
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw runtime_error("Corrupt rANS stream");
+    }
+
+    void writeWord(uint32_t word) {
+        bs.writeByte(static_cast<uint8_t>(word));
+        bs.writeByte(static_cast<uint8_t>(word >> 8));
+    }
+
+    uint32_t readWord() {
+        int low = bs.readByte();
+        int high = bs.readByte();
+        if (low < 0 || high < 0) {
+            throw runtime_error("Unexpected end of rANS stream");
+        }
+        return static_cast<uint32_t>(low) | (static_cast<uint32_t>(high) << 8);
+    }
+
+    // Scale the histogram to PROBABILITY_SCALE, keeping every present symbol codable
+    void normalizeFrequencies(const uint32_t* counts, size_t total) {
+        frequencies.assign(ALPHABET, 0);
+        uint32_t sum = 0;
+        for (uint32_t s = 0; s < ALPHABET; ++s) {
+            if (counts[s] == 0) continue;
+            frequencies[s] = max<uint32_t>(1, static_cast<uint32_t>(uint64_t(counts[s]) * PROBABILITY_SCALE / total));
+            sum += frequencies[s];
+        }
+        // Rounding errors go to the most frequent symbols, where they cost least
+        while (sum != PROBABILITY_SCALE) {
+            uint32_t largest = static_cast<uint32_t>(max_element(frequencies.begin(), frequencies.end()) -
+                                                     frequencies.begin());
+            if (sum < PROBABILITY_SCALE) {
+                frequencies[largest] += PROBABILITY_SCALE - sum;
+                sum = PROBABILITY_SCALE;
+            } else {
+                uint32_t excess = min(sum - PROBABILITY_SCALE, frequencies[largest] - 1);
+                frequencies[largest] -= max<uint32_t>(excess / 2, 1);
+                sum -= max<uint32_t>(excess / 2, 1);
+            }
+        }
+        cumulative.assign(ALPHABET + 1, 0);
+        for (uint32_t s = 0; s < ALPHABET; ++s) {
+            cumulative[s + 1] = cumulative[s] + frequencies[s];
+        }
+    }
+
+    void writeSegment() {
+        size_t count = values.size();
+        uint32_t counts[ALPHABET] = {};
+        rawBits.clear();
+        uint64_t pending = 0;
+        int pendingBits = 0;
+        for (uint32_t& value : values) {
+            uint32_t symbol = tokenOf(value);
+            counts[symbol]++;
+            if (symbol >= DIRECT_VALUES) {
+                int bits = highestBit(value) - 2;
+                pending |= static_cast<uint64_t>(value & ((1u << bits) - 1)) << pendingBits;
+                pendingBits += bits;
+                while (pendingBits >= 8) {
+                    rawBits.push_back(static_cast<uint8_t>(pending));
+                    pending >>= 8;
+                    pendingBits -= 8;
+                }
+            }
+            value = symbol;  // only the tokens are needed from here on
+        }
+        if (pendingBits > 0) {
+            rawBits.push_back(static_cast<uint8_t>(pending));
+        }
+        normalizeFrequencies(counts, count);
+
+        // Encode back to front, so the decoder reads the words front to back
+        uint32_t states[STATES];
+        fill(states, states + STATES, STATE_LOW);
+        words.clear();
+        for (size_t i = count; i-- > 0;) {
+            uint32_t symbol = values[i];
+            uint32_t frequency = frequencies[symbol];
+            uint32_t& x = states[i % STATES];
+            uint64_t limit = (uint64_t(STATE_LOW >> PROBABILITY_BITS) << 16) * frequency;
+            if (x >= limit) {
+                words.push_back(static_cast<uint16_t>(x));
+                x >>= 16;
+            }
+            x = ((x / frequency) << PROBABILITY_BITS) + (x % frequency) + cumulative[symbol];
+        }
+
+        writeVarint(count);
+        uint32_t used = ALPHABET;
+        while (frequencies[used - 1] == 0) used--;
+        writeVarint(used);
+        for (uint32_t s = 0; s < used; ++s) {
+            writeVarint(frequencies[s]);
+        }
+        writeVarint(rawBits.size());
+        bs.writeBytes(rawBits.data(), rawBits.size());
+        for (uint32_t x : states) {
+            writeWord(x);
+            writeWord(x >> 16);
+        }
+        writeVarint(words.size());
+        payload.resize(2 * words.size());
+        for (size_t i = 0; i < words.size(); ++i) {
+            uint16_t word = words[words.size() - 1 - i];
+            payload[2 * i] = static_cast<uint8_t>(word);
+            payload[2 * i + 1] = static_cast<uint8_t>(word >> 8);
+        }
+        bs.writeBytes(payload.data(), payload.size());
+        values.clear();
+    }
+
+    void readSegment() {
+        size_t count = readVarint();
+        uint32_t used = readVarint();
+        if (count == 0 || count > SEGMENT_SYMBOLS || used == 0 || used > ALPHABET) {
+            throw runtime_error("Corrupt rANS stream");
+        }
+        frequencies.assign(ALPHABET, 0);
+        cumulative.assign(ALPHABET + 1, 0);
+        for (uint32_t s = 0; s < used; ++s) {
+            frequencies[s] = readVarint();
+            cumulative[s + 1] = cumulative[s] + frequencies[s];
+        }
+        for (uint32_t s = used; s < ALPHABET; ++s) {
+            cumulative[s + 1] = cumulative[s];
+        }
+        if (cumulative[ALPHABET] != PROBABILITY_SCALE) {
+            throw runtime_error("Corrupt rANS frequency table");
+        }
+        slotSymbols.resize(PROBABILITY_SCALE);
+        for (uint32_t s = 0; s < used; ++s) {
+            fill(slotSymbols.begin() + cumulative[s], slotSymbols.begin() + cumulative[s + 1], static_cast<uint8_t>(s));
+        }
+        rawBits.resize(readVarint());
+        if (bs.readBytes(rawBits.data(), rawBits.size()) != rawBits.size()) {
+            throw runtime_error("Unexpected end of rANS stream");
+        }
+        uint32_t states[STATES];
+        for (uint32_t& x : states) {
+            x = readWord();
+            x |= readWord() << 16;
+        }
+        payload.resize(2 * readVarint());
+        if (bs.readBytes(payload.data(), payload.size()) != payload.size()) {
+            throw runtime_error("Unexpected end of rANS stream");
+        }
+
+        decodeSegment(states, count);
+    }
+
+    /*
+     * The hot loop: STATES symbols per round with independent states, so
+     * their table lookups and multiplies overlap. Only the renormalization
+     * reads are ordered.
+     */
+    void decodeSegment(const uint32_t* initialStates, size_t count) {
+        values.resize(count);
+        const uint32_t mask = PROBABILITY_SCALE - 1;
+        const uint8_t* slots = slotSymbols.data();
+        const uint32_t* frequency = frequencies.data();
+        const uint32_t* start = cumulative.data();
+        const uint8_t* word = payload.data();
+        const uint8_t* wordsEnd = word + payload.size();
+        uint32_t* out = values.data();
+
+        // Local copies, which the compiler can keep in registers as they don't alias `out`
+        uint32_t states[STATES];
+        copy(initialStates, initialStates + STATES, states);
+        auto decodeSymbol = [&](uint32_t& x) {
+            uint32_t slot = x & mask;
+            uint32_t symbol = slots[slot];
+            x = frequency[symbol] * (x >> PROBABILITY_BITS) + slot - start[symbol];
+            if (x < STATE_LOW) {
+                x = (x << 16) | word[0] | (uint32_t(word[1]) << 8);
+                word += 2;
+            }
+            return symbol;
+        };
+
+        // Full rounds while the payload surely holds a word for every state, then a checked tail
+        size_t i = 0;
+        for (; i + STATES <= count && wordsEnd - word >= 2 * STATES; i += STATES) {
+            for (int j = 0; j < STATES; ++j) {
+                out[i + j] = decodeSymbol(states[j]);
+            }
+        }
+        for (; i < count; ++i) {
+            uint32_t& x = states[i % STATES];
+            uint32_t slot = x & mask;
+            uint32_t symbol = slots[slot];
+            x = frequency[symbol] * (x >> PROBABILITY_BITS) + slot - start[symbol];
+            if (x < STATE_LOW) {
+                if (wordsEnd - word < 2) {
+                    throw runtime_error("Corrupt rANS stream");
+                }
+                x = (x << 16) | word[0] | (uint32_t(word[1]) << 8);
+                word += 2;
+            }
+            out[i] = symbol;
+        }
+
+        // Second pass: tokens back to values with their raw bits, branch-free as tokens mix freely
+        const uint8_t* raw = rawBits.data();
+        const uint8_t* rawEnd = raw + rawBits.size();
+        uint64_t pending = 0;
+        int pendingBits = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t symbol = out[i];
+            int bits = tokenBits[symbol];
+            if (pendingBits < bits) {
+                // Refill four bytes at a time while they last
+                if (rawEnd - raw >= 4) {
+                    uint32_t next = raw[0] | (uint32_t(raw[1]) << 8) | (uint32_t(raw[2]) << 16) | (uint32_t(raw[3]) << 24);
+                    pending |= static_cast<uint64_t>(next) << pendingBits;
+                    pendingBits += 32;
+                    raw += 4;
+                } else {
+                    while (pendingBits < bits && raw != rawEnd) {
+                        pending |= static_cast<uint64_t>(*raw++) << pendingBits;
+                        pendingBits += 8;
+                    }
+                    if (pendingBits < bits) {
+                        throw runtime_error("Corrupt rANS stream");
+                    }
+                }
+            }
+            out[i] = tokenBase[symbol] | (static_cast<uint32_t>(pending) & ((1u << bits) - 1));
+            pending >>= bits;
+            pendingBits -= bits;
+        }
+        position = 0;
+    }
+
+protected:
+    void encodeValue(int value, SyntaxElement) override {
+        values.push_back(zigzag(value));
+        if (values.size() == SEGMENT_SYMBOLS) {
+            writeSegment();
+        }
+    }
+
+    int decodeValue(SyntaxElement) override {
+        if (position == values.size()) {
+            readSegment();
+        }
+        return unzigzag(values[position++]);
+    }
+
+public:
+    RansCoder(bool decoder, const string& file) : bs(file, decoder), decoder(decoder) {
+        buildTokenTables();
+    }
+
+    // Code to / from a memory buffer instead of a file
+    RansCoder(bool decoder, vector<uint8_t>& buffer) : bs(buffer, decoder), decoder(decoder) {
+        buildTokenTables();
+    }
+
+    // The encoder writes out the open segment; the decoder drops what is left of its segment
+    void sync() override {
+        if (!decoder) {
+            if (!values.empty()) writeSegment();
+        } else {
+            position = values.size();
+        }
+    }
+
+    void flush() override {
+        sync();
+        if (!decoder) {
+            bs.flush();
+        }
+    }
+
+    void end() override {
+        sync();
+        bs.end();
+    }
+
+    // Closed segments only: buffered values are counted once sync() writes them
+    uint64_t bitsWritten() const override {
+        return bs.bitsWritten();
+    }
+
+    void seekToBit(uint64_t bitOffset) override {
+        bs.seekToBit(bitOffset);
+        values.clear();
+        position = 0;
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+/*
+ * Per-frame quantizer selection for the lossy video codec.
+ *
+ * TARGET_BITRATE uses a first-order rate model (bits = complexity / qStep)
+ * per frame type, plus a virtual buffer holding the bits produced minus the
+ * bits budgeted so far, which pulls the average rate back onto the target.
+ * CONSTANT_QUALITY is x264's constant rate factor: the step follows the
+ * frame's complexity (blurred over frames) to the power 1 - QCOMP, so busy
+ * frames, which mask noise, are quantized coarser and flat or static ones
+ * finer, and the base step is the one for REFERENCE_COMPLEXITY. I-frames
+ * are quantized finer in both modes since every P-frame of the GOP
+ * predicts from them.
+ */
+class RateController {
+public:
+    enum Mode { CONSTANT_QP, TARGET_BITRATE, CONSTANT_QUALITY };
+
+private:
+    static constexpr int MIN_QSTEP = 2;            // step 1 would switch to lossless coding
+    static constexpr int MAX_QSTEP = 255;
+    static constexpr double IP_RATIO = 1.4;        // I-frame step = P-frame step / IP_RATIO
+    static constexpr double MAX_QSTEP_CHANGE = 1.5; // between consecutive frames of a type
+    static constexpr double BUFFER_REACTION = 8.0; // frames over which buffer drift is paid back
+    static constexpr double COMPLEXITY_DECAY = 0.5;
+    static constexpr double QCOMP = 0.6;           // 1 = constant step, 0 = constant bits per frame
+    static constexpr double REFERENCE_COMPLEXITY = 4.0;  // mean |difference| per pixel of typical footage
+
+    Mode mode;
+    int baseQStep;              // constant step, or starting point of the bitrate mode
+    double targetFrameBits = 0;
+    int gopLength = 1;
+
+    double bufferFullness = 0;  // bits produced - bits budgeted
+    double complexity[2] = {0, 0};  // bits * qStep, indexed by isIFrame
+    double lastQStep[2] = {0, 0};
+    bool seen[2] = {false, false};
+    double blurredComplexity = -1;  // constant quality, -1 before the first frame
+
+    int clampQStep(double qStep) const {
+        return static_cast<int>(min<double>(MAX_QSTEP, max<double>(MIN_QSTEP, lround(qStep))));
+    }
+
+    // Share of the GOP budget an I-frame gets if coded at the same step as the P-frames
+    double frameBudget(bool isIFrame) const {
+        double ratio = (seen[0] && seen[1]) ? complexity[1] / complexity[0] : 4.0;
+        double gopBits = targetFrameBits * gopLength;
+        double shares = ratio + (gopLength - 1);
+        return gopBits * (isIFrame ? ratio : 1.0) / shares;
+    }
+
+public:
+    RateController(int qStep = 1) : mode(CONSTANT_QP), baseQStep(qStep) {}
+
+    static RateController targetBitrate(double bitsPerSecond, double framesPerSecond,
+                                        int gopLength, int initialQStep) {
+        if (bitsPerSecond <= 0 || framesPerSecond <= 0) {
+            throw invalid_argument("Bitrate and frame rate must be positive");
+        }
+        RateController rc(initialQStep);
+        rc.mode = TARGET_BITRATE;
+        rc.targetFrameBits = bitsPerSecond / framesPerSecond;
+        rc.gopLength = max(1, gopLength);
+        return rc;
+    }
+
+    static RateController constantQuality(int qStep) {
+        RateController rc(qStep);
+        rc.mode = CONSTANT_QUALITY;
+        return rc;
+    }
+
+    Mode getMode() const { return mode; }
+
+    // Quantizer step for the next frame; the quality mode needs its complexity (e.g. mean |difference| per pixel)
+    int nextQStep(bool isIFrame, double frameComplexity = 0) {
+        double qStep;
+        switch (mode) {
+            case CONSTANT_QP:
+                return baseQStep;
+            case CONSTANT_QUALITY:
+                blurredComplexity = blurredComplexity < 0
+                    ? frameComplexity
+                    : COMPLEXITY_DECAY * blurredComplexity + (1 - COMPLEXITY_DECAY) * frameComplexity;
+                qStep = baseQStep * pow(blurredComplexity / REFERENCE_COMPLEXITY, 1 - QCOMP);
+                return clampQStep(isIFrame ? qStep / IP_RATIO : qStep);
+            case TARGET_BITRATE:
+            default: {
+                if (!seen[isIFrame]) {
+                    qStep = isIFrame ? baseQStep / IP_RATIO : baseQStep;
+                    if (seen[!isIFrame]) {
+                        qStep = isIFrame ? lastQStep[0] / IP_RATIO : lastQStep[1] * IP_RATIO;
+                    }
+                } else {
+                    double budget = frameBudget(isIFrame) - bufferFullness / BUFFER_REACTION;
+                    budget = max(budget, 0.25 * frameBudget(isIFrame));
+                    qStep = complexity[isIFrame] / budget;
+                    qStep = min(qStep, lastQStep[isIFrame] * MAX_QSTEP_CHANGE);
+                    qStep = max(qStep, lastQStep[isIFrame] / MAX_QSTEP_CHANGE);
+                }
+                int chosen = clampQStep(qStep);
+                lastQStep[isIFrame] = chosen;
+                return chosen;
+            }
+        }
+    }
+
+    // Feed back the size of the frame just coded with qStep
+    void update(double frameBits, int qStep, bool isIFrame) {
+        if (mode != TARGET_BITRATE) return;
+        double frameComplexity = frameBits * qStep;
+        complexity[isIFrame] = seen[isIFrame]
+            ? COMPLEXITY_DECAY * complexity[isIFrame] + (1 - COMPLEXITY_DECAY) * frameComplexity
+            : frameComplexity;
+        seen[isIFrame] = true;
+        lastQStep[isIFrame] = qStep;
+        bufferFullness += frameBits - targetFrameBits;
+    }
+};
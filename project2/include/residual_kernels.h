@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Row kernels shared by the video codecs to turn samples into
+ * residuals and back, as int or, where whole planes are kept, int16. They
+ * work on raw row pointers, 16 samples per SSE2 step, with a scalar tail
+ * (and a scalar build without SSE2). 9 to 16-bit samples come in ushort
+ * rows, on a plain scalar path, always with int residuals; their sums are
+ * clamped to maxValue, which the 8-bit overloads take too for callers
+ * templated on the sample type.
+ */
+class ResidualKernels {
+private:
+#ifdef __SSE2__
+    // 16 signed 16-bit differences -> 16 ints
+    static void storeWidened(__m128i lo, __m128i hi, int* out) {
+        __m128i signLo = _mm_srai_epi16(lo, 15);
+        __m128i signHi = _mm_srai_epi16(hi, 15);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi16(lo, signLo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(lo, signLo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpacklo_epi16(hi, signHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm_unpackhi_epi16(hi, signHi));
+    }
+
+    // 16 ints -> 16 saturated 16-bit lanes (two registers)
+    static void loadNarrowed(const int* in, __m128i& lo, __m128i& hi) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(in);
+        lo = _mm_packs_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        hi = _mm_packs_epi32(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+    }
+#endif
+
+public:
+    // out[i] = a[i] - b[i]
+    static void subtractRow(const uchar* a, const uchar* b, int* out, int n) {
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            storeWidened(lo, hi, out + i);
+        }
+#endif
+        for (; i < n; ++i) out[i] = a[i] - b[i];
+    }
+
+    // int16 version: 8-bit differences always fit
+    static void subtractRow(const uchar* a, const uchar* b, short* out, int n) {
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                             _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8),
+                             _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)));
+        }
+#endif
+        for (; i < n; ++i) out[i] = static_cast<short>(a[i] - b[i]);
+    }
+
+    // out[i] = saturate(prediction[i] + residuals[i])
+    static void addRow(const uchar* prediction, const int* residuals, uchar* out, int n) {
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prediction + i));
+            __m128i lo, hi;
+            loadNarrowed(residuals + i, lo, hi);
+            lo = _mm_adds_epi16(lo, _mm_unpacklo_epi8(p, zero));
+            hi = _mm_adds_epi16(hi, _mm_unpackhi_epi8(p, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; i < n; ++i) out[i] = saturate_cast<uchar>(prediction[i] + residuals[i]);
+    }
+
+    static void addRow(const uchar* prediction, const short* residuals, uchar* out, int n) {
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prediction + i));
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i + 8));
+            lo = _mm_adds_epi16(lo, _mm_unpacklo_epi8(p, zero));
+            hi = _mm_adds_epi16(hi, _mm_unpackhi_epi8(p, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; i < n; ++i) out[i] = saturate_cast<uchar>(prediction[i] + residuals[i]);
+    }
+
+    static void addRow(const uchar* prediction, const int* residuals, uchar* out, int n, int /* maxValue */) {
+        addRow(prediction, residuals, out, n);
+    }
+
+    static void addRow(const uchar* prediction, const short* residuals, uchar* out, int n, int /* maxValue */) {
+        addRow(prediction, residuals, out, n);
+    }
+
+    static void subtractRow(const ushort* a, const ushort* b, int* out, int n) {
+        for (int i = 0; i < n; ++i) out[i] = a[i] - b[i];
+    }
+
+    static void addRow(const ushort* prediction, const int* residuals, ushort* out, int n, int maxValue) {
+        for (int i = 0; i < n; ++i) out[i] = static_cast<ushort>(min(max(prediction[i] + residuals[i], 0), maxValue));
+    }
+
+    // West predictor residuals of a row: the left sample, 128 for the first one
+    static void westResidualRow(const uchar* in, int* out, int n) {
+        if (n <= 0) return;
+        out[0] = in[0] - 128;
+        subtractRow(in + 1, in, out + 1, n - 1);
+    }
+
+    // High bit depth (up to 16-bit) version; `mid` predicts the first sample
+    static void westResidualRow(const ushort* in, int* out, int n, int mid) {
+        if (n <= 0) return;
+        out[0] = in[0] - mid;
+        for (int i = 1; i < n; ++i) out[i] = in[i] - in[i - 1];
+    }
+
+    /*
+     * Inverse of westResidualRow: a running sum from 128. Streams from the
+     * encoder never leave 0..255 along the way, so summing first and
+     * saturating the stored value is the same as the sample-by-sample rebuild.
+     */
+    static void westReconstructRow(const int* residuals, uchar* out, int n) {
+        int i = 0;
+        int running = 128;
+#ifdef __SSE2__
+        __m128i carry = _mm_set1_epi32(running);
+        for (; i + 8 <= n; i += 8) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i + 4));
+            // In-register prefix sums of 4 lanes, then the sum so far on top
+            a = _mm_add_epi32(a, _mm_slli_si128(a, 4));
+            a = _mm_add_epi32(a, _mm_slli_si128(a, 8));
+            b = _mm_add_epi32(b, _mm_slli_si128(b, 4));
+            b = _mm_add_epi32(b, _mm_slli_si128(b, 8));
+            a = _mm_add_epi32(a, carry);
+            b = _mm_add_epi32(b, _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3)));
+            carry = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 3, 3, 3));
+            __m128i packed = _mm_packs_epi32(a, b);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(packed, packed));
+        }
+        running = _mm_cvtsi128_si32(carry);
+#endif
+        for (; i < n; ++i) {
+            running += residuals[i];
+            out[i] = saturate_cast<uchar>(running);
+        }
+    }
+
+    static void westReconstructRow(const int* residuals, ushort* out, int n, int mid, int maxValue) {
+        int running = mid;
+        for (int i = 0; i < n; ++i) {
+            running += residuals[i];
+            out[i] = static_cast<ushort>(min(max(running, 0), maxValue));
+        }
+    }
+};
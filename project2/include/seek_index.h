@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Random-access index of a video bitstream: the bit offset of every I-frame
+ * (GOP start), so a decoder can seek to the GOP holding a frame instead of
+ * decoding from the start.
+ *
+ * Binary container, all fields little-endian:
+ *   "VSIX"  uint32 version  uint32 frameCount  uint32 entryCount
+ *   entryCount x { uint32 frame  uint64 bitOffset }
+ */
+class SeekIndex {
+public:
+    struct Entry {
+        uint32_t frame;
+        uint64_t bitOffset;
+    };
+
+private:
+    static constexpr char MAGIC[4] = {'V', 'S', 'I', 'X'};
+    static constexpr uint32_t VERSION = 1;
+
+    vector<Entry> entries;
+    uint32_t frameCount = 0;
+
+    static void writeValue(ofstream& file, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            file.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+        }
+    }
+
+    static uint64_t readValue(ifstream& file, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            int byte = file.get();
+            if (byte == EOF) {
+                throw runtime_error("Truncated seek index");
+            }
+            value |= static_cast<uint64_t>(byte) << (8 * i);
+        }
+        return value;
+    }
+
+public:
+    // Record the start of an I-frame; frames must be added in order
+    void addIFrame(int frame, uint64_t bitOffset) {
+        entries.push_back({static_cast<uint32_t>(frame), bitOffset});
+    }
+
+    void setFrameCount(int count) { frameCount = static_cast<uint32_t>(count); }
+    int getFrameCount() const { return static_cast<int>(frameCount); }
+    const vector<Entry>& getEntries() const { return entries; }
+
+    // Last I-frame at or before `frame`
+    const Entry& seekPoint(int frame) const {
+        auto it = upper_bound(entries.begin(), entries.end(), static_cast<uint32_t>(frame),
+                              [](uint32_t f, const Entry& entry) { return f < entry.frame; });
+        if (it == entries.begin()) {
+            throw runtime_error("No I-frame before frame " + to_string(frame));
+        }
+        return *(it - 1);
+    }
+
+    void write(const string& path) const {
+        ofstream file(path, ios::binary);
+        if (!file) {
+            throw runtime_error("Could not create seek index: " + path);
+        }
+        file.write(MAGIC, sizeof(MAGIC));
+        writeValue(file, VERSION, 4);
+        writeValue(file, frameCount, 4);
+        writeValue(file, entries.size(), 4);
+        for (const Entry& entry : entries) {
+            writeValue(file, entry.frame, 4);
+            writeValue(file, entry.bitOffset, 8);
+        }
+    }
+
+    static SeekIndex read(const string& path) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            throw runtime_error("Could not open seek index: " + path);
+        }
+        char magic[4];
+        if (!file.read(magic, sizeof(magic)) || !equal(magic, magic + 4, MAGIC)) {
+            throw runtime_error("Not a seek index: " + path);
+        }
+        if (readValue(file, 4) != VERSION) {
+            throw runtime_error("Unsupported seek index version");
+        }
+        SeekIndex index;
+        index.frameCount = static_cast<uint32_t>(readValue(file, 4));
+        uint32_t count = static_cast<uint32_t>(readValue(file, 4));
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t frame = static_cast<uint32_t>(readValue(file, 4));
+            uint64_t bitOffset = readValue(file, 8);
+            if (!index.entries.empty() && frame <= index.entries.back().frame) {
+                throw runtime_error("Seek index entries out of order");
+            }
+            index.entries.push_back({frame, bitOffset});
+        }
+        return index;
+    }
+};
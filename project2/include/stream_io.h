@@ -0,0 +1,39 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+/*
+ * Y4M input and output of the video codecs: a path, or "-" for the
+ * standard streams so the codecs sit in pipelines such as
+ *   ffmpeg -i in.mp4 -f yuv4mpegpipe - | main encode ... -i - -o out
+ * Nothing on these streams is ever sought, and codecs log to stderr only.
+ */
+const string STANDARD_STREAM = "-";
+
+// `file` is opened (and owned by the caller) unless path is "-"
+inline istream& openInput(const string& path, ifstream& file) {
+    if (path == STANDARD_STREAM) {
+        return cin;
+    }
+    file.open(path, ios::binary);
+    if (!file) {
+        throw runtime_error("Could not open input file: " + path);
+    }
+    return file;
+}
+
+inline ostream& openOutput(const string& path, ofstream& file) {
+    if (path == STANDARD_STREAM) {
+        return cout;
+    }
+    file.open(path, ios::binary);
+    if (!file) {
+        throw runtime_error("Could not open output file: " + path);
+    }
+    return file;
+}
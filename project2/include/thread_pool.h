@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Work-stealing thread pool shared by all the codecs.
+ * Every worker owns a deque: it pops its own tasks from the back and, when it
+ * runs dry, steals from the front of the other workers' deques. The thread that
+ * waits on a parallel loop also works on it, so nested loops never deadlock.
+ */
+class ThreadPool {
+private:
+    struct WorkQueue {
+        deque<function<void()>> tasks;
+        mutex lock;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> nextQueue{0};
+    atomic<int> queued{0};
+    atomic<bool> stopping{false};
+    mutex sleepLock;
+    condition_variable wakeUp;
+
+    // Index of the worker running on this thread (-1 outside the pool)
+    static inline thread_local int workerIndex = -1;
+
+    bool popTask(size_t index, function<void()>& task) {
+        WorkQueue& queue = *queues[index];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool stealTask(size_t thief, function<void()>& task) {
+        for (size_t i = 1; i <= queues.size(); ++i) {
+            WorkQueue& queue = *queues[(thief + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) continue;
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    // Run one pending task on the calling thread, if there is any
+    bool runPendingTask() {
+        if (queues.empty()) return false;
+        function<void()> task;
+        size_t home = workerIndex >= 0 ? workerIndex : 0;
+        if ((workerIndex >= 0 && popTask(home, task)) || stealTask(home, task)) {
+            queued--;
+            task();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        workerIndex = index;
+        while (true) {
+            if (runPendingTask()) continue;
+
+            unique_lock<mutex> guard(sleepLock);
+            wakeUp.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) return;
+        }
+    }
+
+public:
+    // The calling thread takes part in every loop, so one worker less is enough
+    explicit ThreadPool(unsigned threads = max(1u, thread::hardware_concurrency()) - 1) {
+        for (unsigned i = 0; i < threads; ++i) {
+            queues.push_back(make_unique<WorkQueue>());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Pool used by the codecs, sized to the machine
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Number of threads that work on a parallel loop (workers + caller)
+    size_t concurrency() const { return workers.size() + 1; }
+
+    void submit(function<void()> task) {
+        if (workers.empty()) {
+            task();
+            return;
+        }
+        // Workers push to their own deque, other threads spread the tasks around
+        size_t index = workerIndex >= 0 ? workerIndex : nextQueue++ % queues.size();
+        {
+            lock_guard<mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            queued++;
+        }
+        wakeUp.notify_one();
+    }
+
+    /*
+     * Run body(i) for every i in [begin, end) and wait for all of them.
+     * Indices are claimed in increasing order, which wavefront() relies on.
+     */
+    void parallelFor(int begin, int end, const function<void(int)>& body) {
+        if (end <= begin) return;
+
+        struct LoopState {
+            atomic<int> next;
+            atomic<int> done{0};
+            mutex errorLock;
+            exception_ptr error;
+        };
+        auto state = make_shared<LoopState>();
+        state->next = begin;
+        int count = end - begin;
+
+        auto runLoop = [state, end, &body] {
+            int i;
+            while ((i = state->next++) < end) {
+                try {
+                    body(i);
+                } catch (...) {
+                    lock_guard<mutex> guard(state->errorLock);
+                    if (!state->error) state->error = current_exception();
+                }
+                state->done++;
+            }
+        };
+
+        int helpers = static_cast<int>(min<size_t>(workers.size(), count - 1));
+        for (int h = 0; h < helpers; ++h) {
+            submit(runLoop);
+        }
+        runLoop();
+
+        // Help with other work (e.g. nested loops) until the stragglers finish
+        while (state->done < count) {
+            if (!runPendingTask()) this_thread::yield();
+        }
+        if (state->error) rethrow_exception(state->error);
+    }
+
+    /*
+     * Run body(row, col) over a rows x cols grid in wavefront order: a cell
+     * only starts once its left and top-right neighbours are done, which
+     * covers dependencies on the left, top-left, top and top-right cells.
+     */
+    void wavefront(int rows, int cols, const function<void(int, int)>& body) {
+        if (rows <= 0 || cols <= 0) return;
+
+        vector<atomic<int>> progress(rows);
+        for (auto& p : progress) p = 0;
+
+        parallelFor(0, rows, [&](int row) {
+            try {
+                for (int col = 0; col < cols; ++col) {
+                    if (row > 0) {
+                        int needed = min(col + 2, cols);
+                        while (progress[row - 1].load(memory_order_acquire) < needed) {
+                            this_thread::yield();
+                        }
+                    }
+                    body(row, col);
+                    progress[row].store(col + 1, memory_order_release);
+                }
+            } catch (...) {
+                // Release the rows below so the loop can finish and rethrow
+                progress[row].store(cols, memory_order_release);
+                throw;
+            }
+        });
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <memory>
+#include "entropy_backend.h"
+#include "inter_frame_video_codec.h"
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Frame-by-frame interface to the lossless inter codec for live use: one
+ * frame in, one packet out, and back. A packet is the frame's syntax as in
+ * the .bin stream, byte-aligned, with no file I/O on the way. Reference
+ * planes, per-plane buffers and the packet buffer live in the objects and
+ * are reused, so steady-state frames don't reallocate them.
+ *
+ * Frames are three CV_8UC1 planes, CV_16UC1 above 8 bits, Y then U and V
+ * at the chroma format's size. Encoder and decoder must be built with the
+ * same m, dimensions, block size, format, bit depth and entropy coder. The arithmetic coder's statistics
+ * carry over from packet to packet within a GOP, so a decoder can only
+ * join at an I-frame and must not miss packets after it.
+ */
+class VideoEncoder : private InterFrameVideoCodec {
+private:
+    vector<uint8_t> packet;  // declared before the coder writing into it
+    unique_ptr<EntropyCoder> coder;
+    FrameSyntax syntax;
+    vector<Mat> referencePlanes;  // copy of the last frame, the next P-frame's reference
+    int frameIndex = 0;           // position in the current GOP
+
+public:
+    VideoEncoder(int m, int width, int height, int iFrameInterval, int blockSize, int searchRange,
+                 int sourceFormat = 420, EntropyBackend backend = EntropyBackend::Rice, int bitDepth = 8)
+        : InterFrameVideoCodec(m, 0, 0, iFrameInterval, blockSize, searchRange) {
+        if (iFrameInterval <= 0) {
+            throw invalid_argument("I-frame interval must be positive");
+        }
+        if (bitDepth < 8 || bitDepth > 16) {
+            throw invalid_argument("Bit depth must be 8 to 16");
+        }
+        this->width = width;
+        this->height = height;
+        this->sourceFormat = sourceFormat;
+        this->bitDepth = bitDepth;
+        validateDimensions();
+        coder = makeEntropyCoder(backend, golombParameter(), false, packet);
+    }
+
+    // Encode the next frame; the packet is valid until the next call
+    const vector<uint8_t>& pushFrame(const vector<Mat>& planes) {
+        if (planes.size() != 3) {
+            throw invalid_argument("A frame has 3 planes");
+        }
+        for (int i = 0; i < 3; ++i) {
+            if (planes[i].type() != planeType() || planes[i].size() != planeSize(i)) {
+                throw invalid_argument("Plane " + to_string(i) + " doesn't match the stream format");
+            }
+        }
+
+        bool isIFrame = frameIndex == 0;
+        packet.clear();
+        encodeFrame(planes, referencePlanes, isIFrame, syntax, *coder);
+        coder->flush();
+
+        // Lossless: the decoder's reference is this frame exactly
+        referencePlanes.resize(3);
+        for (int i = 0; i < 3; ++i) {
+            planes[i].copyTo(referencePlanes[i]);
+        }
+        frameIndex = (frameIndex + 1) % iFrameInterval;
+        return packet;
+    }
+
+    // Whether the last packet is an I-frame, where a decoder can join the stream
+    bool lastWasIFrame() const { return syntax.isIFrame; }
+
+    // Start a new GOP at the next frame, e.g. when a receiver joins
+    void requestIFrame() { frameIndex = 0; }
+};
+
+class VideoDecoder : private InterFrameVideoCodec {
+private:
+    vector<uint8_t> packet;
+    unique_ptr<EntropyCoder> coder;
+    FrameSyntax syntax;
+    vector<Mat> frames[2];  // the last frame and the one before it, written in turn
+    int current = 0;
+
+public:
+    VideoDecoder(int m, int width, int height, int blockSize, int sourceFormat = 420,
+                 EntropyBackend backend = EntropyBackend::Rice, int bitDepth = 8)
+        : InterFrameVideoCodec(m, 0, 0, 1, blockSize, 0) {
+        if (bitDepth < 8 || bitDepth > 16) {
+            throw invalid_argument("Bit depth must be 8 to 16");
+        }
+        this->width = width;
+        this->height = height;
+        this->sourceFormat = sourceFormat;
+        this->bitDepth = bitDepth;
+        validateDimensions();
+        coder = makeEntropyCoder(backend, golombParameter(), true, packet);
+    }
+
+    /*
+     * Decode one packet from VideoEncoder::pushFrame. The frame returned
+     * stays valid until the next call but one, its buffers are then reused.
+     */
+    const vector<Mat>& pushPacket(const uint8_t* data, size_t size) {
+        packet.assign(data, data + size);
+        coder->seekToBit(0);
+        if (!parseFrame(*coder, syntax)) {
+            throw runtime_error("Packet holds no frame");
+        }
+        int next = 1 - current;
+        reconstructFrame(syntax, frames[current], frames[next]);
+        current = next;
+        return frames[current];
+    }
+
+    const vector<Mat>& pushPacket(const vector<uint8_t>& data) {
+        return pushPacket(data.data(), data.size());
+    }
+};
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "../include/audio_block_codec.h"
+
+using namespace std;
+
+// AudioBlockCodec round trips: every stereo mode, a partial last block, more
+// blocks than one streaming chunk, and decodes of frame ranges
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        printf("FAILED %s\n", what.c_str());
+        failures++;
+    }
+}
+
+static const int BLOCK_FRAMES = 1024;
+
+/*
+ * Block b of the stereo signal is built from two independent sources a and
+ * b so that stereo mode b % 4 codes it best: left/right, left/side,
+ * side/right and mid/side are in turn the pair of independent signals.
+ */
+static vector<int32_t> makeStereo(mt19937& rng, int frames, int sampleBits) {
+    const double peak = ldexp(1.0, sampleBits - 1) - 1;
+    normal_distribution<double> noise(0, peak / 256);
+    vector<int32_t> samples(2 * static_cast<size_t>(frames));
+    double phase = 0;
+    for (int i = 0; i < frames; ++i) {
+        phase += 0.03;
+        double a = peak / 8 * sin(phase) + noise(rng);
+        double b = noise(rng);
+        double left, right;
+        switch ((i / BLOCK_FRAMES) % 4) {
+            case 0: left = a; right = 4 * b; break;       // independent, one much louder
+            case 1: left = a; right = a - b; break;       // side = b
+            case 2: left = a + b; right = a; break;       // side = b
+            default: left = a + b / 2; right = a - b / 2; // mid = a, side = b
+        }
+        samples[2 * i] = static_cast<int32_t>(max(-peak - 1, min(peak, round(left))));
+        samples[2 * i + 1] = static_cast<int32_t>(max(-peak - 1, min(peak, round(right))));
+    }
+    return samples;
+}
+
+static vector<int32_t> makeChannels(mt19937& rng, int frames, int channels, int sampleBits) {
+    const double peak = ldexp(1.0, sampleBits - 1) - 1;
+    uniform_real_distribution<double> noise(-peak / 32, peak / 32);
+    vector<int32_t> samples(static_cast<size_t>(frames) * channels);
+    for (int i = 0; i < frames; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            double v = peak / 2 * sin(0.01 * (c + 1) * i) + noise(rng);
+            samples[static_cast<size_t>(i) * channels + c] = static_cast<int32_t>(round(v));
+        }
+    }
+    return samples;
+}
+
+// The stereo mode byte that starts each block
+static vector<int> stereoModes(const string& stream) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(stream.data());
+    auto value = [&](size_t at, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= uint64_t(data[at + i]) << (8 * i);
+        return v;
+    };
+    int blocks = static_cast<int>(value(4, 4));
+    size_t dataStart = 8 + 8 * static_cast<size_t>(blocks);
+    vector<int> modes;
+    for (int b = 0; b < blocks; ++b) {
+        modes.push_back(data[dataStart + value(8 + 8 * b, 8)]);
+    }
+    return modes;
+}
+
+static vector<int32_t> decodeRange(const AudioBlockCodec& codec, const string& stream, int frames, int channels,
+                                   int first, int count) {
+    istringstream in(stream);
+    vector<int32_t> out;
+    codec.decode(in, frames, channels, [&](const int32_t* decoded, int n) {
+        out.insert(out.end(), decoded, decoded + static_cast<size_t>(n) * channels);
+    }, first, count);
+    return out;
+}
+
+static void testRoundTrip(const string& name, const AudioBlockCodec& codec, const vector<int32_t>& samples,
+                          int frames, int channels, bool expectAllModes) {
+    printf("Testing %s\n", name.c_str());
+    ostringstream out;
+    size_t position = 0;
+    codec.encode([&](int32_t* buffer, int count) {
+        // Short reads, as from a chunked file reader
+        count = min(count, 1000);
+        copy(samples.begin() + position, samples.begin() + position + static_cast<size_t>(count) * channels, buffer);
+        position += static_cast<size_t>(count) * channels;
+        return count;
+    }, frames, channels, out);
+    string stream = out.str();
+
+    check(decodeRange(codec, stream, frames, channels, 0, -1) == samples, name + ": full decode");
+
+    // Ranges inside one block, across blocks and chunks, and into the partial last block
+    const int ranges[][2] = {{0, 1}, {100, 200}, {BLOCK_FRAMES - 3, 7}, {1500, 17 * BLOCK_FRAMES},
+                             {frames - 5, 5}, {frames - BLOCK_FRAMES - 10, BLOCK_FRAMES + 10}, {frames, 0}};
+    for (const auto& range : ranges) {
+        vector<int32_t> expected(samples.begin() + static_cast<size_t>(range[0]) * channels,
+                                 samples.begin() + static_cast<size_t>(range[0] + range[1]) * channels);
+        check(decodeRange(codec, stream, frames, channels, range[0], range[1]) == expected,
+              name + ": frames " + to_string(range[0]) + " + " + to_string(range[1]));
+    }
+
+    if (expectAllModes) {
+        vector<int> modes = stereoModes(stream);
+        for (int m = 0; m < static_cast<int>(AudioBlockCodec::StereoMode::Count); ++m) {
+            check(find(modes.begin(), modes.end(), m) != modes.end(), name + ": stereo mode " + to_string(m) + " used");
+        }
+    }
+}
+
+int main() {
+    mt19937 rng(99);
+    // More blocks than a streaming chunk, and a partial last block
+    const int frames = 20 * BLOCK_FRAMES + 337;
+
+    for (EntropyBackend backend : {EntropyBackend::Rice, EntropyBackend::Arithmetic, EntropyBackend::Rans}) {
+        string coder = entropyBackendName(backend);
+        for (int sampleBits : {16, 24}) {
+            vector<int32_t> stereo = makeStereo(rng, frames, sampleBits);
+            for (int order : {0, 4, 32}) {
+                AudioBlockCodec codec(order, 0, backend, sampleBits, BLOCK_FRAMES);
+                testRoundTrip(coder + " stereo " + to_string(sampleBits) + "-bit order " + to_string(order),
+                              codec, stereo, frames, 2, order > 0);
+            }
+        }
+
+        // Mono and multichannel take the per-channel path
+        for (int channels : {1, 3}) {
+            vector<int32_t> samples = makeChannels(rng, frames, channels, 16);
+            AudioBlockCodec codec(8, 0, backend, 16, BLOCK_FRAMES);
+            testRoundTrip(coder + " " + to_string(channels) + " channels", codec, samples, frames, channels, false);
+        }
+    }
+
+    // A fixed Rice parameter is still lossless
+    vector<int32_t> stereo = makeStereo(rng, frames, 16);
+    testRoundTrip("fixed Rice parameter", AudioBlockCodec(8, 64, EntropyBackend::Rice, 16, BLOCK_FRAMES),
+                  stereo, frames, 2, false);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("Passed audio block codec round trips\n");
+    return 0;
+}
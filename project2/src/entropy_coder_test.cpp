@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <random>
+#include <vector>
+#include "../include/entropy_backend.h"
+
+using namespace std;
+
+// Encode / decode round trips of the arithmetic and rANS coders across sync()
+// segments, decoded both in one pass and by seeking to segment starts
+static int failures = 0;
+
+static void check(bool ok, const char* what, EntropyBackend backend, int segment) {
+    if (!ok) {
+        printf("FAILED %s (%s, segment %d)\n", what, entropyBackendName(backend).c_str(), segment);
+        failures++;
+    }
+}
+
+struct Symbol {
+    int value;
+    SyntaxElement element;
+};
+
+// Segments of varying length and statistics: zero runs, small residuals,
+// rare large values and both signs, spread over the syntax elements. The
+// longest one spans several of the rANS coder's internal segments
+static vector<vector<Symbol>> makeSegments(mt19937& rng) {
+    const SyntaxElement elements[] = {SyntaxElement::Header, SyntaxElement::Flag, SyntaxElement::IntraMode,
+                                      SyntaxElement::MotionVector, SyntaxElement::Residual,
+                                      SyntaxElement::Level, SyntaxElement::Run};
+    const int lengths[] = {1, 7, 300, 0, 5000, 2, 40000, 150000};
+    geometric_distribution<int> small(0.3);
+    uniform_int_distribution<int> large(-(1 << 24), 1 << 24);
+    uniform_int_distribution<int> pick(0, 99);
+
+    vector<vector<Symbol>> segments;
+    for (int length : lengths) {
+        vector<Symbol> segment;
+        for (int i = 0; i < length; ++i) {
+            int kind = pick(rng);
+            int value = kind < 40 ? 0 : kind < 97 ? small(rng) : large(rng);
+            if (pick(rng) < 50) value = -value;
+            segment.push_back({value, elements[(i / 16) % 7]});
+        }
+        segments.push_back(segment);
+    }
+    return segments;
+}
+
+static void testBackend(EntropyBackend backend, const vector<vector<Symbol>>& segments) {
+    printf("Testing %s coder\n", entropyBackendName(backend).c_str());
+    vector<uint8_t> buffer;
+    vector<uint64_t> starts;
+
+    // Every segment starts from fresh statistics so it decodes on its own;
+    // the extra sync() calls must be no-ops
+    unique_ptr<EntropyCoder> encoder = makeEntropyCoder(backend, 4, false, buffer);
+    for (const vector<Symbol>& segment : segments) {
+        encoder->sync();
+        encoder->resetContexts();
+        starts.push_back(encoder->bitsWritten());
+        for (const Symbol& s : segment) {
+            encoder->encode(s.value, s.element);
+        }
+        encoder->sync();
+    }
+    encoder->end();
+
+    // One pass
+    unique_ptr<EntropyCoder> decoder = makeEntropyCoder(backend, 4, true, buffer);
+    for (size_t k = 0; k < segments.size(); ++k) {
+        decoder->sync();
+        decoder->resetContexts();
+        bool ok = true;
+        for (const Symbol& s : segments[k]) {
+            ok &= decoder->decode_val(s.element) == s.value;
+        }
+        check(ok, "sequential decode", backend, static_cast<int>(k));
+        decoder->sync();
+    }
+
+    // Seeking to the segment starts in reverse, decoding part of some of them
+    decoder = makeEntropyCoder(backend, 4, true, buffer);
+    for (size_t k = segments.size(); k-- > 0;) {
+        decoder->seekToBit(starts[k]);
+        decoder->resetContexts();
+        size_t count = (k % 2) ? segments[k].size() / 2 : segments[k].size();
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            ok &= decoder->decode_val(segments[k][i].element) == segments[k][i].value;
+        }
+        check(ok, "decode after seekToBit", backend, static_cast<int>(k));
+    }
+}
+
+int main() {
+    mt19937 rng(2024);
+    vector<vector<Symbol>> segments = makeSegments(rng);
+
+    testBackend(EntropyBackend::Arithmetic, segments);
+    testBackend(EntropyBackend::Rans, segments);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("Passed entropy coder round trips\n");
+    return 0;
+}
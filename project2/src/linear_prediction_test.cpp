@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "../include/linear_prediction.h"
+
+using namespace std;
+
+// LinearPrediction::residuals / restore round trips at the sample widths of
+// a 16-bit channel, its side signal and a 24-bit side signal, checked
+// against a plain int64 prediction
+static int failures = 0;
+
+static void check(bool ok, const char* what, int sampleBits, int order, int precision) {
+    if (!ok) {
+        printf("FAILED %s (%d bits, order %d, precision %d)\n", what, sampleBits, order, precision);
+        failures++;
+    }
+}
+
+// Resonant noise plus full-scale steps, clipped to the sample range
+static vector<int> makeSignal(mt19937& rng, int n, int sampleBits) {
+    const double peak = ldexp(1.0, sampleBits - 1) - 1;
+    normal_distribution<double> noise(0, peak / 64);
+    vector<int> x(n);
+    double y1 = 0, y2 = 0;
+    for (int i = 0; i < n; ++i) {
+        double y = 1.8 * y1 - 0.9 * y2 + noise(rng);
+        y2 = y1;
+        y1 = y;
+        double v = (i / 512) % 4 == 3 ? ((i / 7) % 2 ? peak : -peak - 1) : y;
+        x[i] = static_cast<int>(max(-peak - 1, min(peak, round(v))));
+    }
+    return x;
+}
+
+int main() {
+    mt19937 rng(7);
+    const int N = 4096;
+
+    for (int sampleBits : {16, 17, 25}) {
+        printf("Testing %d-bit prediction\n", sampleBits);
+        vector<int> x = makeSignal(rng, N, sampleBits);
+
+        vector<double> windowed;
+        double r[LinearPrediction::MAX_ORDER + 1];
+        double lp[LinearPrediction::MAX_ORDER][LinearPrediction::MAX_ORDER];
+        double errors[LinearPrediction::MAX_ORDER];
+        LinearPrediction::autocorrelation(x.data(), N, LinearPrediction::MAX_ORDER, windowed, r);
+        int reached = LinearPrediction::levinsonDurbin(r, LinearPrediction::MAX_ORDER, lp, errors);
+        if (reached < LinearPrediction::MAX_ORDER) {
+            printf("FAILED Levinson-Durbin stopped at order %d\n", reached);
+            failures++;
+            continue;
+        }
+
+        for (int order : {1, 2, 3, 4, 5, 8, 12, 31, 32}) {
+            for (int precision : {8, 12, LinearPrediction::MAX_PRECISION}) {
+                LinearPrediction::Coefficients q = LinearPrediction::quantize(lp[order - 1], order, precision);
+
+                vector<int> residuals(N);
+                LinearPrediction::residuals(x.data(), N, q, sampleBits, residuals.data());
+                bool exact = true;
+                for (int i = order; i < N; ++i) {
+                    int64_t sum = 0;
+                    for (int j = 0; j < order; ++j) sum += int64_t(q.values[j]) * x[i - 1 - j];
+                    exact &= residuals[i] == x[i] - static_cast<int>(sum >> q.shift);
+                }
+                check(exact, "residuals vs int64 prediction", sampleBits, order, precision);
+
+                vector<int> restored(x.begin(), x.begin() + order);
+                restored.insert(restored.end(), residuals.begin() + order, residuals.end());
+                LinearPrediction::restore(restored.data(), N, q, sampleBits);
+                check(restored == x, "restore", sampleBits, order, precision);
+            }
+        }
+    }
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("Passed linear prediction round trips\n");
+    return 0;
+}
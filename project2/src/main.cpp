@@ -3,6 +3,7 @@
 #include "../include/inter_frame_video_codec.h"
 #include "../include/lossy_inter_video_codec.h"
 #include "../include/compare.h"
+#include "../include/cxxopts.hpp"
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <string>
@@ -14,7 +15,7 @@ using namespace std;
 namespace fs = std::filesystem;
 
 void handleImage(const string &imagePath, int m) {
-    Mat image = imread(imagePath, IMREAD_COLOR); // Load the image
+    Mat image = imread(imagePath, IMREAD_ANYDEPTH | IMREAD_ANYCOLOR); // Load the image, keeping 16-bit samples
     if (image.empty()) {
         cerr << "Failed to load image: " << imagePath << endl;
         return;
@@ -33,8 +34,10 @@ void handleImage(const string &imagePath, int m) {
     // Calculate and display MSE/PSNR
     Mat diff;
     absdiff(image, decodedImage, diff);
+    diff.convertTo(diff, CV_64F);
     double mse = mean(diff.mul(diff))[0];
-    double psnr = 10 * log10((255 * 255) / mse);
+    double peak = (image.depth() == CV_16U) ? 65535 : 255;
+    double psnr = 10 * log10((peak * peak) / mse);
 
     cout << "MSE: " << mse << endl;
     cout << "PSNR: " << psnr << " dB" << endl;
@@ -43,7 +46,7 @@ void handleImage(const string &imagePath, int m) {
 }
 
 void handleImageCompression(const string &imagePath, const string &outputPath, int m) {
-    Mat image = imread(imagePath, IMREAD_COLOR); // Load the image
+    Mat image = imread(imagePath, IMREAD_ANYDEPTH | IMREAD_ANYCOLOR); // Load the image, keeping 16-bit samples
     if (image.empty()) {
         cerr << "Failed to load image: " << imagePath << endl;
         return;
@@ -109,13 +112,18 @@ void handleInterFrameVideoCompression (const string &videoPath, const string &ou
     }
 }
 
-void handleInterLossyFrameVideoCompression(const string &videoPath, const string &outputPath, int m, int width, int height, int iFrameInterval, int blockSize, int searchRange, int quantizationLevel) {
+void handleInterLossyFrameVideoCompression(const string &videoPath, const string &outputPath, int m, int width, int height, int iFrameInterval, int blockSize, int searchRange, int quantizationLevel, int transformSize, int rateMode, double targetKbps) {
     try {
         cout << "Starting video compression..." << endl;
         cout << "Parameters: " << iFrameInterval << " I-frame interval, " << blockSize << " block size, " << searchRange << " search range" << endl;
         
         // Fix constructor call order to match the class definition
-        InterFrameVideoLossyCodec codec(m, width, height, iFrameInterval, blockSize, searchRange, quantizationLevel);
+        InterFrameVideoLossyCodec codec(m, width, height, iFrameInterval, blockSize, searchRange, quantizationLevel, transformSize);
+        if (rateMode == 1) {
+            codec.setTargetBitrate(targetKbps * 1000);
+        } else if (rateMode == 2) {
+            codec.setConstantQuality(quantizationLevel);
+        }
 
         // Encode the video
         cout << "Encoding video..." << endl;
@@ -192,6 +200,29 @@ void analyzeImagePredictors(const string& imagePath) {
 //     cout << "Compressed video saved to: " << outputPath << endl;
 // }
 
+// Decode part of an encoded stream through its seek index
+template<typename Codec>
+void handleFrameRangeDecode(Codec &codec, const string &outputPath) {
+    cout << "Decode a frame range? (y/n): ";
+    char answer;
+    cin >> answer;
+    if (answer != 'y' && answer != 'Y') {
+        return;
+    }
+    int first, last;
+    cout << "Enter first frame: ";
+    cin >> first;
+    cout << "Enter last frame: ";
+    cin >> last;
+    try {
+        string rangePath = outputPath + "_frames_" + to_string(first) + "_" + to_string(last) + ".y4m";
+        codec.decodeRange(outputPath, rangePath, first, last);
+        cout << "Frames saved to: " << rangePath << endl;
+    } catch (const exception& e) {
+        cerr << "Error during range decoding: " << e.what() << endl;
+    }
+}
+
 void displayMenu() {
     cout << "Select mode:" << endl;
     cout << "1. Image Compression" << endl;
@@ -267,13 +298,15 @@ void handleChoice(int choice) {
             handleInterFrameVideoCompression(inputPath, outputPath, m, width, height, iFrameInterval, blockSize, searchRange, "420");
             Compare compare;
             compare.compareFiles(inputPath, outputPath + "_decoded.y4m");
+            InterFrameVideoCodec rangeCodec(m, width, height, iFrameInterval, blockSize, searchRange);
+            handleFrameRangeDecode(rangeCodec, outputPath);
             break;
         }
         case 4: {
             inputPath = chooseFile("../videos");
             fs::path inputFilePath(inputPath);
             string outputPath = (inputFilePath.parent_path() / ("encoded_lossy_" + inputFilePath.stem().string())).string();
-            int width, height, frameCount, iFrameInterval, blockSize, searchRange, quantizationLevel;
+            int width, height, frameCount, iFrameInterval, blockSize, searchRange, quantizationLevel, transformSize;
             cout << "Enter width: ";
             cin >> width;
             cout << "Enter height: ";
@@ -286,9 +319,21 @@ void handleChoice(int choice) {
             cin >> searchRange;
             cout << "Enter quantization level: ";
             cin >> quantizationLevel;
-            handleInterLossyFrameVideoCompression(inputPath, outputPath, m, width, height, iFrameInterval, blockSize, searchRange, quantizationLevel);
+            cout << "Enter transform size (0 = none, 4 or 8): ";
+            cin >> transformSize;
+            int rateMode;
+            double targetKbps = 0;
+            cout << "Rate control (0 = constant step, 1 = target bitrate, 2 = constant quality): ";
+            cin >> rateMode;
+            if (rateMode == 1) {
+                cout << "Enter target bitrate (kbps): ";
+                cin >> targetKbps;
+            }
+            handleInterLossyFrameVideoCompression(inputPath, outputPath, m, width, height, iFrameInterval, blockSize, searchRange, quantizationLevel, transformSize, rateMode, targetKbps);
             Compare compare;
             compare.compareFiles(inputPath, outputPath + "_decoded.y4m");
+            InterFrameVideoLossyCodec rangeCodec(m, width, height, iFrameInterval, blockSize, searchRange, quantizationLevel, transformSize);
+            handleFrameRangeDecode(rangeCodec, outputPath);
             break;
         }
         case 5:
@@ -300,7 +345,92 @@ void handleChoice(int choice) {
     }
 }
 
-int main() {
+/*
+ * Non-interactive video coding for pipelines; "-" reads or writes the
+ * standard streams and every log goes to stderr, e.g.
+ *   ffmpeg -i in.mp4 -f yuv4mpegpipe - | ./main encode --codec inter -i - -o encoded
+ *   ./main decode --codec inter -i encoded -o - | ffplay -
+ */
+int runVideoCommand(int argc, char* argv[]) {
+    cxxopts::Options options("main", "Video encode / decode");
+    options.add_options()
+        ("command", "encode or decode", cxxopts::value<string>())
+        ("c,codec", "intra, inter or lossy", cxxopts::value<string>()->default_value("inter"))
+        ("i,input", "Y4M input (encode) or encoded stream (decode), - for stdin", cxxopts::value<string>())
+        ("o,output", "Encoded stream (encode) or Y4M output (decode), - for stdout", cxxopts::value<string>())
+        ("m,golomb", "Golomb parameter", cxxopts::value<int>()->default_value("4"))
+        ("e,entropy", "Entropy coder: rice, arithmetic or rans (encode; decode reads it from the stream)",
+         cxxopts::value<string>()->default_value("rice"))
+        ("iframe-interval", "I-frame interval", cxxopts::value<int>()->default_value("10"))
+        ("block-size", "Block size", cxxopts::value<int>()->default_value("16"))
+        ("search-range", "Motion search range", cxxopts::value<int>()->default_value("16"))
+        ("q,quantization", "Quantization step (lossy)", cxxopts::value<int>()->default_value("8"))
+        ("transform", "Transform size, 0, 4 or 8 (lossy)", cxxopts::value<int>()->default_value("8"))
+        ("bitrate", "Target bitrate in kbps, 0 for a constant step (lossy)", cxxopts::value<double>()->default_value("0"))
+        ("quality", "Constant quality: the step at typical complexity, adapted per frame, 0 for a constant step (lossy)",
+         cxxopts::value<int>()->default_value("0"))
+        ("h,help", "Print usage");
+    options.parse_positional({"command"});
+    options.positional_help("encode|decode");
+
+    try {
+        auto args = options.parse(argc, argv);
+        if (args.count("help") || !args.count("command") || !args.count("input") || !args.count("output")) {
+            cerr << options.help() << endl;
+            return args.count("help") ? 0 : 1;
+        }
+        string command = args["command"].as<string>();
+        if (command != "encode" && command != "decode") {
+            throw invalid_argument("Unknown command: " + command);
+        }
+        bool encoding = command == "encode";
+        string input = args["input"].as<string>();
+        string output = args["output"].as<string>();
+        if ((encoding && output == STANDARD_STREAM) || (!encoding && input == STANDARD_STREAM)) {
+            throw invalid_argument("Encoded streams are files (.bin, .meta, .idx), not standard streams");
+        }
+
+        // Unbuffered C stdio sync costs a lot on multi-gigabyte Y4M pipes
+        ios::sync_with_stdio(false);
+
+        string codecName = args["codec"].as<string>();
+        int m = args["golomb"].as<int>();
+        EntropyBackend backend = parseEntropyBackend(args["entropy"].as<string>());
+        // Dimensions come from the Y4M header (encode) or the metadata (decode)
+        if (codecName == "intra") {
+            IntraFrameVideoCodec codec(m);
+            codec.setEntropyBackend(backend);
+            encoding ? codec.encode(input, output) : codec.decode(input, output);
+        } else if (codecName == "inter") {
+            InterFrameVideoCodec codec(m, 0, 0, args["iframe-interval"].as<int>(),
+                                       args["block-size"].as<int>(), args["search-range"].as<int>());
+            codec.setEntropyBackend(backend);
+            encoding ? codec.encode(input, output) : codec.decode(input, output);
+        } else if (codecName == "lossy") {
+            InterFrameVideoLossyCodec codec(m, 0, 0, args["iframe-interval"].as<int>(),
+                                            args["block-size"].as<int>(), args["search-range"].as<int>(),
+                                            args["quantization"].as<int>(), args["transform"].as<int>());
+            if (args["bitrate"].as<double>() > 0) {
+                codec.setTargetBitrate(args["bitrate"].as<double>() * 1000);
+            } else if (args["quality"].as<int>() > 0) {
+                codec.setConstantQuality(args["quality"].as<int>());
+            }
+            codec.setEntropyBackend(backend);
+            encoding ? codec.encode(input, output) : codec.decode(input, output);
+        } else {
+            throw invalid_argument("Unknown codec: " + codecName);
+        }
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return runVideoCommand(argc, argv);
+    }
 
     while (true) {
         int choice;
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "../include/integer_transform.h"
+
+using namespace std;
+
+// Round trip of the integer transform: forward -> quantize -> dequantize ->
+// inverse, with the SSE2 transforms checked against the scalar ones
+static int failures = 0;
+
+static void check(bool ok, const char* what, int size, int bitDepth, double step) {
+    if (!ok) {
+        printf("FAILED %s (size %d, %d bits, step %g)\n", what, size, bitDepth, step);
+        failures++;
+    }
+}
+
+int main() {
+    mt19937 rng(12345);
+    const int BLOCKS = 2000;
+
+    for (int size : {4, 8}) {
+        for (int bitDepth : {8, 10}) {
+            IntegerTransform transform(size, bitDepth);
+            const int area = transform.area();
+            const int range = (1 << bitDepth) - 1;
+            uniform_int_distribution<int> residual(-range, range);
+
+            vector<int> block(area), coeffs(area), reference(area);
+            vector<int> levels(area), dequantized(area), decoded(area), decodedReference(area);
+
+            printf("Testing %dx%d transform at %d bits\n", size, size, bitDepth);
+            // Steps scale with the sample range, as the transform trades precision for headroom
+            for (double baseStep : {1.0, 4.0, 16.0, 64.0}) {
+                double step = baseStep * (1 << (bitDepth - 8));
+                for (bool intra : {true, false}) {
+                    IntegerTransform::QuantTable table = transform.makeQuantTable(step, intra);
+                    double squaredError = 0;
+                    for (int b = 0; b < BLOCKS; ++b) {
+                        // Alternate full-range noise with smooth ramps, which exercise the zero runs
+                        int base = residual(rng), slope = residual(rng) / size;
+                        for (int i = 0; i < area; ++i) {
+                            block[i] = (b % 2) ? residual(rng)
+                                               : max(-range, min(range, base + slope * (i % size + i / size)));
+                        }
+
+                        transform.forward(block.data(), coeffs.data());
+                        transform.forwardScalar(block.data(), reference.data());
+                        check(coeffs == reference, "forward SSE2 vs scalar", size, bitDepth, step);
+
+                        transform.quantize(coeffs.data(), table, levels.data());
+                        transform.dequantize(levels.data(), table, dequantized.data());
+                        transform.inverse(dequantized.data(), decoded.data());
+                        transform.inverseScalar(dequantized.data(), decodedReference.data());
+                        check(decoded == decodedReference, "inverse SSE2 vs scalar", size, bitDepth, step);
+
+                        for (int i = 0; i < area; ++i) {
+                            double error = decoded[i] - block[i];
+                            squaredError += error * error;
+                        }
+                    }
+
+                    // The step is in the orthonormal domain, so the error must
+                    // stay within a uniform quantizer's, scaled by the largest
+                    // weighting matrix entry (42 / 16) and the dead zone
+                    double rmse = sqrt(squaredError / (double(BLOCKS) * area));
+                    double bound = step * (42.0 / 16.0) * 0.6 + 0.5;
+                    printf("  step %5.1f %s: rmse %.3f\n", step, intra ? "intra" : "inter", rmse);
+                    check(rmse <= bound, "reconstruction error", size, bitDepth, step);
+                }
+            }
+        }
+    }
+
+    // Lossless corner: with the finest step the round trip must be nearly exact
+    IntegerTransform fine(4);
+    IntegerTransform::QuantTable table = fine.makeQuantTable(0.25, false);
+    int block[16], coeffs[16], levels[16], decoded[16];
+    for (int i = 0; i < 16; ++i) block[i] = (i * 37) % 511 - 255;
+    fine.forward(block, coeffs);
+    fine.quantize(coeffs, table, levels);
+    fine.dequantize(levels, table, coeffs);
+    fine.inverse(coeffs, decoded);
+    for (int i = 0; i < 16; ++i) {
+        check(abs(decoded[i] - block[i]) <= 1, "fine step round trip", 4, 8, 0.25);
+    }
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("Passed integer transform round trips\n");
+    return 0;
+}